@@ -0,0 +1,1324 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Micro benchmarks of the tracefs library.
+ *
+ * Each benchmark builds the data it works on in a temporary directory,
+ * times the library code that consumes it, and prints one line per
+ * configuration on stdout.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <time.h>
+#include <ftw.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+
+#include <event-parse.h>
+
+#include "tracefs.h"
+
+#define BENCH_LOOPS	3
+
+struct bench {
+	const char	*name;
+	const char	*help;
+	int		(*run)(void);
+};
+
+static unsigned long long get_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static char *make_tmp_dir(void)
+{
+	char tmpl[] = "/tmp/tracefs-bench.XXXXXX";
+
+	if (!mkdtemp(tmpl)) {
+		perror("mkdtemp");
+		return NULL;
+	}
+	return strdup(tmpl);
+}
+
+static int remove_file(const char *path, const struct stat *st,
+		       int flag, struct FTW *ftw)
+{
+	return remove(path);
+}
+
+static void remove_tmp_dir(char *dir)
+{
+	if (!dir)
+		return;
+	nftw(dir, remove_file, 16, FTW_DEPTH | FTW_PHYS);
+	free(dir);
+}
+
+/*
+ * merge: the time it takes to merge the per CPU buffers by timestamp.
+ *
+ * Every CPU gets a trace_pipe_raw file of ring buffer sub-buffers
+ * holding one synthetic event. The timestamps are interleaved across
+ * the CPUs, so that every record read comes from a different CPU than
+ * the one before it, which is the worst case for picking the next CPU.
+ * The same sub-buffers are also written as a multiplexed recording, to
+ * time tracefs_iterate_raw_file().
+ */
+#define MERGE_PAGE_SIZE		4096
+#define MERGE_RECORDS		(1 << 20)
+
+/* The ring buffer page header: timestamp and commit (long size of 8) */
+#define MERGE_PAGE_HEADER	16
+
+/* Type len 1-28 of the event header is the data length in words */
+#define MERGE_EVENT_SIZE	(4 + sizeof(struct merge_record))
+
+struct merge_record {
+	unsigned short		common_type;
+	unsigned char		common_flags;
+	unsigned char		common_preempt_count;
+	int			common_pid;
+	unsigned long long	value;
+};
+
+#define MERGE_EVENT_ID		1
+
+#define MERGE_FILE		"trace.dat"
+
+static const char merge_event_format[] =
+	"name: bench\n"
+	"ID: 1\n"
+	"format:\n"
+	"\tfield:unsigned short common_type;\toffset:0;\tsize:2;\tsigned:0;\n"
+	"\tfield:unsigned char common_flags;\toffset:2;\tsize:1;\tsigned:0;\n"
+	"\tfield:unsigned char common_preempt_count;\toffset:3;\tsize:1;\tsigned:0;\n"
+	"\tfield:int common_pid;\toffset:4;\tsize:4;\tsigned:1;\n"
+	"\n"
+	"\tfield:unsigned long long value;\toffset:8;\tsize:8;\tsigned:0;\n"
+	"\n"
+	"print fmt: \"value=%llu\", REC->value\n";
+
+struct merge_count {
+	unsigned long long	last_ts;
+	int			records;
+	int			unordered;
+};
+
+static struct tep_handle *merge_tep(void)
+{
+	struct tep_handle *tep;
+
+	tep = tep_alloc();
+	if (!tep)
+		return NULL;
+
+	/* Without a header page, this sets the defaults for a long size of 8 */
+	tep_parse_header_page(tep, NULL, 0, 8);
+
+	if (tep_parse_event(tep, merge_event_format,
+			    sizeof(merge_event_format) - 1, "bench")) {
+		fprintf(stderr, "Failed to parse the bench event\n");
+		tep_free(tep);
+		return NULL;
+	}
+	return tep;
+}
+
+static int write_cpu_file(const char *path, int cpu, int cpus, int records)
+{
+	int per_page = (MERGE_PAGE_SIZE - MERGE_PAGE_HEADER) / MERGE_EVENT_SIZE;
+	struct merge_record rec = { .common_type = MERGE_EVENT_ID };
+	unsigned long long ts = 1000 + cpu;
+	unsigned long long commit;
+	char page[MERGE_PAGE_SIZE];
+	unsigned int header;
+	char *p;
+	int ret = -1;
+	int fd;
+	int i, n;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+
+	for (i = 0; i < records; i += n) {
+		n = records - i;
+		if (n > per_page)
+			n = per_page;
+
+		memset(page, 0, sizeof(page));
+		commit = n * MERGE_EVENT_SIZE;
+		memcpy(page, &ts, 8);
+		memcpy(page + 8, &commit, 8);
+
+		p = page + MERGE_PAGE_HEADER;
+		for (int r = 0; r < n; r++) {
+			/* The first event's delta is relative to the page timestamp */
+			header = (sizeof(rec) / 4) | ((r ? cpus : 0) << 5);
+			memcpy(p, &header, 4);
+			rec.value = i + r;
+			memcpy(p + 4, &rec, sizeof(rec));
+			p += MERGE_EVENT_SIZE;
+			ts += cpus;
+		}
+		/* ts is now the timestamp of the first event of the next page */
+
+		if (write(fd, page, sizeof(page)) != sizeof(page))
+			goto out;
+	}
+	ret = 0;
+ out:
+	close(fd);
+	return ret;
+}
+
+/* Write the sub-buffers of all the CPUs to one file, like a multiplexed recorder */
+static int write_mux_file(const char *dir, int cpus)
+{
+	struct {
+		unsigned int	cpu;
+		unsigned int	size;
+	} header = { .size = MERGE_PAGE_SIZE };
+	char page[MERGE_PAGE_SIZE];
+	char *path = NULL;
+	int *fds;
+	int ret = -1;
+	int fd = -1;
+	int pages;
+	int cpu;
+	int r;
+
+	fds = calloc(cpus, sizeof(*fds));
+	if (!fds)
+		return -1;
+	for (cpu = 0; cpu < cpus; cpu++)
+		fds[cpu] = -1;
+
+	for (cpu = 0; cpu < cpus; cpu++) {
+		free(path);
+		path = NULL;
+		if (asprintf(&path, "%s/per_cpu/cpu%d/trace_pipe_raw", dir, cpu) < 0)
+			goto out;
+		fds[cpu] = open(path, O_RDONLY);
+		if (fds[cpu] < 0)
+			goto out;
+	}
+
+	free(path);
+	path = NULL;
+	if (asprintf(&path, "%s/" MERGE_FILE, dir) < 0)
+		goto out;
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto out;
+
+	/* Round robin, as the recorder would have read them */
+	do {
+		pages = 0;
+		for (cpu = 0; cpu < cpus; cpu++) {
+			r = read(fds[cpu], page, sizeof(page));
+			if (r < 0)
+				goto out;
+			if (r != sizeof(page))
+				continue;
+			header.cpu = cpu;
+			if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+			    write(fd, page, sizeof(page)) != sizeof(page))
+				goto out;
+			pages++;
+		}
+	} while (pages);
+	ret = 0;
+ out:
+	if (fd >= 0)
+		close(fd);
+	for (cpu = 0; cpu < cpus; cpu++) {
+		if (fds[cpu] >= 0)
+			close(fds[cpu]);
+	}
+	free(fds);
+	free(path);
+	return ret;
+}
+
+static char *merge_create_dir(int cpus)
+{
+	char *path = NULL;
+	char *dir;
+	int cpu;
+
+	dir = make_tmp_dir();
+	if (!dir)
+		return NULL;
+
+	if (asprintf(&path, "%s/per_cpu", dir) < 0 || mkdir(path, 0755) < 0)
+		goto fail;
+
+	for (cpu = 0; cpu < cpus; cpu++) {
+		free(path);
+		path = NULL;
+		if (asprintf(&path, "%s/per_cpu/cpu%d", dir, cpu) < 0 ||
+		    mkdir(path, 0755) < 0)
+			goto fail;
+		free(path);
+		path = NULL;
+		if (asprintf(&path, "%s/per_cpu/cpu%d/trace_pipe_raw", dir, cpu) < 0 ||
+		    write_cpu_file(path, cpu, cpus, MERGE_RECORDS / cpus) < 0)
+			goto fail;
+	}
+	free(path);
+	path = NULL;
+	if (write_mux_file(dir, cpus) < 0)
+		goto fail;
+	return dir;
+ fail:
+	perror(path ? path : dir);
+	free(path);
+	remove_tmp_dir(dir);
+	return NULL;
+}
+
+static int merge_callback(struct tep_event *event, struct tep_record *record,
+			  int cpu, void *context)
+{
+	struct merge_count *count = context;
+
+	if (record->ts < count->last_ts)
+		count->unordered++;
+	count->last_ts = record->ts;
+	count->records++;
+	return 0;
+}
+
+static int merge_check(struct merge_count *count, int cpus, const char *what)
+{
+	if (count->records == (MERGE_RECORDS / cpus) * cpus && !count->unordered)
+		return 0;
+
+	fprintf(stderr, "merge: %s of %d CPUs read %d records (%d out of order)\n",
+		what, cpus, count->records, count->unordered);
+	return -1;
+}
+
+static int merge_run(struct tep_handle *tep, int cpus)
+{
+	struct tracefs_instance *instance = NULL;
+	unsigned long long start, best_buffers = 0, best_file = 0;
+	struct merge_count count;
+	char *file = NULL;
+	char *dir;
+	int ret = -1;
+	int i;
+
+	dir = merge_create_dir(cpus);
+	if (!dir)
+		return -1;
+
+	/* An instance on a directory that is not tracefs reads the files offline */
+	instance = tracefs_instance_alloc(dir, NULL);
+	if (!instance)
+		goto out;
+
+	if (asprintf(&file, "%s/" MERGE_FILE, dir) < 0) {
+		file = NULL;
+		goto out;
+	}
+
+	for (i = 0; i < BENCH_LOOPS; i++) {
+		memset(&count, 0, sizeof(count));
+		start = get_ns();
+		if (tracefs_iterate_raw_events(tep, instance, NULL, 0,
+					       merge_callback, &count) < 0) {
+			perror("tracefs_iterate_raw_events");
+			goto out;
+		}
+		start = get_ns() - start;
+		if (merge_check(&count, cpus, "buffers") < 0)
+			goto out;
+		if (!best_buffers || start < best_buffers)
+			best_buffers = start;
+
+		memset(&count, 0, sizeof(count));
+		start = get_ns();
+		if (tracefs_iterate_raw_file(tep, file, NULL, 0,
+					     merge_callback, &count) < 0) {
+			perror("tracefs_iterate_raw_file");
+			goto out;
+		}
+		start = get_ns() - start;
+		if (merge_check(&count, cpus, "file") < 0)
+			goto out;
+		if (!best_file || start < best_file)
+			best_file = start;
+	}
+
+	printf("merge: %4d CPUs %9d records %8.1f ns/record (buffers) %8.1f ns/record (file)\n",
+	       cpus, count.records, (double)best_buffers / count.records,
+	       (double)best_file / count.records);
+	ret = 0;
+ out:
+	tracefs_instance_free(instance);
+	remove_tmp_dir(dir);
+	free(file);
+	return ret;
+}
+
+static int bench_merge(void)
+{
+	static const int cpus[] = { 8, 64, 256 };
+	struct tep_handle *tep;
+	int ret = 0;
+	int i;
+
+	tep = merge_tep();
+	if (!tep)
+		return -1;
+
+	for (i = 0; i < sizeof(cpus) / sizeof(cpus[0]); i++) {
+		if (merge_run(tep, cpus[i]) < 0)
+			ret = -1;
+	}
+
+	tep_free(tep);
+	return ret;
+}
+
+/*
+ * dirent: the system calls it takes to list the event systems and the
+ * events of each system.
+ *
+ * The tracing directory is a fake one, with the events/ layout of
+ * tracefs and empty files. The walks are run in a child that is traced
+ * with ptrace(), to count its system calls, and separately untraced to
+ * time them. A child that does nothing is counted as well, and its
+ * system calls are subtracted.
+ */
+#define DIRENT_SYSTEMS		30
+#define DIRENT_EVENTS		50
+
+struct dirent_count {
+	int			syscalls;
+	int			lookups;
+	int			getdents;
+};
+
+static const char *dirent_files[] = { "enable", "filter", "format", "id", "trigger" };
+
+#define NR_DIRENT_FILES	(sizeof(dirent_files) / sizeof(dirent_files[0]))
+
+static int dirent_mkfiles(const char *dir)
+{
+	char *path;
+	int fd;
+	int i;
+
+	for (i = 0; i < NR_DIRENT_FILES; i++) {
+		if (asprintf(&path, "%s/%s", dir, dirent_files[i]) < 0)
+			return -1;
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		free(path);
+		if (fd < 0)
+			return -1;
+		close(fd);
+	}
+	return 0;
+}
+
+static char *dirent_create_dir(void)
+{
+	char *path = NULL;
+	char *dir;
+	int s, e;
+
+	dir = make_tmp_dir();
+	if (!dir)
+		return NULL;
+
+	if (asprintf(&path, "%s/events", dir) < 0 || mkdir(path, 0755) < 0 ||
+	    dirent_mkfiles(path) < 0)
+		goto fail;
+
+	for (s = 0; s < DIRENT_SYSTEMS; s++) {
+		free(path);
+		path = NULL;
+		if (asprintf(&path, "%s/events/sys%d", dir, s) < 0 ||
+		    mkdir(path, 0755) < 0 || dirent_mkfiles(path) < 0)
+			goto fail;
+		for (e = 0; e < DIRENT_EVENTS; e++) {
+			free(path);
+			path = NULL;
+			if (asprintf(&path, "%s/events/sys%d/event%d", dir, s, e) < 0 ||
+			    mkdir(path, 0755) < 0 || dirent_mkfiles(path) < 0)
+				goto fail;
+		}
+	}
+	free(path);
+	return dir;
+ fail:
+	perror(path ? path : dir);
+	free(path);
+	remove_tmp_dir(dir);
+	return NULL;
+}
+
+/* Returns the number of events found, or -1 on error */
+static int dirent_walk(const char *dir)
+{
+	char **systems;
+	char **events;
+	int count = 0;
+	int s, e;
+
+	systems = tracefs_event_systems(dir);
+	if (!systems)
+		return -1;
+
+	for (s = 0; systems[s]; s++) {
+		events = tracefs_system_events(dir, systems[s]);
+		if (!events)
+			continue;
+		for (e = 0; events[e]; e++)
+			count++;
+		tracefs_list_free(events);
+	}
+	tracefs_list_free(systems);
+	return count;
+}
+
+static bool dirent_is_lookup(long nr)
+{
+	switch (nr) {
+#ifdef SYS_open
+	case SYS_open:
+#endif
+#ifdef SYS_stat
+	case SYS_stat:
+#endif
+#ifdef SYS_lstat
+	case SYS_lstat:
+#endif
+#ifdef SYS_access
+	case SYS_access:
+#endif
+#ifdef SYS_newfstatat
+	case SYS_newfstatat:
+#endif
+#ifdef SYS_fstatat64
+	case SYS_fstatat64:
+#endif
+#ifdef SYS_statx
+	case SYS_statx:
+#endif
+#ifdef SYS_faccessat2
+	case SYS_faccessat2:
+#endif
+	case SYS_openat:
+	case SYS_faccessat:
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Count the system calls of the child from its first stop until it
+ * exits. With PTRACE_O_TRACESYSGOOD, every system call stops the child
+ * twice, on entry and on exit.
+ */
+static int dirent_trace(const char *dir, bool walk, struct dirent_count *count)
+{
+#ifdef PTRACE_GET_SYSCALL_INFO
+	struct __ptrace_syscall_info info;
+#endif
+	int status;
+	int sig = 0;
+	pid_t pid;
+
+	memset(count, 0, sizeof(*count));
+
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (!pid) {
+		if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0)
+			_exit(1);
+		raise(SIGSTOP);
+		if (walk && dirent_walk(dir) < 0)
+			_exit(1);
+		_exit(0);
+	}
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status))
+		return -1;
+	ptrace(PTRACE_SETOPTIONS, pid, NULL,
+	       (void *)(PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL));
+
+	for (;;) {
+		if (ptrace(PTRACE_SYSCALL, pid, NULL, (void *)(long)sig) < 0)
+			return -1;
+		if (waitpid(pid, &status, 0) < 0)
+			return -1;
+		if (WIFEXITED(status) || WIFSIGNALED(status))
+			break;
+		sig = 0;
+		if (WSTOPSIG(status) != (SIGTRAP | 0x80)) {
+			sig = WSTOPSIG(status);
+			continue;
+		}
+#ifdef PTRACE_GET_SYSCALL_INFO
+		if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, (void *)sizeof(info), &info) < 0 ||
+		    info.op != PTRACE_SYSCALL_INFO_ENTRY)
+			continue;
+		if (dirent_is_lookup(info.entry.nr))
+			count->lookups++;
+		if (info.entry.nr == SYS_getdents64)
+			count->getdents++;
+#endif
+		count->syscalls++;
+	}
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		return -1;
+#ifndef PTRACE_GET_SYSCALL_INFO
+	count->syscalls /= 2;
+#endif
+	return 0;
+}
+
+static int bench_dirent(void)
+{
+	struct dirent_count base, walk;
+	unsigned long long start, best = 0;
+	char *dir;
+	int ret = -1;
+	int events;
+	int i;
+
+	dir = dirent_create_dir();
+	if (!dir)
+		return -1;
+
+	if (dirent_trace(dir, false, &base) < 0 ||
+	    dirent_trace(dir, true, &walk) < 0) {
+		fprintf(stderr, "dirent: failed to trace the walk\n");
+		goto out;
+	}
+
+	for (i = 0; i < BENCH_LOOPS; i++) {
+		start = get_ns();
+		events = dirent_walk(dir);
+		start = get_ns() - start;
+		if (events != DIRENT_SYSTEMS * DIRENT_EVENTS) {
+			fprintf(stderr, "dirent: found %d events of %d\n",
+				events, DIRENT_SYSTEMS * DIRENT_EVENTS);
+			goto out;
+		}
+		if (!best || start < best)
+			best = start;
+	}
+
+	printf("dirent: %d systems %d events %6d syscalls (%d path lookups, %d getdents64) %8.1f us\n",
+	       DIRENT_SYSTEMS, events, walk.syscalls - base.syscalls,
+	       walk.lookups - base.lookups, walk.getdents - base.getdents,
+	       best / 1000.0);
+	ret = 0;
+ out:
+	remove_tmp_dir(dir);
+	return ret;
+}
+
+/*
+ * printf: the cost of a tracefs_printf() marker, next to formatting it
+ * with vasprintf() and writing it with write(), which is what the
+ * library used to do.
+ *
+ * The markers go to an instance on a temporary directory whose
+ * trace_marker is /dev/null, which leaves out the cost of the ring
+ * buffer. When tracefs is mounted and writable, they also go to the
+ * trace_marker of a new instance.
+ */
+#define PRINTF_MARKERS		(1 << 19)
+#define PRINTF_INSTANCE		"tracefs_bench"
+
+struct printf_thread {
+	struct tracefs_instance	*instance;
+	pthread_t		thread;
+	int			fd;
+	bool			reference;
+	int			markers;
+	int			failed;
+};
+
+static int reference_printf(int fd, const char *fmt, ...)
+{
+	char *str;
+	va_list ap;
+	int ret;
+
+	va_start(ap, fmt);
+	ret = vasprintf(&str, fmt, ap);
+	va_end(ap);
+	if (ret < 0)
+		return -1;
+	ret = write(fd, str, strlen(str));
+	free(str);
+	return ret < 0 ? -1 : 0;
+}
+
+static void *printf_thread(void *data)
+{
+	struct printf_thread *pt = data;
+	int ret;
+	int i;
+
+	for (i = 0; i < pt->markers; i++) {
+		if (pt->reference)
+			ret = reference_printf(pt->fd, "bench marker %d of %s: %llu",
+					       i, "tracefs", (unsigned long long)pt->thread);
+		else
+			ret = tracefs_printf(pt->instance, "bench marker %d of %s: %llu",
+					     i, "tracefs", (unsigned long long)pt->thread);
+		if (ret < 0)
+			pt->failed++;
+	}
+	return NULL;
+}
+
+/* Returns the wall time per marker in ns, or a negative value on error */
+static double printf_run(struct tracefs_instance *instance, int fd,
+			 int threads, bool reference)
+{
+	struct printf_thread pt[threads];
+	unsigned long long start, best = 0;
+	int failed;
+	int l, t;
+
+	for (l = 0; l < BENCH_LOOPS; l++) {
+		failed = 0;
+		start = get_ns();
+		for (t = 0; t < threads; t++) {
+			memset(&pt[t], 0, sizeof(pt[t]));
+			pt[t].instance = instance;
+			pt[t].fd = fd;
+			pt[t].reference = reference;
+			pt[t].markers = PRINTF_MARKERS / threads;
+			if (pthread_create(&pt[t].thread, NULL, printf_thread, &pt[t]))
+				return -1;
+		}
+		for (t = 0; t < threads; t++) {
+			pthread_join(pt[t].thread, NULL);
+			failed += pt[t].failed;
+		}
+		start = get_ns() - start;
+		if (failed) {
+			fprintf(stderr, "printf: %d markers failed\n", failed);
+			return -1;
+		}
+		if (!best || start < best)
+			best = start;
+	}
+	return (double)best / ((PRINTF_MARKERS / threads) * threads);
+}
+
+static int printf_sink(struct tracefs_instance *instance, const char *sink)
+{
+	static const int threads[] = { 1, 4 };
+	double lib, ref;
+	int ret = -1;
+	int fd;
+	int i;
+
+	if (tracefs_print_init(instance) < 0) {
+		perror("tracefs_print_init");
+		return -1;
+	}
+	fd = tracefs_instance_file_open(instance, "trace_marker", O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror("trace_marker");
+		goto out;
+	}
+
+	for (i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+		lib = printf_run(instance, fd, threads[i], false);
+		ref = printf_run(instance, fd, threads[i], true);
+		if (lib < 0 || ref < 0)
+			goto out;
+		printf("printf: %-10s %d threads %8.1f ns/marker (tracefs_printf) %8.1f ns/marker (vasprintf + write)\n",
+		       sink, threads[i], lib, ref);
+	}
+	ret = 0;
+ out:
+	if (fd >= 0)
+		close(fd);
+	tracefs_print_close(instance);
+	return ret;
+}
+
+static int bench_printf(void)
+{
+	struct tracefs_instance *instance = NULL;
+	char *path = NULL;
+	char *dir;
+	int ret = -1;
+
+	dir = make_tmp_dir();
+	if (!dir)
+		return -1;
+
+	if (asprintf(&path, "%s/trace_marker", dir) < 0) {
+		path = NULL;
+		goto out;
+	}
+	if (symlink("/dev/null", path) < 0) {
+		perror(path);
+		goto out;
+	}
+
+	instance = tracefs_instance_alloc(dir, NULL);
+	if (!instance || printf_sink(instance, "/dev/null") < 0)
+		goto out;
+	tracefs_instance_free(instance);
+	instance = NULL;
+
+	ret = 0;
+	if (geteuid() || !tracefs_tracing_dir())
+		goto out;
+
+	instance = tracefs_instance_create(PRINTF_INSTANCE);
+	if (!instance) {
+		perror(PRINTF_INSTANCE);
+		ret = -1;
+		goto out;
+	}
+	if (printf_sink(instance, "tracefs") < 0)
+		ret = -1;
+	tracefs_instance_destroy(instance);
+ out:
+	tracefs_instance_free(instance);
+	remove_tmp_dir(dir);
+	free(path);
+	return ret;
+}
+
+/*
+ * stream: the throughput of the streamer, from the trace_pipe of an
+ * instance to /dev/null, to a file on tmpfs, and to a file on tmpfs
+ * opened with O_APPEND, which can not be spliced to and is copied.
+ *
+ * The trace_pipe is a FIFO in a temporary directory, fed by a thread
+ * until it closes it, which ends the stream. Each sink is run with the
+ * default sizes, with 1 megabyte pipes and buffers, and adaptive, with
+ * epoll and with io_uring.
+ */
+#define STREAM_BYTES		(256ULL << 20)
+#define STREAM_CHUNK		(64 << 10)
+#define STREAM_SIZE		(1 << 20)
+#define STREAM_SHM		"/dev/shm"
+
+struct stream_feed {
+	pthread_t		thread;
+	const char		*fifo;
+	int			failed;
+};
+
+static void *stream_feed(void *data)
+{
+	struct stream_feed *feed = data;
+	unsigned long long n;
+	static char buf[STREAM_CHUNK];
+	int fd;
+
+	memset(buf, 'x', sizeof(buf));
+	fd = open(feed->fifo, O_WRONLY);
+	if (fd < 0) {
+		feed->failed = 1;
+		return NULL;
+	}
+	for (n = 0; n < STREAM_BYTES; n += sizeof(buf)) {
+		if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+			feed->failed = 1;
+			break;
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+struct stream_mode {
+	const char		*name;
+	int			pipe_size;
+	int			buf_size;
+	unsigned int		flags;
+};
+
+static const struct stream_mode stream_modes[] = {
+	{ "default",	0,		0,		0 },
+	{ "1M",		STREAM_SIZE,	STREAM_SIZE,	0 },
+	{ "adaptive",	0,		0,		TRACEFS_STREAM_ADAPTIVE },
+};
+
+static int stream_run(const char *dir, const char *sink, const char *out,
+		      int oflags, const struct stream_mode *mode, bool uring)
+{
+	struct tracefs_streamer_stat stat;
+	struct tracefs_streamer *streamer;
+	struct tracefs_instance *instance;
+	struct stream_feed feed = { };
+	unsigned long long start;
+	char *fifo = NULL;
+	ssize_t bytes;
+	int ret = -1;
+	int fd;
+
+	instance = tracefs_instance_alloc(dir, NULL);
+	streamer = tracefs_streamer_alloc();
+	if (!instance || !streamer)
+		goto out;
+
+	if (uring && tracefs_streamer_use_uring(streamer) < 0) {
+		/* Not an error, the library or the kernel has no io_uring */
+		ret = 0;
+		goto out;
+	}
+	tracefs_streamer_set_sizes(streamer, mode->pipe_size, mode->buf_size,
+				   mode->flags);
+
+	if (asprintf(&fifo, "%s/trace_pipe", dir) < 0) {
+		fifo = NULL;
+		goto out;
+	}
+	/* The streamer may open the FIFO blocking, the writer must be there */
+	feed.fifo = fifo;
+	if (pthread_create(&feed.thread, NULL, stream_feed, &feed))
+		goto out;
+
+	fd = open(out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | oflags, 0644);
+	if (fd < 0 || tracefs_streamer_add(streamer, instance, fd) < 0) {
+		perror(out);
+		if (fd >= 0)
+			close(fd);
+		/* Release the writer */
+		fd = open(fifo, O_RDONLY | O_NONBLOCK);
+		pthread_join(feed.thread, NULL);
+		if (fd >= 0)
+			close(fd);
+		goto out;
+	}
+	close(fd);
+
+	start = get_ns();
+	bytes = tracefs_streamer_run(streamer);
+	start = get_ns() - start;
+	pthread_join(feed.thread, NULL);
+
+	if (bytes != STREAM_BYTES || feed.failed) {
+		fprintf(stderr, "stream: %s moved %zd bytes of %llu\n",
+			sink, bytes, STREAM_BYTES);
+		goto out;
+	}
+
+	tracefs_streamer_stat(streamer, 0, &stat);
+	printf("stream: %-16s %-8s %-8s %7.0f MB/s (pipe %d, buffer %d)\n",
+	       sink, mode->name, uring ? "io_uring" : "epoll",
+	       STREAM_BYTES / (start / 1000000000.0) / (1 << 20),
+	       stat.pipe_size, stat.buf_size);
+	ret = 0;
+ out:
+	tracefs_streamer_free(streamer);
+	tracefs_instance_free(instance);
+	free(fifo);
+	return ret;
+}
+
+static int bench_stream(void)
+{
+	struct stat st;
+	char *fifo = NULL;
+	char *out = NULL;
+	char *dir;
+	int ret = -1;
+	int m, u;
+
+	/* A writer left without a reader on an error must not be killed */
+	signal(SIGPIPE, SIG_IGN);
+
+	dir = make_tmp_dir();
+	if (!dir)
+		return -1;
+
+	if (asprintf(&fifo, "%s/trace_pipe", dir) < 0) {
+		fifo = NULL;
+		goto out;
+	}
+	if (mkfifo(fifo, 0600) < 0) {
+		perror(fifo);
+		goto out;
+	}
+
+	/* The temporary directory may not be on tmpfs */
+	if (stat(STREAM_SHM, &st) == 0 && S_ISDIR(st.st_mode))
+		ret = asprintf(&out, STREAM_SHM "/tracefs-bench.%d", getpid());
+	else
+		ret = asprintf(&out, "%s/out", dir);
+	if (ret < 0) {
+		out = NULL;
+		goto out;
+	}
+
+	ret = 0;
+	for (u = 0; u < 2; u++) {
+		for (m = 0; m < sizeof(stream_modes) / sizeof(stream_modes[0]); m++) {
+			if (stream_run(dir, "/dev/null", "/dev/null", 0,
+				       &stream_modes[m], u) < 0 ||
+			    stream_run(dir, "tmpfs", out, 0,
+				       &stream_modes[m], u) < 0 ||
+			    stream_run(dir, "tmpfs O_APPEND", out, O_APPEND,
+				       &stream_modes[m], u) < 0)
+				ret = -1;
+		}
+	}
+	unlink(out);
+ out:
+	free(out);
+	free(fifo);
+	remove_tmp_dir(dir);
+	return ret;
+}
+
+/*
+ * filter: the write() calls it takes to set the function filter, next to
+ * writing it one word per write(), which is what the library used to do.
+ *
+ * The tracing directory is a fake one, with synthetic functions in
+ * available_filter_functions, and a regular file as set_ftrace_filter,
+ * that takes whole buffers where the kernel takes one word per write().
+ * The library only reads the functions of the mounted tracing directory,
+ * so the fake one is bind mounted over it, in a child that has its own
+ * mount namespace. This needs root.
+ *
+ * The whole list is written as indexes, and so are the functions that a
+ * glob matches, one in FILTER_GLOB_EVERY. The time of the library includes
+ * matching the functions, the one word per write() only writes the words
+ * that the library wrote.
+ */
+#define FILTER_FUNCS		100000
+#define FILTER_GLOB_EVERY	10
+
+struct filter_mode {
+	const char		*name;
+	const char		*filter;
+};
+
+static const struct filter_mode filter_modes[] = {
+	{ "index list",	"*" },
+	{ "glob",	"sched_*" },
+};
+
+static char *filter_create_dir(void)
+{
+	char *path = NULL;
+	FILE *fp = NULL;
+	char *dir;
+	int fd;
+	int i;
+
+	dir = make_tmp_dir();
+	if (!dir)
+		return NULL;
+
+	if (asprintf(&path, "%s/available_filter_functions", dir) < 0) {
+		path = NULL;
+		goto fail;
+	}
+	fp = fopen(path, "w");
+	if (!fp)
+		goto fail;
+	for (i = 0; i < FILTER_FUNCS; i++)
+		fprintf(fp, "%s_func_%d\n", i % FILTER_GLOB_EVERY ? "bench" : "sched", i);
+	if (fclose(fp))
+		goto fail;
+
+	free(path);
+	if (asprintf(&path, "%s/set_ftrace_filter", dir) < 0) {
+		path = NULL;
+		goto fail;
+	}
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto fail;
+	close(fd);
+
+	free(path);
+	return dir;
+ fail:
+	perror(path ? path : dir);
+	free(path);
+	remove_tmp_dir(dir);
+	return NULL;
+}
+
+/* The write() calls (and the like) the thread made, or -1 if unknown */
+static long long filter_writes(void)
+{
+	long long writes = -1;
+	char line[64];
+	FILE *fp;
+
+	fp = fopen("/proc/thread-self/io", "r");
+	if (!fp)
+		return -1;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "syscw: %lld", &writes) == 1)
+			break;
+	}
+	fclose(fp);
+	return writes;
+}
+
+/* Write @words one per write(), with the space that ends each one */
+static int filter_reference(const char *path, const char *words)
+{
+	const char *word, *end;
+	int ret = 0;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_TRUNC | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	for (word = words; *word; word = end) {
+		end = strchr(word, ' ');
+		end = end ? end + 1 : word + strlen(word);
+		if (write(fd, word, end - word) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+	close(fd);
+	return ret;
+}
+
+static int filter_run(const char *path, const struct filter_mode *mode)
+{
+	unsigned long long start, lib = 0, ref = 0;
+	long long lib_writes, ref_writes;
+	struct stat st;
+	char *words;
+	int nr = 0;
+	int fd;
+	int i;
+
+	for (i = 0; i < BENCH_LOOPS; i++) {
+		lib_writes = filter_writes();
+		start = get_ns();
+		if (tracefs_function_filter(NULL, mode->filter, NULL, TRACEFS_FL_RESET)) {
+			fprintf(stderr, "filter: %s failed\n", mode->name);
+			return -1;
+		}
+		start = get_ns() - start;
+		lib_writes = filter_writes() - lib_writes;
+		if (!lib || start < lib)
+			lib = start;
+	}
+
+	/* Write again what the library wrote */
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	words = malloc(st.st_size + 1);
+	if (!words || read(fd, words, st.st_size) != st.st_size) {
+		close(fd);
+		free(words);
+		return -1;
+	}
+	close(fd);
+	words[st.st_size] = 0;
+	for (i = 0; i < st.st_size; i++) {
+		if (words[i] == ' ')
+			nr++;
+	}
+
+	for (i = 0; i < BENCH_LOOPS; i++) {
+		ref_writes = filter_writes();
+		start = get_ns();
+		if (filter_reference(path, words) < 0) {
+			perror(path);
+			free(words);
+			return -1;
+		}
+		start = get_ns() - start;
+		ref_writes = filter_writes() - ref_writes;
+		if (!ref || start < ref)
+			ref = start;
+	}
+	free(words);
+
+	printf("filter: %-10s %6d words %6lld writes %8.1f us (tracefs_function_filter) %6lld writes %8.1f us (one write per word)\n",
+	       mode->name, nr, lib_writes, lib / 1000.0, ref_writes, ref / 1000.0);
+	return 0;
+}
+
+/* Runs in the child, with the fake directory @dir over the tracing directory */
+static int filter_child(const char *dir)
+{
+	const char *tracing;
+	char *path;
+	int ret = 0;
+	int i;
+
+	if (unshare(CLONE_NEWNS) < 0 ||
+	    mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) < 0 ||
+	    !(tracing = tracefs_tracing_dir()) ||
+	    mount(dir, tracing, NULL, MS_BIND, NULL) < 0) {
+		fprintf(stderr, "filter: skipped, needs root and tracefs mounted\n");
+		return 0;
+	}
+
+	if (filter_writes() < 0) {
+		fprintf(stderr, "filter: skipped, no /proc/thread-self/io to count the writes\n");
+		return 0;
+	}
+
+	if (asprintf(&path, "%s/set_ftrace_filter", dir) < 0)
+		return -1;
+	for (i = 0; i < sizeof(filter_modes) / sizeof(filter_modes[0]); i++) {
+		if (filter_run(path, &filter_modes[i]) < 0)
+			ret = -1;
+	}
+	free(path);
+	return ret;
+}
+
+static int bench_filter(void)
+{
+	int status;
+	int ret = -1;
+	char *dir;
+	pid_t pid;
+
+	dir = filter_create_dir();
+	if (!dir)
+		return -1;
+
+	/* Do not print what is buffered twice */
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0)
+		goto out;
+	if (!pid) {
+		ret = filter_child(dir);
+		fflush(stdout);
+		_exit(ret ? 1 : 0);
+	}
+
+	if (waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+	    !WEXITSTATUS(status))
+		ret = 0;
+ out:
+	remove_tmp_dir(dir);
+	return ret;
+}
+
+static struct bench benchmarks[] = {
+	{ "merge", "merge the per CPU raw buffers of 8, 64 and 256 CPUs", bench_merge },
+	{ "dirent", "count the system calls of listing the events", bench_dirent },
+	{ "printf", "write markers with tracefs_printf()", bench_printf },
+	{ "stream", "stream a trace_pipe to /dev/null and to tmpfs", bench_stream },
+	{ "filter", "count the writes of setting the function filter", bench_filter },
+};
+
+#define NR_BENCHMARKS	(sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static void print_help(char **argv)
+{
+	int i;
+
+	printf("Usage: %s [OPTIONS] [benchmark ...]\n", basename(argv[0]));
+	printf("\t-h, --help\tPrint usage information\n");
+	printf("\nBenchmarks (all of them are run by default):\n");
+	for (i = 0; i < NR_BENCHMARKS; i++)
+		printf("\t%-10s%s\n", benchmarks[i].name, benchmarks[i].help);
+	exit(0);
+}
+
+static struct bench *find_bench(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NR_BENCHMARKS; i++) {
+		if (strcmp(benchmarks[i].name, name) == 0)
+			return &benchmarks[i];
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench *bench;
+	int ret = 0;
+	int i;
+
+	for (;;) {
+		int c;
+		int index = 0;
+		const char *opts = "+h";
+		static struct option long_options[] = {
+			{"help", no_argument, NULL, 'h'},
+			{NULL, 0, NULL, 0}
+		};
+
+		c = getopt_long (argc, argv, opts, long_options, &index);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'h':
+		default:
+			print_help(argv);
+			break;
+		}
+	}
+
+	for (i = optind; i < argc; i++) {
+		if (!find_bench(argv[i])) {
+			fprintf(stderr, "Unknown benchmark '%s', see -h\n", argv[i]);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < NR_BENCHMARKS; i++) {
+		bench = &benchmarks[i];
+		if (optind < argc) {
+			int a;
+
+			for (a = optind; a < argc; a++) {
+				if (strcmp(argv[a], bench->name) == 0)
+					break;
+			}
+			if (a == argc)
+				continue;
+		}
+		if (bench->run() < 0) {
+			fprintf(stderr, "%s: failed\n", bench->name);
+			ret = 1;
+		}
+	}
+
+	return ret;
+}
@@ -6,6 +6,8 @@
 #ifndef _TRACE_FS_LOCAL_H
 #define _TRACE_FS_LOCAL_H
 
+#include <dirent.h>
+
 #define __hidden __attribute__((visibility ("hidden")))
 #define __weak __attribute__((weak))
 
@@ -19,6 +21,32 @@ struct tracefs_options_mask {
 	unsigned long long	mask;
 };
 
+struct follow_event {
+	struct tep_event	*event;
+	void			*callback_data;
+	int (*callback)(struct tep_event *,
+			struct tep_record *,
+			int, void *);
+};
+
+/* Number of control files kept open per instance */
+#define NR_CACHED_FILES		8
+
+struct cached_file {
+	char				*file;
+	int				fd;
+};
+
+struct file_cache {
+	struct cached_file		files[NR_CACHED_FILES];
+	/* The tracing directory the files were opened in, for the top one */
+	char				*tracing_dir;
+	/* The next entry to replace when all are used */
+	int				next;
+	/* Set by tracefs_instance_file_cache_init() */
+	bool				enabled;
+};
+
 struct tracefs_instance {
 	struct tracefs_options_mask	supported_opts;
 	struct tracefs_options_mask	enabled_opts;
@@ -31,6 +59,9 @@ struct tracefs_instance {
 	int				ftrace_notrace_fd;
 	int				ftrace_marker_fd;
 	int				ftrace_marker_raw_fd;
+	struct follow_event		*followers;
+	int				nr_followers;
+	struct file_cache		file_cache;
 	bool				pipe_keep_going;
 	bool				iterate_keep_going;
 };
@@ -50,7 +81,14 @@ void tracefs_warning(const char *fmt, ...);
 
 int str_read_file(const char *file, char **buffer, bool warn);
 char *trace_append_file(const char *dir, const char *name);
+DIR *trace_opendir_at(int dfd, const char *path);
+bool trace_dirent_is_dir(DIR *dir, struct dirent *dent);
+bool trace_dirent_has_file(DIR *dir, struct dirent *dent, const char *file);
+unsigned long long trace_hash_file(const char *path, bool names_only);
+char *trace_kernel_id(void);
+int trace_load_kallsyms(struct tep_handle *tep);
 char *trace_find_tracing_dir(void);
+bool trace_splice_safe(int fd, int pfd);
 
 #ifndef ACCESSPERMS
 #define ACCESSPERMS (S_IRWXU|S_IRWXG|S_IRWXO) /* 0777 */
@@ -85,6 +123,81 @@ int trace_append_filter(char **filter, unsigned int *state,
 			enum tracefs_compare compare,
 			 const char *val);
 
+struct kbuffer;
+void *trace_mmap(int fd, struct kbuffer *kbuf);
+void trace_unmap(void *mapping);
+int trace_mmap_load_subbuf(void *mapping, struct kbuffer *kbuf);
+int trace_mmap_subbuf_size(void *mapping);
+int trace_mmap_copy_subbuf(void *mapping, struct kbuffer *kbuf, void *buf, int size);
+
+/* A sub-buffer in a recorded file */
+struct trace_file_page {
+	size_t offset;
+	int size;
+};
+
+struct cpu_iterate {
+	struct tep_record record;
+	struct tep_event *event;
+	/* If set, only the events in this table, indexed by id, are read */
+	struct tep_event **events;
+	int nr_events;
+	struct kbuffer *kbuf;
+	/* Loads the events that are not in the tep yet, if set */
+	struct tracefs_lazy_events *lazy;
+	void *mapping;
+	void *page;
+	/* The sub-buffers of a recording, read from a mapping of the file */
+	struct trace_file_page *file_pages;
+	void *file_map;
+	/* Only set if the mapping belongs to this CPU */
+	size_t file_size;
+	int nr_file_pages;
+	int next_file_page;
+	bool offline;
+	int psize;
+	int rsize;
+	int cpu;
+	int fd;
+};
+
+int trace_instance_subbuf_size(struct tracefs_instance *instance);
+int trace_cpu_iterate_open(struct cpu_iterate *cpu_iter, const char *per_cpu,
+			   int cpu, int subbuf_size, bool nonblock);
+void trace_cpu_iterate_close(struct cpu_iterate *cpu_iter);
+int trace_open_cpu_files(struct tracefs_instance *instance, cpu_set_t *cpus,
+			 int cpu_size, struct cpu_iterate **all_cpus, int *count);
+void trace_close_cpu_files(struct cpu_iterate *all_cpus, int count);
+int trace_read_cpu_pages(struct tep_handle *tep, struct cpu_iterate *cpus, int count,
+			 int (*callback)(struct tep_event *,
+					 struct tep_record *,
+					 int, void *),
+			 void *callback_context,
+			 bool *keep_going);
+int read_next_page(struct tep_handle *tep, struct cpu_iterate *cpu);
+int read_next_record(struct tep_handle *tep, struct cpu_iterate *cpu);
+struct tracefs_lazy_events *trace_lazy_events(struct tep_handle *tep);
+void trace_put_lazy_events(struct tracefs_lazy_events *lazy);
+
+struct trace_uring;
+struct trace_uring *trace_uring_alloc(unsigned int entries, int nr_files,
+				      int nr_buffers);
+void trace_uring_free(struct trace_uring *ring);
+int trace_uring_fd(struct trace_uring *ring);
+int trace_uring_set_file(struct trace_uring *ring, int slot, int fd);
+int trace_uring_set_buffer(struct trace_uring *ring, int slot,
+			   void *buf, size_t size);
+int trace_uring_splice(struct trace_uring *ring, int in, int out,
+		       unsigned int len, bool fixed, unsigned long long data);
+int trace_uring_rw(struct trace_uring *ring, bool write, int fd,
+		   bool fixed, void *buf, unsigned int len,
+		   int buf_slot, unsigned long long data);
+int trace_uring_poll(struct trace_uring *ring, int fd, bool fixed,
+		     unsigned int events, unsigned long long data);
+int trace_uring_cancel(struct trace_uring *ring, unsigned long long data);
+int trace_uring_submit(struct trace_uring *ring, int timeout);
+int trace_uring_reap(struct trace_uring *ring, unsigned long long *data, int *res);
+
 struct tracefs_synth *synth_init_from(struct tep_handle *tep,
 				      const char *start_system,
 				      const char *start_event);
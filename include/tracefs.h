@@ -34,6 +34,8 @@ int tracefs_instance_file_write(struct tracefs_instance *instance,
 				const char *file, const char *str);
 int tracefs_instance_file_append(struct tracefs_instance *instance,
 				 const char *file, const char *str);
+int tracefs_instance_file_cache_init(struct tracefs_instance *instance);
+void tracefs_instance_file_cache_close(struct tracefs_instance *instance);
 int tracefs_instance_file_clear(struct tracefs_instance *instance,
 				const char *file);
 char *tracefs_instance_file_read(struct tracefs_instance *instance,
@@ -90,6 +92,40 @@ int tracefs_binary_init(struct tracefs_instance *instance);
 int tracefs_binary_write(struct tracefs_instance *instance, void *data, int len);
 void tracefs_binary_close(struct tracefs_instance *instance);
 
+/* typed binary data */
+enum tracefs_marker_type {
+	TRACEFS_MARKER_U8,
+	TRACEFS_MARKER_S8,
+	TRACEFS_MARKER_U16,
+	TRACEFS_MARKER_S16,
+	TRACEFS_MARKER_U32,
+	TRACEFS_MARKER_S32,
+	TRACEFS_MARKER_U64,
+	TRACEFS_MARKER_S64,
+	TRACEFS_MARKER_STRING,
+};
+
+struct tracefs_marker_schema;
+struct tracefs_marker_schema *tracefs_marker_schema_alloc(unsigned int id,
+							 const char *name);
+void tracefs_marker_schema_free(struct tracefs_marker_schema *schema);
+int tracefs_marker_schema_add_field(struct tracefs_marker_schema *schema,
+				    const char *name,
+				    enum tracefs_marker_type type, int len);
+int tracefs_marker_schema_write(struct tracefs_instance *instance,
+				struct tracefs_marker_schema *schema, ...);
+struct tracefs_marker_schema *
+tracefs_marker_schema_find(struct tep_handle *tep, struct tep_record *record);
+int tracefs_marker_schema_read(struct tracefs_marker_schema *schema,
+			       struct tep_handle *tep, struct tep_record *record,
+			       const char *name, unsigned long long *val);
+int tracefs_marker_schema_read_string(struct tracefs_marker_schema *schema,
+				      struct tep_handle *tep,
+				      struct tep_record *record,
+				      const char *name, const char **str);
+int tracefs_marker_schema_print(struct trace_seq *seq, struct tep_handle *tep,
+				struct tep_record *record);
+
 /* events */
 char **tracefs_event_systems(const char *tracing_dir);
 char **tracefs_system_events(const char *tracing_dir, const char *system);
@@ -101,6 +137,87 @@ int tracefs_iterate_raw_events(struct tep_handle *tep,
 						int, void *),
 				void *callback_context);
 void tracefs_iterate_stop(struct tracefs_instance *instance);
+int tracefs_follow_event(struct tep_handle *tep, struct tracefs_instance *instance,
+			 const char *system, const char *event_name,
+			 int (*callback)(struct tep_event *,
+					 struct tep_record *,
+					 int, void *),
+			 void *callback_data);
+int tracefs_follow_event_clear(struct tracefs_instance *instance,
+			       const char *system, const char *event_name);
+
+/*
+ * UNORDERED	- Do not merge the per CPU buffers by timestamp, call the
+ *		  callback directly from the per CPU threads.
+ */
+enum {
+	TRACEFS_ITERATE_UNORDERED	= (1 << 0),
+};
+
+int tracefs_iterate_raw_events_parallel(struct tep_handle *tep,
+					struct tracefs_instance *instance,
+					cpu_set_t *cpus, int cpu_size,
+					unsigned int flags,
+					int (*callback)(struct tep_event *,
+							struct tep_record *,
+							int, void *),
+					void *callback_context);
+int tracefs_iterate_raw_events_batch(struct tep_handle *tep,
+				     struct tracefs_instance *instance,
+				     cpu_set_t *cpus, int cpu_size,
+				     int batch_size,
+				     int (*callback)(struct tep_event **,
+						     struct tep_record *,
+						     int, void *),
+				     void *callback_context);
+
+struct tracefs_iterator;
+struct tracefs_iterator *tracefs_iterator_open(struct tep_handle *tep,
+					       struct tracefs_instance *instance,
+					       cpu_set_t *cpus, int cpu_size);
+void tracefs_iterator_close(struct tracefs_iterator *iter);
+int tracefs_iterator_fd(struct tracefs_iterator *iter);
+int tracefs_iterator_set_watermark(struct tracefs_iterator *iter, int percent);
+int tracefs_iterator_read(struct tracefs_iterator *iter, int timeout,
+			  int (*callback)(struct tep_event *,
+					  struct tep_record *,
+					  int, void *),
+			  void *callback_context);
+
+struct tracefs_cpu_reader;
+struct tracefs_cpu_reader *
+tracefs_cpu_reader_open(struct tracefs_instance *instance, int cpu, bool nonblock);
+void tracefs_cpu_reader_close(struct tracefs_cpu_reader *reader);
+int tracefs_cpu_reader_fd(struct tracefs_cpu_reader *reader);
+int tracefs_cpu_reader_read(struct tracefs_cpu_reader *reader,
+			    struct tep_handle *tep,
+			    int (*callback)(struct tep_event *,
+					    struct tep_record *,
+					    int, void *),
+			    void *callback_context);
+
+/*
+ * MULTIPLEX	- Write all the CPUs to a single file, instead of one
+ *		  file per CPU.
+ */
+enum {
+	TRACEFS_RECORD_MULTIPLEX	= (1 << 0),
+};
+
+struct tracefs_recorder;
+struct tracefs_recorder *
+tracefs_recorder_open(struct tracefs_instance *instance, cpu_set_t *cpus,
+		      int cpu_size, const char *output, unsigned int flags);
+void tracefs_recorder_close(struct tracefs_recorder *rec);
+int tracefs_recorder_fd(struct tracefs_recorder *rec);
+ssize_t tracefs_recorder_read(struct tracefs_recorder *rec, int timeout);
+ssize_t tracefs_recorder_flush(struct tracefs_recorder *rec);
+int tracefs_iterate_raw_file(struct tep_handle *tep, const char *file,
+			     cpu_set_t *cpus, int cpu_size,
+			     int (*callback)(struct tep_event *,
+					     struct tep_record *,
+					     int, void *),
+			     void *callback_context);
 
 char *tracefs_event_get_file(struct tracefs_instance *instance,
 			     const char *system, const char *event,
@@ -128,8 +245,20 @@ struct tep_handle *tracefs_local_events_system(const char *tracing_dir,
 					       const char * const *sys_names);
 int tracefs_fill_local_events(const char *tracing_dir,
 			       struct tep_handle *tep, int *parsing_failures);
+struct tep_handle *tracefs_local_events_cached(const char *tracing_dir,
+					       const char *cache_file);
+
+struct tracefs_lazy_events;
+struct tracefs_lazy_events *tracefs_lazy_events_alloc(const char *tracing_dir,
+						      struct tep_handle *tep);
+void tracefs_lazy_events_free(struct tracefs_lazy_events *lazy);
+struct tep_event *tracefs_lazy_find_event(struct tracefs_lazy_events *lazy, int id);
+struct tep_event *
+tracefs_lazy_find_event_by_name(struct tracefs_lazy_events *lazy,
+				const char *system, const char *event_name);
 
 int tracefs_load_cmdlines(const char *tracing_dir, struct tep_handle *tep);
+int tracefs_kallsyms_set_cache(const char *cache_file);
 
 char *tracefs_get_clock(struct tracefs_instance *instance);
 
@@ -191,6 +320,34 @@ int tracefs_option_disable(struct tracefs_instance *instance, enum tracefs_optio
 const char *tracefs_option_name(enum tracefs_option_id id);
 enum tracefs_option_id tracefs_option_id(const char *name);
 
+/* Batches of configuration writes */
+struct tracefs_config;
+struct tracefs_config *tracefs_config_alloc(struct tracefs_instance *instance);
+void tracefs_config_free(struct tracefs_config *config);
+int tracefs_config_write(struct tracefs_config *config, const char *file,
+			 const char *str);
+int tracefs_config_append(struct tracefs_config *config, const char *file,
+			  const char *str);
+int tracefs_config_set_buffer_size(struct tracefs_config *config, int size_kb);
+int tracefs_config_set_clock(struct tracefs_config *config, const char *clock);
+int tracefs_config_set_tracer(struct tracefs_config *config, const char *tracer);
+int tracefs_config_option_enable(struct tracefs_config *config,
+				 enum tracefs_option_id id);
+int tracefs_config_option_disable(struct tracefs_config *config,
+				  enum tracefs_option_id id);
+int tracefs_config_event_enable(struct tracefs_config *config,
+				const char *system, const char *event);
+int tracefs_config_event_disable(struct tracefs_config *config,
+				 const char *system, const char *event);
+int tracefs_config_event_filter(struct tracefs_config *config,
+				const char *system, const char *event,
+				const char *filter);
+int tracefs_config_event_trigger(struct tracefs_config *config,
+				 const char *system, const char *event,
+				 const char *trigger);
+int tracefs_config_apply(struct tracefs_config *config);
+int tracefs_config_print(struct tracefs_config *config, FILE *fp);
+
 /*
  * RESET	- Reset on opening filter file (O_TRUNC)
  * CONTINUE	- Do not close filter file on return.
@@ -207,6 +364,16 @@ int tracefs_function_filter(struct tracefs_instance *instance, const char *filte
 			    const char *module, unsigned int flags);
 int tracefs_function_notrace(struct tracefs_instance *instance, const char *filter,
 			     const char *module, unsigned int flags);
+
+struct tracefs_function_pattern {
+	const char		*filter;
+	const char		*module;
+	bool			notrace;
+};
+
+int tracefs_function_filter_patterns(struct tracefs_instance *instance,
+				     const struct tracefs_function_pattern *patterns,
+				     int nr_patterns, unsigned int flags);
 int tracefs_filter_functions(const char *filter, const char *module, char ***list);
 
 
@@ -238,6 +405,45 @@ ssize_t tracefs_trace_pipe_stream(int fd, struct tracefs_instance *instance, int
 ssize_t tracefs_trace_pipe_print(struct tracefs_instance *instance, int flags);
 void tracefs_trace_pipe_stop(struct tracefs_instance *instance);
 
+struct tracefs_streamer_stat {
+	/* Bytes written to the destination */
+	unsigned long long	bytes;
+	/* Number of times the destination was full */
+	unsigned long long	stalls;
+	/* Bytes read, waiting for the destination */
+	size_t			pending;
+	bool			blocked;
+	bool			stopped;
+	/* The error that stopped the stream, or 0 */
+	int			error;
+	/* The size of the pipe, or of the bounce buffer without splice */
+	int			pipe_size;
+	int			buf_size;
+};
+
+/*
+ * ADAPTIVE	- Start with the default buffer sizes, and grow them
+ *		  under load.
+ */
+enum {
+	TRACEFS_STREAM_ADAPTIVE		= (1 << 0),
+};
+
+struct tracefs_streamer;
+struct tracefs_streamer *tracefs_streamer_alloc(void);
+void tracefs_streamer_free(struct tracefs_streamer *streamer);
+int tracefs_streamer_set_sizes(struct tracefs_streamer *streamer, int pipe_size,
+			       int buf_size, unsigned int flags);
+int tracefs_streamer_use_uring(struct tracefs_streamer *streamer);
+int tracefs_streamer_add(struct tracefs_streamer *streamer,
+			 struct tracefs_instance *instance, int fd);
+int tracefs_streamer_fd(struct tracefs_streamer *streamer);
+ssize_t tracefs_streamer_read(struct tracefs_streamer *streamer, int timeout);
+ssize_t tracefs_streamer_run(struct tracefs_streamer *streamer);
+void tracefs_streamer_stop(struct tracefs_streamer *streamer);
+int tracefs_streamer_stat(struct tracefs_streamer *streamer, int stream,
+			  struct tracefs_streamer_stat *stat);
+
 enum tracefs_kprobe_type {
 	TRACEFS_ALL_KPROBES,
 	TRACEFS_KPROBE,
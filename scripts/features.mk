@@ -35,3 +35,25 @@ int main (void)
 	return ret;
 }
 endef
+
+define SOURCE_IO_URING
+#include <linux/io_uring.h>
+
+int main (void)
+{
+	struct io_uring_rsrc_register reg = { .flags = IORING_RSRC_REGISTER_SPARSE };
+	struct io_uring_sqe sqe = { .opcode = IORING_OP_SPLICE };
+
+	sqe.splice_flags = SPLICE_F_FD_IN_FIXED;
+	return reg.flags + sqe.opcode + IORING_ENTER_EXT_ARG;
+}
+endef
+
+define SOURCE_TEP_SUB_BUFFER_SIZE
+#include <event-parse.h>
+
+int main (void)
+{
+	return tep_get_sub_buffer_size(tep_alloc());
+}
+endef
@@ -0,0 +1,749 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Batches of configuration writes to an instance.
+ *
+ * The writes are recorded first, and then applied together in an order
+ * where each one can depend on the previous ones (the tracer before its
+ * options, the filters before the events are enabled, ...). The state of
+ * every file is read before it is written, so that the writes that were
+ * already applied can be undone if a later one fails.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "tracefs.h"
+#include "tracefs-local.h"
+
+/* The order the writes are applied in */
+enum config_stage {
+	STAGE_BUFFER,
+	STAGE_CLOCK,
+	STAGE_TRACER,
+	STAGE_OPTION,
+	STAGE_FILE,
+	STAGE_FILTER,
+	STAGE_TRIGGER,
+	STAGE_ENABLE,
+	STAGE_TRACING_ON,
+};
+
+/* How the previous state of a file is captured and restored */
+enum config_type {
+	CONFIG_VALUE,
+	CONFIG_CLOCK,
+	CONFIG_FILTER,
+	CONFIG_TRIGGER,
+	CONFIG_ENABLE,
+	CONFIG_APPEND,
+};
+
+struct config_restore {
+	char			*file;
+	char			*str;
+	bool			append;
+};
+
+struct config_entry {
+	char			*file;
+	char			*str;
+	enum config_type	type;
+	enum config_stage	stage;
+	/* The order it was added in, to keep it within a stage */
+	int			seq;
+	struct config_restore	*restore;
+	int			nr_restore;
+	bool			applied;
+};
+
+struct tracefs_config {
+	struct tracefs_instance	*instance;
+	struct config_entry	*entries;
+	int			nr_entries;
+};
+
+/**
+ * tracefs_config_alloc - allocate a batch of configuration writes
+ * @instance: The instance to configure, or NULL for the top instance
+ *
+ * Returns a batch to record the writes in, that must be freed with
+ * tracefs_config_free(), or NULL on error.
+ */
+struct tracefs_config *tracefs_config_alloc(struct tracefs_instance *instance)
+{
+	struct tracefs_config *config;
+
+	if (instance && trace_get_instance(instance))
+		return NULL;
+
+	config = calloc(1, sizeof(*config));
+	if (!config) {
+		if (instance)
+			trace_put_instance(instance);
+		return NULL;
+	}
+	config->instance = instance;
+
+	return config;
+}
+
+static void free_restore(struct config_entry *entry)
+{
+	int i;
+
+	for (i = 0; i < entry->nr_restore; i++) {
+		free(entry->restore[i].file);
+		free(entry->restore[i].str);
+	}
+	free(entry->restore);
+	entry->restore = NULL;
+	entry->nr_restore = 0;
+}
+
+/**
+ * tracefs_config_free - free a batch of configuration writes
+ * @config: The batch to free
+ *
+ * The writes that were applied are kept.
+ */
+void tracefs_config_free(struct tracefs_config *config)
+{
+	int i;
+
+	if (!config)
+		return;
+
+	for (i = 0; i < config->nr_entries; i++) {
+		free(config->entries[i].file);
+		free(config->entries[i].str);
+		free_restore(&config->entries[i]);
+	}
+	free(config->entries);
+	if (config->instance)
+		trace_put_instance(config->instance);
+	free(config);
+}
+
+static bool ends_with(const char *str, const char *end)
+{
+	int len = strlen(str);
+	int elen = strlen(end);
+
+	return len >= elen && strcmp(str + len - elen, end) == 0;
+}
+
+static void classify_entry(struct config_entry *entry, bool append)
+{
+	const char *file = entry->file;
+	bool event = strncmp(file, "events/", 7) == 0;
+
+	entry->type = CONFIG_VALUE;
+	entry->stage = STAGE_FILE;
+
+	if (append) {
+		if (event && ends_with(file, "/trigger")) {
+			entry->type = CONFIG_TRIGGER;
+			entry->stage = STAGE_TRIGGER;
+		} else {
+			entry->type = CONFIG_APPEND;
+		}
+		return;
+	}
+
+	if (strcmp(file, "buffer_size_kb") == 0) {
+		entry->stage = STAGE_BUFFER;
+	} else if (strcmp(file, "trace_clock") == 0) {
+		entry->type = CONFIG_CLOCK;
+		entry->stage = STAGE_CLOCK;
+	} else if (strcmp(file, "current_tracer") == 0) {
+		entry->stage = STAGE_TRACER;
+	} else if (strncmp(file, "options/", 8) == 0) {
+		entry->stage = STAGE_OPTION;
+	} else if (strcmp(file, "tracing_on") == 0) {
+		entry->stage = STAGE_TRACING_ON;
+	} else if (event && ends_with(file, "/filter")) {
+		entry->type = CONFIG_FILTER;
+		entry->stage = STAGE_FILTER;
+	} else if (strcmp(file, "events/enable") == 0 ||
+		   (event && ends_with(file, "/enable"))) {
+		entry->type = CONFIG_ENABLE;
+		entry->stage = STAGE_ENABLE;
+	}
+}
+
+static int add_entry(struct tracefs_config *config, const char *file,
+		     const char *str, bool append)
+{
+	struct config_entry *entries;
+	struct config_entry *entry;
+
+	if (!config || !file || !str) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	entries = realloc(config->entries,
+			  (config->nr_entries + 1) * sizeof(*entries));
+	if (!entries)
+		return -1;
+	config->entries = entries;
+
+	entry = &entries[config->nr_entries];
+	memset(entry, 0, sizeof(*entry));
+	entry->file = strdup(file);
+	entry->str = strdup(str);
+	if (!entry->file || !entry->str) {
+		free(entry->file);
+		free(entry->str);
+		return -1;
+	}
+	entry->seq = config->nr_entries++;
+	classify_entry(entry, append);
+
+	return 0;
+}
+
+/**
+ * tracefs_config_write - record a write to a file of the instance
+ * @config: The batch to record the write in
+ * @file: The file of the instance, relative to the instance directory
+ * @str: The string to write to @file
+ *
+ * Records a write of @str to @file, like tracefs_instance_file_write().
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int tracefs_config_write(struct tracefs_config *config, const char *file,
+			 const char *str)
+{
+	return add_entry(config, file, str, false);
+}
+
+/**
+ * tracefs_config_append - record an append to a file of the instance
+ * @config: The batch to record the append in
+ * @file: The file of the instance, relative to the instance directory
+ * @str: The string to append to @file
+ *
+ * Records an append of @str to @file, like tracefs_instance_file_append().
+ * Only the appends to the trigger files of the events can be undone.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int tracefs_config_append(struct tracefs_config *config, const char *file,
+			  const char *str)
+{
+	return add_entry(config, file, str, true);
+}
+
+/**
+ * tracefs_config_set_buffer_size - record a change of the buffer size
+ * @config: The batch to record the change in
+ * @size_kb: The size of the buffer of each CPU, in kilobytes
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int tracefs_config_set_buffer_size(struct tracefs_config *config, int size_kb)
+{
+	char str[32];
+
+	snprintf(str, sizeof(str), "%d", size_kb);
+	return add_entry(config, "buffer_size_kb", str, false);
+}
+
+/**
+ * tracefs_config_set_clock - record a change of the trace clock
+ * @config: The batch to record the change in
+ * @clock: The name of the clock
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int tracefs_config_set_clock(struct tracefs_config *config, const char *clock)
+{
+	return add_entry(config, "trace_clock", clock, false);
+}
+
+/**
+ * tracefs_config_set_tracer - record a change of the current tracer
+ * @config: The batch to record the change in
+ * @tracer: The name of the tracer
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int tracefs_config_set_tracer(struct tracefs_config *config, const char *tracer)
+{
+	return add_entry(config, "current_tracer", tracer, false);
+}
+
+static int config_option(struct tracefs_config *config,
+			 enum tracefs_option_id id, bool set)
+{
+	const char *name = tracefs_option_name(id);
+	char file[PATH_MAX];
+
+	if (id == TRACEFS_OPTION_INVALID || id >= TRACEFS_OPTION_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	snprintf(file, PATH_MAX, "options/%s", name);
+	return add_entry(config, file, set ? "1" : "0", false);
+}
+
+/**
+ * tracefs_config_option_enable - record the enabling of an option
+ * @config: The batch to record the change in
+ * @id: The id of the option
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int tracefs_config_option_enable(struct tracefs_config *config,
+				 enum tracefs_option_id id)
+{
+	return config_option(config, id, true);
+}
+
+/**
+ * tracefs_config_option_disable - record the disabling of an option
+ * @config: The batch to record the change in
+ * @id: The id of the option
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int tracefs_config_option_disable(struct tracefs_config *config,
+				  enum tracefs_option_id id)
+{
+	return config_option(config, id, false);
+}
+
+/* @file is "events/[<system>/[<event>/]]<name>" */
+static int event_file(char *file, const char *system, const char *event,
+		      const char *name)
+{
+	int ret;
+
+	if (event && !system) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (event)
+		ret = snprintf(file, PATH_MAX, "events/%s/%s/%s", system, event, name);
+	else if (system)
+		ret = snprintf(file, PATH_MAX, "events/%s/%s", system, name);
+	else
+		ret = snprintf(file, PATH_MAX, "events/%s", name);
+
+	if (ret >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+static int config_event(struct tracefs_config *config, const char *system,
+			const char *event, bool enable)
+{
+	char file[PATH_MAX];
+
+	if (event_file(file, system, event, "enable") < 0)
+		return -1;
+
+	return add_entry(config, file, enable ? "1" : "0", false);
+}
+
+/**
+ * tracefs_config_event_enable - record the enabling of events
+ * @config: The batch to record the change in
+ * @system: The system of the event, or NULL for all the events
+ * @event: The event, or NULL for all the events of @system
+ *
+ * Unlike tracefs_event_enable(), @system and @event are names, not
+ * regular expressions.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int tracefs_config_event_enable(struct tracefs_config *config,
+				const char *system, const char *event)
+{
+	return config_event(config, system, event, true);
+}
+
+/**
+ * tracefs_config_event_disable - record the disabling of events
+ * @config: The batch to record the change in
+ * @system: The system of the event, or NULL for all the events
+ * @event: The event, or NULL for all the events of @system
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int tracefs_config_event_disable(struct tracefs_config *config,
+				 const char *system, const char *event)
+{
+	return config_event(config, system, event, false);
+}
+
+/**
+ * tracefs_config_event_filter - record the setting of an event filter
+ * @config: The batch to record the change in
+ * @system: The system of the event
+ * @event: The event
+ * @filter: The filter, or "0" to clear it
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int tracefs_config_event_filter(struct tracefs_config *config,
+				const char *system, const char *event,
+				const char *filter)
+{
+	char file[PATH_MAX];
+
+	if (!system || !event) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (event_file(file, system, event, "filter") < 0)
+		return -1;
+
+	return add_entry(config, file, filter, false);
+}
+
+/**
+ * tracefs_config_event_trigger - record the addition of an event trigger
+ * @config: The batch to record the change in
+ * @system: The system of the event
+ * @event: The event
+ * @trigger: The trigger to add to the event
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int tracefs_config_event_trigger(struct tracefs_config *config,
+				 const char *system, const char *event,
+				 const char *trigger)
+{
+	char file[PATH_MAX];
+
+	if (!system || !event) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (event_file(file, system, event, "trigger") < 0)
+		return -1;
+
+	return add_entry(config, file, trigger, true);
+}
+
+static int cmp_entries(const void *a, const void *b)
+{
+	const struct config_entry *ea = a;
+	const struct config_entry *eb = b;
+
+	if (ea->stage != eb->stage)
+		return ea->stage < eb->stage ? -1 : 1;
+	return ea->seq - eb->seq;
+}
+
+static int add_restore(struct config_entry *entry, const char *file,
+		       const char *str, bool append)
+{
+	struct config_restore *restore;
+
+	restore = realloc(entry->restore, (entry->nr_restore + 1) * sizeof(*restore));
+	if (!restore)
+		return -1;
+	entry->restore = restore;
+	restore += entry->nr_restore;
+
+	restore->file = strdup(file);
+	restore->str = strdup(str);
+	restore->append = append;
+	if (!restore->file || !restore->str) {
+		free(restore->file);
+		free(restore->str);
+		return -1;
+	}
+	entry->nr_restore++;
+
+	return 0;
+}
+
+/* Read @file without its trailing new line */
+static char *read_value(struct tracefs_instance *instance, const char *file)
+{
+	char *str;
+	int len;
+
+	str = tracefs_instance_file_read(instance, file, NULL);
+	if (!str)
+		return NULL;
+
+	len = strlen(str);
+	while (len && str[len - 1] == '\n')
+		str[--len] = '\0';
+
+	return str;
+}
+
+/*
+ * The enable file of a system (or of all the events) reads "X" if some
+ * of its events are enabled and others are not. Then the state of each
+ * of them is saved. Returns 1 if the state of @file matches @str and
+ * it needs no write.
+ */
+static int capture_enable(struct tracefs_instance *instance,
+			  struct config_entry *entry, const char *file,
+			  const char *str)
+{
+	char sub[PATH_MAX];
+	char **list = NULL;
+	char *dir = NULL;
+	char *val;
+	int ret = -1;
+	int i;
+
+	val = read_value(instance, file);
+	if (!val)
+		return -1;
+
+	/* The soft enabled state ("0*" or "1*") is not changed by writes */
+	if (val[0] == '0' || val[0] == '1') {
+		ret = val[0] == str[0] && !str[1] ? 1 :
+			add_restore(entry, file, val[0] == '1' ? "1" : "0", false);
+		goto out;
+	}
+
+	if (strcmp(file, "events/enable") == 0) {
+		list = tracefs_event_systems(tracefs_instance_get_trace_dir(instance));
+	} else {
+		/* "events/<system>/enable" */
+		dir = strdup(file + 7);
+		if (!dir)
+			goto out;
+		dir[strlen(dir) - strlen("/enable")] = '\0';
+		list = tracefs_system_events(tracefs_instance_get_trace_dir(instance), dir);
+	}
+	if (!list)
+		goto out;
+
+	for (i = 0; list[i]; i++) {
+		if (dir)
+			snprintf(sub, PATH_MAX, "events/%s/%s/enable", dir, list[i]);
+		else
+			snprintf(sub, PATH_MAX, "events/%s/enable", list[i]);
+		if (capture_enable(instance, entry, sub, "") < 0)
+			goto out;
+	}
+	ret = 0;
+ out:
+	tracefs_list_free(list);
+	free(dir);
+	free(val);
+	return ret;
+}
+
+/*
+ * Save what is needed to undo the write of @entry. Returns 1 if @entry
+ * would not change anything, 0 if it must be written, and -1 on error.
+ */
+static int capture_entry(struct tracefs_instance *instance,
+			 struct config_entry *entry)
+{
+	char *trigger;
+	char *val;
+	char *p;
+	int ret;
+
+	switch (entry->type) {
+	case CONFIG_APPEND:
+		return 0;
+	case CONFIG_TRIGGER:
+		if (asprintf(&trigger, "!%s", entry->str) < 0)
+			return -1;
+		ret = add_restore(entry, entry->file, trigger, true);
+		free(trigger);
+		return ret;
+	case CONFIG_ENABLE:
+		return capture_enable(instance, entry, entry->file, entry->str);
+	default:
+		break;
+	}
+
+	val = read_value(instance, entry->file);
+	if (!val)
+		return -1;
+
+	switch (entry->type) {
+	case CONFIG_CLOCK:
+		/* The current clock is the one in brackets */
+		p = strchr(val, '[');
+		if (!p)
+			goto fail;
+		memmove(val, p + 1, strlen(p));
+		p = strchr(val, ']');
+		if (!p)
+			goto fail;
+		*p = '\0';
+		break;
+	case CONFIG_FILTER:
+		if (strcmp(val, "none") == 0)
+			strcpy(val, "0");
+		break;
+	default:
+		/* buffer_size_kb may read "7 (expanded: 1408)" */
+		if (strcmp(entry->file, "buffer_size_kb") == 0)
+			val[strcspn(val, " ")] = '\0';
+		break;
+	}
+
+	if (strcmp(val, entry->str) == 0)
+		ret = 1;
+	else
+		ret = add_restore(entry, entry->file, val, false);
+	free(val);
+	return ret;
+ fail:
+	free(val);
+	return -1;
+}
+
+static int write_entry(struct tracefs_instance *instance, const char *file,
+		       const char *str, bool append)
+{
+	if (append)
+		return tracefs_instance_file_append(instance, file, str);
+	return tracefs_instance_file_write(instance, file, str);
+}
+
+static void rollback_entry(struct tracefs_instance *instance,
+			   struct config_entry *entry)
+{
+	struct config_restore *restore;
+	int i;
+
+	for (i = entry->nr_restore - 1; i >= 0; i--) {
+		restore = &entry->restore[i];
+		if (write_entry(instance, restore->file, restore->str,
+				restore->append) < 0)
+			tracefs_warning("Failed to restore %s", restore->file);
+	}
+	entry->applied = false;
+}
+
+/**
+ * tracefs_config_apply - apply a batch of configuration writes
+ * @config: The batch to apply
+ *
+ * Applies the writes recorded in @config, ordered so that each one can
+ * rely on the previous ones: the buffer size, the clock, the tracer,
+ * the options, the other files, the event filters, the event triggers,
+ * the enabling of events, and tracing_on last. Within each of these, the
+ * writes are applied in the order they were recorded. The writes that
+ * would not change the state of their file are skipped.
+ *
+ * Before each file is written, its current state is saved. If a write
+ * fails, the writes that were applied are undone, in reverse order.
+ *
+ * Returns 0 if all the writes were applied, -1 otherwise.
+ */
+int tracefs_config_apply(struct tracefs_config *config)
+{
+	struct tracefs_instance *instance;
+	struct config_entry *entry;
+	int ret;
+	int i;
+
+	if (!config) {
+		errno = EINVAL;
+		return -1;
+	}
+	instance = config->instance;
+
+	qsort(config->entries, config->nr_entries, sizeof(*config->entries),
+	      cmp_entries);
+
+	for (i = 0; i < config->nr_entries; i++) {
+		entry = &config->entries[i];
+		free_restore(entry);
+
+		ret = capture_entry(instance, entry);
+		if (ret > 0)
+			continue;
+		if (ret < 0)
+			goto fail;
+
+		ret = write_entry(instance, entry->file, entry->str,
+				  entry->type == CONFIG_APPEND ||
+				  entry->type == CONFIG_TRIGGER);
+		if (ret < 0)
+			goto fail;
+		entry->applied = true;
+	}
+
+	return 0;
+ fail:
+	tracefs_warning("Failed to write '%s' to %s", entry->str, entry->file);
+	/* A failed write to an enable file may have enabled some of its events */
+	if (entry->type == CONFIG_ENABLE)
+		rollback_entry(instance, entry);
+	for (i--; i >= 0; i--) {
+		if (config->entries[i].applied)
+			rollback_entry(instance, &config->entries[i]);
+	}
+	return -1;
+}
+
+/* Print @str in single quotes for the shell, where ' is written as '\'' */
+static void print_quoted(FILE *fp, const char *str)
+{
+	fputc('\'', fp);
+	for (; *str; str++) {
+		if (*str == '\'')
+			fputs("'\\''", fp);
+		else
+			fputc(*str, fp);
+	}
+	fputc('\'', fp);
+}
+
+/**
+ * tracefs_config_print - print a batch as shell commands
+ * @config: The batch to print
+ * @fp: The file to print to
+ *
+ * Prints the commands that do the writes of @config, in the order that
+ * tracefs_config_apply() would do them, without applying anything.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int tracefs_config_print(struct tracefs_config *config, FILE *fp)
+{
+	struct config_entry *entry;
+	char *path;
+	int i;
+
+	if (!config || !fp) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	qsort(config->entries, config->nr_entries, sizeof(*config->entries),
+	      cmp_entries);
+
+	for (i = 0; i < config->nr_entries; i++) {
+		entry = &config->entries[i];
+		path = tracefs_instance_get_file(config->instance, entry->file);
+		if (!path)
+			return -1;
+		fputs("echo ", fp);
+		print_quoted(fp, entry->str);
+		fprintf(fp, " %s ", entry->type == CONFIG_APPEND ||
+			entry->type == CONFIG_TRIGGER ? ">>" : ">");
+		print_quoted(fp, path);
+		fputc('\n', fp);
+		tracefs_put_tracing_file(path);
+	}
+
+	return 0;
+}
@@ -14,22 +14,30 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
 
 #include <kbuffer.h>
 
 #include "tracefs.h"
 #include "tracefs-local.h"
 
-struct cpu_iterate {
-	struct tep_record record;
-	struct tep_event *event;
-	struct kbuffer *kbuf;
-	void *page;
-	int psize;
-	int rsize;
-	int cpu;
-	int fd;
-};
+/*
+ * The records are reused for every event. They are zeroed when allocated,
+ * and only the fields that change from one event to the next are set here.
+ */
+static inline void set_kbuf_record(struct tep_record *record, struct kbuffer *kbuf,
+				   unsigned long long ts, void *ptr, int cpu)
+{
+	record->ts = ts;
+	record->size = kbuffer_event_size(kbuf);
+	record->record_size = kbuffer_curr_size(kbuf);
+	record->cpu = cpu;
+	record->data = ptr;
+	record->ref_count = 1;
+}
 
 static int read_kbuf_record(struct cpu_iterate *cpu)
 {
@@ -42,44 +50,145 @@ static int read_kbuf_record(struct cpu_iterate *cpu)
 	if (!ptr)
 		return -1;
 
-	memset(&cpu->record, 0, sizeof(cpu->record));
-	cpu->record.ts = ts;
-	cpu->record.size = kbuffer_event_size(cpu->kbuf);
-	cpu->record.record_size = kbuffer_curr_size(cpu->kbuf);
-	cpu->record.cpu = cpu->cpu;
-	cpu->record.data = ptr;
-	cpu->record.ref_count = 1;
+	set_kbuf_record(&cpu->record, cpu->kbuf, ts, ptr, cpu->cpu);
 
 	kbuffer_next_event(cpu->kbuf, NULL);
 
 	return 0;
 }
 
-int read_next_page(struct tep_handle *tep, struct cpu_iterate *cpu)
+static struct kbuffer *tep_kbuffer_alloc(struct tep_handle *tep)
 {
 	enum kbuffer_long_size long_size;
 	enum kbuffer_endian endian;
 
-	cpu->rsize = read(cpu->fd, cpu->page, cpu->psize);
-	if (cpu->rsize <= 0)
+	if (tep_is_file_bigendian(tep))
+		endian = KBUFFER_ENDIAN_BIG;
+	else
+		endian = KBUFFER_ENDIAN_LITTLE;
+
+	if (tep_get_header_page_size(tep) == 8)
+		long_size = KBUFFER_LSIZE_8;
+	else
+		long_size = KBUFFER_LSIZE_4;
+
+	return kbuffer_alloc(long_size, endian);
+}
+
+static bool is_regular_file(int fd)
+{
+	struct stat st;
+
+	return fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/*
+ * A recording is made of the sub-buffers of the ring buffer it was
+ * recorded from, which can be bigger than a page. libtraceevent knows
+ * their size from the header page that @tep was given.
+ */
+static int recorded_subbuf_size(struct tep_handle *tep, struct cpu_iterate *cpu)
+{
+#ifdef HAVE_TEP_SUB_BUFFER_SIZE
+	int size = tep_get_sub_buffer_size(tep);
+
+	/* Without a header page, it is not known */
+	if (size >= cpu->psize)
+		return size;
+#endif
+	return cpu->psize;
+}
+
+/*
+ * If the file of @cpu is a regular file, then it is a recording of the
+ * buffer (see tracefs_recorder_open()). Map it, and read its sub-buffers
+ * in place. Returns 0 on success, or -1 on error.
+ */
+static int map_cpu_file(struct tep_handle *tep, struct cpu_iterate *cpu)
+{
+	struct stat st;
+	size_t offset;
+	void *map;
+	int i;
+
+	if (fstat(cpu->fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return 0;
+
+	cpu->offline = true;
+	cpu->psize = recorded_subbuf_size(tep, cpu);
+	if (!st.st_size)
+		return 0;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, cpu->fd, 0);
+	if (map == MAP_FAILED)
 		return -1;
 
-	if (!cpu->kbuf) {
-		if (tep_is_file_bigendian(tep))
-			endian = KBUFFER_ENDIAN_BIG;
-		else
-			endian = KBUFFER_ENDIAN_LITTLE;
+	cpu->nr_file_pages = (st.st_size + cpu->psize - 1) / cpu->psize;
+	cpu->file_pages = calloc(cpu->nr_file_pages, sizeof(*cpu->file_pages));
+	if (!cpu->file_pages) {
+		munmap(map, st.st_size);
+		return -1;
+	}
 
-		if (tep_get_header_page_size(tep) == 8)
-			long_size = KBUFFER_LSIZE_8;
-		else
-			long_size = KBUFFER_LSIZE_4;
+	cpu->file_map = map;
+	cpu->file_size = st.st_size;
+	for (i = 0, offset = 0; i < cpu->nr_file_pages; i++, offset += cpu->psize) {
+		cpu->file_pages[i].offset = offset;
+		cpu->file_pages[i].size = st.st_size - offset < cpu->psize ?
+			st.st_size - offset : cpu->psize;
+	}
+
+	return 0;
+}
+
+static int read_file_page(struct cpu_iterate *cpu)
+{
+	struct trace_file_page *page;
+
+	if (cpu->next_file_page >= cpu->nr_file_pages)
+		return -1;
 
-		cpu->kbuf = kbuffer_alloc(long_size, endian);
+	page = &cpu->file_pages[cpu->next_file_page++];
+	kbuffer_load_subbuffer(cpu->kbuf, cpu->file_map + page->offset);
+	if (kbuffer_subbuffer_size(cpu->kbuf) > page->size) {
+		tracefs_warning("%s: page_size > %d", __func__, page->size);
+		return -1;
+	}
+
+	return 0;
+}
+
+int read_next_page(struct tep_handle *tep, struct cpu_iterate *cpu)
+{
+	if (!cpu->kbuf) {
+		cpu->kbuf = tep_kbuffer_alloc(tep);
 		if (!cpu->kbuf)
 			return -1;
+
+		cpu->lazy = trace_lazy_events(tep);
+
+		if (!cpu->offline && map_cpu_file(tep, cpu) < 0)
+			return -1;
+
+		/*
+		 * If the kernel supports it, map the ring buffer and read
+		 * the sub-buffers in place, instead of copying every page
+		 * out of trace_pipe_raw.
+		 */
+		if (!cpu->offline)
+			cpu->mapping = trace_mmap(cpu->fd, cpu->kbuf);
 	}
 
+	if (cpu->offline)
+		return read_file_page(cpu);
+
+	if (cpu->mapping)
+		return trace_mmap_load_subbuf(cpu->mapping, cpu->kbuf) > 0 ? 0 : -1;
+
+	cpu->rsize = read(cpu->fd, cpu->page, cpu->psize);
+	if (cpu->rsize <= 0)
+		return -1;
+
 	kbuffer_load_subbuffer(cpu->kbuf, cpu->page);
 	if (kbuffer_subbuffer_size(cpu->kbuf) > cpu->rsize) {
 		tracefs_warning("%s: page_size > %d", __func__, cpu->rsize);
@@ -89,70 +198,243 @@ int read_next_page(struct tep_handle *tep, struct cpu_iterate *cpu)
 	return 0;
 }
 
-int read_next_record(struct tep_handle *tep, struct cpu_iterate *cpu)
+/* Read the next known event of the currently loaded page */
+static inline struct tep_event *
+find_event(struct tep_handle *tep, struct tracefs_lazy_events *lazy, int id)
+{
+	if (lazy)
+		return tracefs_lazy_find_event(lazy, id);
+	return tep_find_event(tep, id);
+}
+
+static int read_page_record(struct tep_handle *tep, struct cpu_iterate *cpu)
 {
 	int id;
 
-	do {
-		while (!read_kbuf_record(cpu)) {
-			id = tep_data_type(tep, &(cpu->record));
-			cpu->event = tep_find_event(tep, id);
-			if (cpu->event)
-				return 0;
+	while (!read_kbuf_record(cpu)) {
+		id = tep_data_type(tep, &(cpu->record));
+		if (cpu->events) {
+			/* Skip the events that are not in the table */
+			if (id < 0 || id >= cpu->nr_events)
+				continue;
+			cpu->event = cpu->events[id];
+		} else {
+			cpu->event = find_event(tep, cpu->lazy, id);
 		}
+		if (cpu->event)
+			return 0;
+	}
+
+	return -1;
+}
+
+int read_next_record(struct tep_handle *tep, struct cpu_iterate *cpu)
+{
+	do {
+		if (!read_page_record(tep, cpu))
+			return 0;
 	} while (!read_next_page(tep, cpu));
 
 	return -1;
 }
 
-static int read_cpu_pages(struct tep_handle *tep, struct cpu_iterate *cpus, int count,
-			  int (*callback)(struct tep_event *,
-					  struct tep_record *,
-					  int, void *),
-			  void *callback_context,
-			  bool *keep_going)
+/*
+ * Min-heap of the CPU buffers, keyed on the timestamp of the next record
+ * of each buffer. Finding the oldest record is O(1) and replacing it with
+ * the next record of the same buffer is O(log n), instead of scanning all
+ * the CPUs for every record. Ties are broken by the index of the buffer,
+ * to keep the order stable.
+ */
+struct ts_heap_node {
+	unsigned long long	ts;
+	int			idx;
+};
+
+struct ts_heap {
+	struct ts_heap_node	*nodes;
+	int			nr;
+};
+
+static bool ts_heap_less(struct ts_heap_node *a, struct ts_heap_node *b)
 {
-	bool has_data = false;
-	int ret;
+	if (a->ts != b->ts)
+		return a->ts < b->ts;
+	return a->idx < b->idx;
+}
+
+static void ts_heap_sift_down(struct ts_heap *heap, int i)
+{
+	struct ts_heap_node *nodes = heap->nodes;
+	struct ts_heap_node tmp;
+	int child;
+
+	while ((child = i * 2 + 1) < heap->nr) {
+		if (child + 1 < heap->nr &&
+		    ts_heap_less(&nodes[child + 1], &nodes[child]))
+			child++;
+		if (!ts_heap_less(&nodes[child], &nodes[i]))
+			break;
+		tmp = nodes[i];
+		nodes[i] = nodes[child];
+		nodes[child] = tmp;
+		i = child;
+	}
+}
+
+static int ts_heap_init(struct ts_heap *heap, int size)
+{
+	heap->nr = 0;
+	heap->nodes = calloc(size ? size : 1, sizeof(*heap->nodes));
+	return heap->nodes ? 0 : -1;
+}
+
+/* Only used to fill the heap, must be followed by ts_heap_build() */
+static void ts_heap_add(struct ts_heap *heap, unsigned long long ts, int idx)
+{
+	heap->nodes[heap->nr].ts = ts;
+	heap->nodes[heap->nr].idx = idx;
+	heap->nr++;
+}
+
+static void ts_heap_build(struct ts_heap *heap)
+{
+	int i;
+
+	for (i = heap->nr / 2 - 1; i >= 0; i--)
+		ts_heap_sift_down(heap, i);
+}
+
+/* The next record of the buffer at the top of the heap has @ts */
+static void ts_heap_replace_top(struct ts_heap *heap, unsigned long long ts)
+{
+	heap->nodes[0].ts = ts;
+	ts_heap_sift_down(heap, 0);
+}
+
+/* The buffer at the top of the heap has no more records */
+static void ts_heap_pop(struct ts_heap *heap)
+{
+	heap->nodes[0] = heap->nodes[--heap->nr];
+	ts_heap_sift_down(heap, 0);
+}
+
+/*
+ * Merge the records of all @cpus and call @callback for each of them,
+ * until there's no more data to read. A CPU that already has a record
+ * read (an event set) from a previous call keeps it.
+ * Returns the number of records passed to @callback, or -1 on error.
+ */
+__hidden int trace_read_cpu_pages(struct tep_handle *tep, struct cpu_iterate *cpus, int count,
+				  int (*callback)(struct tep_event *,
+						  struct tep_record *,
+						  int, void *),
+				  void *callback_context,
+				  bool *keep_going)
+{
+	struct tep_event *event;
+	struct ts_heap heap;
+	int nr = 0;
 	int i, j;
 
+	if (ts_heap_init(&heap, count) < 0)
+		return -1;
+
 	for (i = 0; i < count; i++) {
-		ret = read_next_record(tep, cpus + i);
-		if (!ret)
-			has_data = true;
+		if (cpus[i].event || !read_next_record(tep, cpus + i))
+			ts_heap_add(&heap, cpus[i].record.ts, i);
+	}
+	ts_heap_build(&heap);
+
+	while (heap.nr && *(volatile bool *)keep_going) {
+		j = heap.nodes[0].idx;
+		event = cpus[j].event;
+		cpus[j].event = NULL;
+		nr++;
+		if (callback(event, &cpus[j].record, cpus[j].cpu, callback_context))
+			break;
+		if (!read_next_record(tep, cpus + j))
+			ts_heap_replace_top(&heap, cpus[j].record.ts);
+		else
+			ts_heap_pop(&heap);
 	}
 
-	while (has_data && *(volatile bool *)keep_going) {
-		j = count;
-		for (i = 0; i < count; i++) {
-			if (!cpus[i].event)
-				continue;
-			if (j == count || cpus[j].record.ts > cpus[i].record.ts)
-				j = i;
-		}
-		if (j < count) {
-			if (callback(cpus[j].event, &cpus[j].record, cpus[j].cpu, callback_context))
-				break;
-			cpus[j].event = NULL;
-			read_next_record(tep, cpus + j);
-		} else {
-			has_data = false;
-		}
+	free(heap.nodes);
+	return nr;
+}
+
+/*
+ * The size of the sub-buffers of the ring buffer of @instance, that can
+ * be bigger than a page. trace_pipe_raw hands them out whole, and only to
+ * reads and splices of at least that size.
+ */
+__hidden int trace_instance_subbuf_size(struct tracefs_instance *instance)
+{
+	long long kb;
+
+	/* Older kernels and recordings do not have it */
+	if (!tracefs_file_exists(instance, "buffer_subbuf_size_kb") ||
+	    tracefs_instance_file_read_number(instance, "buffer_subbuf_size_kb", &kb) < 0 ||
+	    kb * 1024 < getpagesize())
+		return getpagesize();
+
+	return kb * 1024;
+}
+
+/**
+ * trace_cpu_iterate_open - open the raw buffer of a CPU for reading
+ * @cpu_iter: The per CPU iterator to initialize
+ * @per_cpu: The path of the per_cpu directory of the instance
+ * @cpu: The CPU to open the buffer of
+ * @subbuf_size: The size of the sub-buffers, see trace_instance_subbuf_size()
+ * @nonblock: Open the buffer in non blocking mode
+ *
+ * Returns 0 on success, or -1 on error. On success, @cpu_iter must be
+ * released with trace_cpu_iterate_close().
+ */
+__hidden int trace_cpu_iterate_open(struct cpu_iterate *cpu_iter, const char *per_cpu,
+				    int cpu, int subbuf_size, bool nonblock)
+{
+	char file[PATH_MAX];
+	int fd;
+
+	snprintf(file, PATH_MAX, "%s/cpu%d/trace_pipe_raw", per_cpu, cpu);
+	fd = open(file, O_RDONLY | (nonblock ? O_NONBLOCK : 0));
+	if (fd < 0)
+		return -1;
+
+	memset(cpu_iter, 0, sizeof(*cpu_iter));
+	cpu_iter->fd = fd;
+	cpu_iter->cpu = cpu;
+	cpu_iter->psize = subbuf_size;
+	cpu_iter->page = malloc(cpu_iter->psize);
+	if (!cpu_iter->page) {
+		close(fd);
+		return -1;
 	}
 
 	return 0;
 }
 
-static int open_cpu_files(struct tracefs_instance *instance, cpu_set_t *cpus,
-			  int cpu_size, struct cpu_iterate **all_cpus, int *count)
+__hidden void trace_cpu_iterate_close(struct cpu_iterate *cpu_iter)
+{
+	trace_unmap(cpu_iter->mapping);
+	trace_put_lazy_events(cpu_iter->lazy);
+	kbuffer_free(cpu_iter->kbuf);
+	if (cpu_iter->file_size)
+		munmap(cpu_iter->file_map, cpu_iter->file_size);
+	free(cpu_iter->file_pages);
+	if (cpu_iter->fd >= 0)
+		close(cpu_iter->fd);
+	free(cpu_iter->page);
+}
+
+__hidden int trace_open_cpu_files(struct tracefs_instance *instance, cpu_set_t *cpus,
+				  int cpu_size, struct cpu_iterate **all_cpus, int *count)
 {
 	struct cpu_iterate *tmp;
-	unsigned int p_size;
 	struct dirent *dent;
-	char file[PATH_MAX];
-	struct stat st;
+	int subbuf_size;
 	int ret = -1;
-	int fd = -1;
 	char *path;
 	DIR *dir;
 	int cpu;
@@ -161,10 +443,10 @@ static int open_cpu_files(struct tracefs_instance *instance, cpu_set_t *cpus,
 	path = tracefs_instance_get_file(instance, "per_cpu");
 	if (!path)
 		return -1;
-	dir = opendir(path);
+	subbuf_size = trace_instance_subbuf_size(instance);
+	dir = trace_opendir_at(AT_FDCWD, path);
 	if (!dir)
 		goto out;
-	p_size = getpagesize();
 	while ((dent = readdir(dir))) {
 		const char *name = dent->d_name;
 
@@ -173,28 +455,16 @@ static int open_cpu_files(struct tracefs_instance *instance, cpu_set_t *cpus,
 		cpu = atoi(name + 3);
 		if (cpus && !CPU_ISSET_S(cpu, cpu_size, cpus))
 			continue;
-		sprintf(file, "%s/%s", path, name);
-		if (stat(file, &st) < 0 || !S_ISDIR(st.st_mode))
+		if (!trace_dirent_is_dir(dir, dent))
 			continue;
 
-		sprintf(file, "%s/%s/trace_pipe_raw", path, name);
-		fd = open(file, O_RDONLY | O_NONBLOCK);
-		if (fd < 0)
-			continue;
 		tmp = realloc(*all_cpus, (i + 1) * sizeof(struct cpu_iterate));
-		if (!tmp) {
-			close(fd);
+		if (!tmp)
 			goto out;
-		}
-		memset(tmp + i, 0, sizeof(struct cpu_iterate));
-		tmp[i].fd = fd;
-		tmp[i].cpu = cpu;
-		tmp[i].page =  malloc(p_size);
-		tmp[i].psize = p_size;
 		*all_cpus = tmp;
-		*count = i + 1;
-		if (!tmp[i++].page)
-			goto out;
+		if (trace_cpu_iterate_open(tmp + i, path, cpu, subbuf_size, true) < 0)
+			continue;
+		*count = ++i;
 	}
 
 	ret = 0;
@@ -206,359 +476,1449 @@ out:
 	return ret;
 }
 
-static bool top_iterate_keep_going;
-
-/*
- * tracefs_iterate_raw_events - Iterate through events in trace_pipe_raw,
- *				per CPU trace buffers
- * @tep: a handle to the trace event parser context
- * @instance: ftrace instance, can be NULL for the top instance
- * @cpus: Iterate only through the buffers of CPUs, set in the mask.
- *	  If NULL, iterate through all CPUs.
- * @cpu_size: size of @cpus set
- * @callback: A user function, called for each record from the file
- * @callback_context: A custom context, passed to the user callback function
- *
- * If the @callback returns non-zero, the iteration stops - in that case all
- * records from the current page will be lost from future reads
- * The events are iterated in sorted order, oldest first.
- *
- * Returns -1 in case of an error, or 0 otherwise
- */
-int tracefs_iterate_raw_events(struct tep_handle *tep,
-				struct tracefs_instance *instance,
-				cpu_set_t *cpus, int cpu_size,
-				int (*callback)(struct tep_event *,
-						struct tep_record *,
-						int, void *),
-				void *callback_context)
+__hidden void trace_close_cpu_files(struct cpu_iterate *all_cpus, int count)
 {
-	bool *keep_going = instance ? &instance->pipe_keep_going :
-				      &top_iterate_keep_going;
-	struct cpu_iterate *all_cpus = NULL;
-	int count = 0;
-	int ret;
 	int i;
 
-	(*(volatile bool *)keep_going) = true;
+	if (!all_cpus)
+		return;
 
-	if (!tep || !callback)
-		return -1;
+	for (i = 0; i < count; i++)
+		trace_cpu_iterate_close(&all_cpus[i]);
+	free(all_cpus);
+}
 
-	ret = open_cpu_files(instance, cpus, cpu_size, &all_cpus, &count);
-	if (ret < 0)
-		goto out;
-	ret = read_cpu_pages(tep, all_cpus, count,
-			     callback, callback_context,
-			     keep_going);
+static bool top_iterate_keep_going;
 
-out:
-	if (all_cpus) {
-		for (i = 0; i < count; i++) {
-			kbuffer_free(all_cpus[i].kbuf);
-			close(all_cpus[i].fd);
-			free(all_cpus[i].page);
-		}
-		free(all_cpus);
+/* Followers of the top instance */
+static struct follow_event *top_followers;
+static int top_nr_followers;
+
+static struct follow_event **get_followers(struct tracefs_instance *instance,
+					   int **nr_followers)
+{
+	if (instance) {
+		*nr_followers = &instance->nr_followers;
+		return &instance->followers;
 	}
+	*nr_followers = &top_nr_followers;
+	return &top_followers;
+}
 
-	return ret;
+static bool has_followers(struct tracefs_instance *instance)
+{
+	return instance ? instance->nr_followers > 0 : top_nr_followers > 0;
 }
 
-/**
- * tracefs_iterate_stop - stop the iteration over the raw events.
- * @instance: ftrace instance, can be NULL for top tracing instance.
+/*
+ * The followers of the iterated instance, grouped by the id of their
+ * event, so that the followers of a record are found without any
+ * lookup. The followers of event id are followers[start[id]] up to
+ * followers[start[id + 1]].
  */
-void tracefs_iterate_stop(struct tracefs_instance *instance)
+struct event_dispatch {
+	int			(*callback)(struct tep_event *,
+					    struct tep_record *,
+					    int, void *);
+	void			*callback_context;
+	struct follow_event	**followers;
+	struct tep_event	**events;
+	int			*start;
+	int			nr_ids;
+};
+
+static int cmp_followers(const void *a, const void *b)
 {
-	if (instance)
-		instance->iterate_keep_going = false;
-	else
-		top_iterate_keep_going = false;
+	struct follow_event * const *fa = a;
+	struct follow_event * const *fb = b;
+
+	if ((*fa)->event->id != (*fb)->event->id)
+		return (*fa)->event->id < (*fb)->event->id ? -1 : 1;
+
+	/* Keep the order the followers were added in */
+	if (*fa != *fb)
+		return *fa < *fb ? -1 : 1;
+	return 0;
 }
 
-static int add_list_string(char ***list, const char *name)
+static void free_dispatch(struct event_dispatch *dispatch)
 {
-	char **tmp;
+	free(dispatch->followers);
+	free(dispatch->events);
+	free(dispatch->start);
+}
 
-	tmp = tracefs_list_add(*list, name);
-	if (!tmp) {
-		tracefs_list_free(*list);
-		*list = NULL;
+static int init_dispatch(struct event_dispatch *dispatch,
+			 struct follow_event *followers, int nr_followers)
+{
+	int id;
+	int i;
+
+	dispatch->nr_ids = 0;
+	for (i = 0; i < nr_followers; i++) {
+		if (followers[i].event->id >= dispatch->nr_ids)
+			dispatch->nr_ids = followers[i].event->id + 1;
+	}
+
+	dispatch->followers = calloc(nr_followers, sizeof(*dispatch->followers));
+	dispatch->events = calloc(dispatch->nr_ids, sizeof(*dispatch->events));
+	dispatch->start = calloc(dispatch->nr_ids + 1, sizeof(*dispatch->start));
+	if (!dispatch->followers || !dispatch->events || !dispatch->start) {
+		free_dispatch(dispatch);
 		return -1;
 	}
 
-	*list = tmp;
+	for (i = 0; i < nr_followers; i++)
+		dispatch->followers[i] = &followers[i];
+	qsort(dispatch->followers, nr_followers, sizeof(*dispatch->followers),
+	      cmp_followers);
+
+	for (i = 0; i < nr_followers; i++) {
+		id = dispatch->followers[i]->event->id;
+		dispatch->events[id] = dispatch->followers[i]->event;
+		dispatch->start[id + 1]++;
+	}
+	for (id = 0; id < dispatch->nr_ids; id++)
+		dispatch->start[id + 1] += dispatch->start[id];
+
 	return 0;
 }
 
-__hidden char *trace_append_file(const char *dir, const char *name)
+static int dispatch_callback(struct tep_event *event, struct tep_record *record,
+			     int cpu, void *data)
 {
-	char *file;
-	int ret;
+	struct event_dispatch *dispatch = data;
+	struct follow_event *follow;
+	int i;
 
-	ret = asprintf(&file, "%s/%s", dir, name);
+	if (event->id >= 0 && event->id < dispatch->nr_ids) {
+		for (i = dispatch->start[event->id];
+		     i < dispatch->start[event->id + 1]; i++) {
+			follow = dispatch->followers[i];
+			if (follow->callback(event, record, cpu, follow->callback_data))
+				return -1;
+		}
+	}
 
-	return ret < 0 ? NULL : file;
+	if (dispatch->callback)
+		return dispatch->callback(event, record, cpu,
+					  dispatch->callback_context);
+	return 0;
 }
 
-static int event_file(char **path, const char *system,
-		      const char *event, const char *file)
+/*
+ * Iterate the records of @cpus, calling the followers of @instance and
+ * @callback for each of them. If there's no @callback, the records of
+ * the events that are not followed are skipped without being looked up.
+ */
+static int iterate_cpus(struct tep_handle *tep, struct tracefs_instance *instance,
+			struct cpu_iterate *cpus, int count,
+			int (*callback)(struct tep_event *,
+					struct tep_record *,
+					int, void *),
+			void *callback_context,
+			bool *keep_going)
 {
-	if (!system || !event || !file)
+	struct event_dispatch dispatch = { };
+	struct follow_event **followers;
+	int *nr_followers;
+	int ret;
+	int i;
+
+	followers = get_followers(instance, &nr_followers);
+	if (!*nr_followers)
+		return trace_read_cpu_pages(tep, cpus, count, callback,
+					    callback_context, keep_going);
+
+	if (init_dispatch(&dispatch, *followers, *nr_followers) < 0)
 		return -1;
+	dispatch.callback = callback;
+	dispatch.callback_context = callback_context;
 
-	return asprintf(path, "events/%s/%s/%s",
-			system, event, file);
-}
-
-/**
- * tracefs_event_get_file - return a file in an event directory
- * @instance: The instance the event is in (NULL for top level)
- * @system: The system name that the event file is in
- * @event: The event name of the event
- * @file: The name of the file in the event directory.
- *
- * Returns a path to a file in the event director.
- * or NULL on error. The path returned must be freed with
- * tracefs_put_tracing_file().
- */
-char *tracefs_event_get_file(struct tracefs_instance *instance,
-			     const char *system, const char *event,
-			     const char *file)
-{
-	char *instance_path;
-	char *path;
-	int ret;
+	if (!callback) {
+		for (i = 0; i < count; i++) {
+			cpus[i].events = dispatch.events;
+			cpus[i].nr_events = dispatch.nr_ids;
+		}
+	}
 
-	ret = event_file(&path, system, event, file);
-	if (ret < 0)
-		return NULL;
+	ret = trace_read_cpu_pages(tep, cpus, count, dispatch_callback,
+				   &dispatch, keep_going);
 
-	instance_path = tracefs_instance_get_file(instance, path);
-	free(path);
+	for (i = 0; i < count; i++) {
+		cpus[i].events = NULL;
+		cpus[i].nr_events = 0;
+	}
+	free_dispatch(&dispatch);
 
-	return instance_path;
+	return ret;
 }
 
 /**
- * tracefs_event_file_read - read the content from an event file
- * @instance: The instance the event is in (NULL for top level)
- * @system: The system name that the event file is in
- * @event: The event name of the event
- * @file: The name of the file in the event directory.
- * @psize: the size of the content read.
+ * tracefs_follow_event - Add a callback for a specific event
+ * @tep: a handle to the trace event parser context
+ * @instance: The instance to follow, can be NULL for the top instance
+ * @system: The system of the event to follow, can be NULL for any system
+ * @event_name: The name of the event to follow
+ * @callback: The function to call for each record of the event
+ * @callback_data: The data to pass to @callback
  *
- * Reads the content of the event file that is passed via the
- * arguments and returns the content.
+ * Registers @callback to be called for every record of the given event,
+ * when the raw events of @instance are iterated with
+ * tracefs_iterate_raw_events() or tracefs_iterator_read(). The followers
+ * are called before the callback passed to these functions, which may
+ * then be NULL, in which case the records of the events that are not
+ * followed are skipped without looking up their event. If a follower
+ * returns non-zero, the iteration stops.
  *
- * Return a string containing the content of the file or NULL
- * on error. The string returned must be freed with free().
+ * The followers must not be changed while @instance is being iterated.
+ *
+ * Returns 0 on success, or -1 on error.
  */
-char *tracefs_event_file_read(struct tracefs_instance *instance,
-			      const char *system, const char *event,
-			      const char *file, int *psize)
+int tracefs_follow_event(struct tep_handle *tep, struct tracefs_instance *instance,
+			 const char *system, const char *event_name,
+			 int (*callback)(struct tep_event *,
+					 struct tep_record *,
+					 int, void *),
+			 void *callback_data)
 {
-	char *content;
-	char *path;
-	int ret;
-
-	ret = event_file(&path, system, event, file);
-	if (ret < 0)
-		return NULL;
+	struct follow_event **followers;
+	struct follow_event *follow;
+	struct tep_event *event;
+	int *nr_followers;
+	int ret = -1;
 
-	content = tracefs_instance_file_read(instance, path, psize);
-	free(path);
-	return content;
-}
+	if (!tep || !event_name || !callback) {
+		errno = EINVAL;
+		return -1;
+	}
 
-/**
- * tracefs_event_file_write - write to an event file
- * @instance: The instance the event is in (NULL for top level)
- * @system: The system name that the event file is in
- * @event: The event name of the event
- * @file: The name of the file in the event directory.
- * @str: The string to write into the file
- *
- * Writes the content of @str to a file in the instance directory.
- * The content of the file will be overwritten by @str.
- *
- * Return 0 on success, and -1 on error.
- */
-int tracefs_event_file_write(struct tracefs_instance *instance,
-			     const char *system, const char *event,
-			     const char *file, const char *str)
-{
-	char *path;
-	int ret;
+	event = tep_find_event_by_name(tep, system, event_name);
+	if (!event && system) {
+		struct tracefs_lazy_events *lazy = trace_lazy_events(tep);
 
-	ret = event_file(&path, system, event, file);
-	if (ret < 0)
+		if (lazy)
+			event = tracefs_lazy_find_event_by_name(lazy, system,
+								event_name);
+		trace_put_lazy_events(lazy);
+	}
+	if (!event) {
+		errno = ENOENT;
 		return -1;
+	}
 
-	ret = tracefs_instance_file_write(instance, path, str);
-	free(path);
+	pthread_mutex_lock(trace_get_lock(instance));
+	followers = get_followers(instance, &nr_followers);
+	follow = realloc(*followers, sizeof(*follow) * (*nr_followers + 1));
+	if (!follow)
+		goto out;
+	*followers = follow;
+	follow += (*nr_followers)++;
+	follow->event = event;
+	follow->callback = callback;
+	follow->callback_data = callback_data;
+	ret = 0;
+ out:
+	pthread_mutex_unlock(trace_get_lock(instance));
 	return ret;
 }
 
+static bool match_follower(struct follow_event *follow, const char *system,
+			   const char *event_name)
+{
+	if (system && strcmp(follow->event->system, system) != 0)
+		return false;
+	if (event_name && strcmp(follow->event->name, event_name) != 0)
+		return false;
+	return true;
+}
+
 /**
- * tracefs_event_file_append - write to an event file
- * @instance: The instance the event is in (NULL for top level)
- * @system: The system name that the event file is in
- * @event: The event name of the event
- * @file: The name of the file in the event directory.
- * @str: The string to write into the file
+ * tracefs_follow_event_clear - Remove followers of events
+ * @instance: The instance to remove the followers from, NULL for the top instance
+ * @system: The system of the followed events, NULL for any system
+ * @event_name: The name of the followed events, NULL for any event
  *
- * Writes the content of @str to a file in the instance directory.
- * The content of @str will be appended to the content of the file.
- * The current content should not be lost.
+ * Removes all the followers added by tracefs_follow_event() to @instance
+ * that match @system and @event_name.
  *
- * Return 0 on success, and -1 on error.
+ * Returns 0 if any followers were removed, or -1 if none matched.
  */
-int tracefs_event_file_append(struct tracefs_instance *instance,
-			      const char *system, const char *event,
-			      const char *file, const char *str)
+int tracefs_follow_event_clear(struct tracefs_instance *instance,
+			       const char *system, const char *event_name)
 {
-	char *path;
-	int ret;
+	struct follow_event **followers;
+	int *nr_followers;
+	int ret = -1;
+	int i, j;
 
-	ret = event_file(&path, system, event, file);
-	if (ret < 0)
-		return -1;
+	pthread_mutex_lock(trace_get_lock(instance));
+	followers = get_followers(instance, &nr_followers);
+	for (i = 0, j = 0; i < *nr_followers; i++) {
+		if (match_follower(&(*followers)[i], system, event_name)) {
+			ret = 0;
+			continue;
+		}
+		(*followers)[j++] = (*followers)[i];
+	}
+	*nr_followers = j;
+	if (!j) {
+		free(*followers);
+		*followers = NULL;
+	}
+	pthread_mutex_unlock(trace_get_lock(instance));
 
-	ret = tracefs_instance_file_append(instance, path, str);
-	free(path);
+	if (ret < 0)
+		errno = ENOENT;
 	return ret;
 }
 
-/**
- * tracefs_event_file_clear - clear an event file
- * @instance: The instance the event is in (NULL for top level)
- * @system: The system name that the event file is in
- * @event: The event name of the event
- * @file: The name of the file in the event directory.
+/*
+ * tracefs_iterate_raw_events - Iterate through events in trace_pipe_raw,
+ *				per CPU trace buffers
+ * @tep: a handle to the trace event parser context
+ * @instance: ftrace instance, can be NULL for the top instance
+ * @cpus: Iterate only through the buffers of CPUs, set in the mask.
+ *	  If NULL, iterate through all CPUs.
+ * @cpu_size: size of @cpus set
+ * @callback: A user function, called for each record from the file
+ * @callback_context: A custom context, passed to the user callback function
  *
- * Clears the content of the event file. That is, it is opened
- * with O_TRUNC and then closed.
+ * If the @callback returns non-zero, the iteration stops - in that case all
+ * records from the current page will be lost from future reads
+ * The events are iterated in sorted order, oldest first.
  *
- * Return 0 on success, and -1 on error.
+ * The followers added to @instance by tracefs_follow_event() are called
+ * for the records of their events, before @callback. @callback may be
+ * NULL if @instance has followers.
+ *
+ * If the kernel supports memory mapping of the ring buffer, the per CPU
+ * buffers are mapped and the records passed to @callback point directly
+ * into the mapped sub-buffers. Otherwise, the pages are read from the
+ * trace_pipe_raw files.
+ *
+ * Returns -1 in case of an error, or 0 otherwise
  */
-int tracefs_event_file_clear(struct tracefs_instance *instance,
-			     const char *system, const char *event,
-			     const char *file)
+int tracefs_iterate_raw_events(struct tep_handle *tep,
+				struct tracefs_instance *instance,
+				cpu_set_t *cpus, int cpu_size,
+				int (*callback)(struct tep_event *,
+						struct tep_record *,
+						int, void *),
+				void *callback_context)
 {
-	char *path;
+	bool *keep_going = instance ? &instance->iterate_keep_going :
+				      &top_iterate_keep_going;
+	struct cpu_iterate *all_cpus = NULL;
+	int count = 0;
 	int ret;
 
-	ret = event_file(&path, system, event, file);
-	if (ret < 0)
+	(*(volatile bool *)keep_going) = true;
+
+	if (!tep || (!callback && !has_followers(instance)))
 		return -1;
 
-	ret = tracefs_instance_file_clear(instance, path);
-	free(path);
+	ret = trace_open_cpu_files(instance, cpus, cpu_size, &all_cpus, &count);
+	if (ret < 0)
+		goto out;
+	ret = iterate_cpus(tep, instance, all_cpus, count,
+			   callback, callback_context,
+			   keep_going);
+	if (ret > 0)
+		ret = 0;
+
+out:
+	trace_close_cpu_files(all_cpus, count);
 	return ret;
 }
 
-/**
- * tracefs_event_file_exits - test if a file exists
- * @instance: The instance the event is in (NULL for top level)
- * @system: The system name that the event file is in
- * @event: The event name of the event
- * @file: The name of the file in the event directory.
- *
- * Return true if the file exists, false if it odes not or
- * an error occurred.
+/*
+ * Number of pages that can be in flight between a per CPU reader thread
+ * and the merging thread. Must be a power of two.
  */
-bool tracefs_event_file_exists(struct tracefs_instance *instance,
-			       const char *system, const char *event,
-			       const char *file)
+#define NR_CPU_BATCHES		8
+
+/* A sub-buffer read by a per CPU thread, and the records found in it */
+struct record_batch {
+	void			*page;
+	struct tep_record	*records;
+	struct tep_event	**events;
+	int			nr_records;
+	int			alloc;
+	int			next;
+};
+
+/*
+ * Lock free ring of pointers, with a single producer and a single
+ * consumer. The producer only writes @head and the consumer only
+ * writes @tail.
+ */
+struct spsc_ring {
+	void			*slots[NR_CPU_BATCHES];
+	unsigned int		head;
+	unsigned int		tail;
+};
+
+static bool ring_push(struct spsc_ring *ring, void *ptr)
 {
-	char *path;
-	bool ret;
+	unsigned int head = ring->head;
+	unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
 
-	if (event_file(&path, system, event, file) < 0)
+	if (head - tail == NR_CPU_BATCHES)
 		return false;
 
-	ret = tracefs_file_exists(instance, path);
-	free(path);
-	return ret;
+	ring->slots[head & (NR_CPU_BATCHES - 1)] = ptr;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return true;
 }
 
-/**
- * tracefs_event_systems - return list of systems for tracing
- * @tracing_dir: directory holding the "events" directory
- *		 if NULL, top tracing directory is used
- *
- * Returns an allocated list of system names. Both the names and
- * the list must be freed with tracefs_list_free()
- * The list returned ends with a "NULL" pointer
- */
-char **tracefs_event_systems(const char *tracing_dir)
+static void *ring_pop(struct spsc_ring *ring)
 {
-	struct dirent *dent;
-	char **systems = NULL;
-	char *events_dir;
-	struct stat st;
-	DIR *dir;
-	int ret;
-
-	if (!tracing_dir)
-		tracing_dir = tracefs_tracing_dir();
+	unsigned int tail = ring->tail;
+	unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	void *ptr;
 
-	if (!tracing_dir)
+	if (head == tail)
 		return NULL;
 
-	events_dir = trace_append_file(tracing_dir, "events");
-	if (!events_dir)
-		return NULL;
+	ptr = ring->slots[tail & (NR_CPU_BATCHES - 1)];
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return ptr;
+}
 
-	/*
-	 * Search all the directories in the events directory,
-	 * and collect the ones that have the "enable" file.
-	 */
-	ret = stat(events_dir, &st);
-	if (ret < 0 || !S_ISDIR(st.st_mode))
-		goto out_free;
+struct parallel_iterate {
+	struct tep_handle	*tep;
+	struct tracefs_lazy_events *lazy;
+	/* The events of the tep by id, if they are not loaded lazily */
+	struct tep_event	**events;
+	int			nr_ids;
+	int			(*callback)(struct tep_event *,
+					    struct tep_record *,
+					    int, void *);
+	void			*callback_context;
+	bool			*keep_going;
+	bool			stop;
+};
 
-	dir = opendir(events_dir);
-	if (!dir)
-		goto out_free;
+struct cpu_worker {
+	struct parallel_iterate	*iter;
+	struct cpu_iterate	*cpu;
+	pthread_t		thread;
+	/* Batches with records, from the reader thread to the merge */
+	struct spsc_ring	full;
+	/* Consumed batches, from the merge back to the reader thread */
+	struct spsc_ring	free;
+	struct record_batch	batches[NR_CPU_BATCHES];
+	struct record_batch	*curr;
+	/* The size of the pages of the batches */
+	int			page_size;
+	bool			done;
+};
 
-	while ((dent = readdir(dir))) {
-		const char *name = dent->d_name;
-		char *enable;
-		char *sys;
+/*
+ * tep_find_event() caches the last event found in the tep, so it can not
+ * be called from many threads at once. The per CPU threads look the ids
+ * up in a table made before they start, that they only read. The lazy
+ * events have their own table, that is safe to use from many threads.
+ */
+static int init_event_table(struct parallel_iterate *iter)
+{
+	struct tep_event *event;
+	int nr = tep_get_events_count(iter->tep);
+	int i;
 
-		if (strcmp(name, ".") == 0 ||
-		    strcmp(name, "..") == 0)
-			continue;
+	if (iter->lazy)
+		return 0;
 
-		sys = trace_append_file(events_dir, name);
-		ret = stat(sys, &st);
-		if (ret < 0 || !S_ISDIR(st.st_mode)) {
-			free(sys);
-			continue;
-		}
+	for (i = 0; i < nr; i++) {
+		event = tep_get_event(iter->tep, i);
+		if (event && event->id >= iter->nr_ids)
+			iter->nr_ids = event->id + 1;
+	}
 
-		enable = trace_append_file(sys, "enable");
+	iter->events = calloc(iter->nr_ids ? : 1, sizeof(*iter->events));
+	if (!iter->events)
+		return -1;
 
-		ret = stat(enable, &st);
-		if (ret >= 0) {
-			if (add_list_string(&systems, name) < 0)
-				goto out_free;
-		}
-		free(enable);
-		free(sys);
+	for (i = 0; i < nr; i++) {
+		event = tep_get_event(iter->tep, i);
+		if (event && event->id >= 0)
+			iter->events[event->id] = event;
 	}
 
-	closedir(dir);
+	return 0;
+}
 
- out_free:
-	free(events_dir);
-	return systems;
+static struct tep_event *parallel_find_event(struct parallel_iterate *iter, int id)
+{
+	if (iter->lazy)
+		return tracefs_lazy_find_event(iter->lazy, id);
+	if (id < 0 || id >= iter->nr_ids)
+		return NULL;
+	return iter->events[id];
 }
 
-/**
+static bool iterate_continue(struct parallel_iterate *iter)
+{
+	return *(volatile bool *)iter->keep_going &&
+		!__atomic_load_n(&iter->stop, __ATOMIC_ACQUIRE);
+}
+
+static void iterate_abort(struct parallel_iterate *iter)
+{
+	__atomic_store_n(&iter->stop, true, __ATOMIC_RELEASE);
+}
+
+/*
+ * Read the next sub-buffer of the CPU into @batch and decode all
+ * its records. Returns 0 on success and -1 if there's no more data.
+ */
+static int read_batch(struct cpu_worker *worker, struct record_batch *batch)
+{
+	struct tep_handle *tep = worker->iter->tep;
+	struct cpu_iterate *cpu = worker->cpu;
+	struct tep_record *record;
+	struct tep_event **events;
+	struct tep_record *records;
+	unsigned long long ts;
+	void *ptr;
+	int size;
+	int id;
+
+	/*
+	 * The records of a batch are used after the next sub-buffer is read,
+	 * so a mapped sub-buffer is copied, as the kernel takes it back.
+	 * That still saves the system call of each read.
+	 */
+	if (cpu->mapping) {
+		if (trace_mmap_copy_subbuf(cpu->mapping, cpu->kbuf, batch->page,
+					   worker->page_size) <= 0)
+			return -1;
+	} else {
+		size = read(cpu->fd, batch->page, cpu->psize);
+		if (size <= 0)
+			return -1;
+
+		kbuffer_load_subbuffer(cpu->kbuf, batch->page);
+		if (kbuffer_subbuffer_size(cpu->kbuf) > size) {
+			tracefs_warning("%s: page_size > %d", __func__, size);
+			return -1;
+		}
+	}
+
+	batch->nr_records = 0;
+	batch->next = 0;
+
+	while ((ptr = kbuffer_read_event(cpu->kbuf, &ts))) {
+		if (batch->nr_records == batch->alloc) {
+			size = batch->alloc ? batch->alloc * 2 : 64;
+			records = realloc(batch->records, size * sizeof(*records));
+			if (!records)
+				return -1;
+			memset(records + batch->alloc, 0,
+			       (size - batch->alloc) * sizeof(*records));
+			batch->records = records;
+			events = realloc(batch->events, size * sizeof(*events));
+			if (!events)
+				return -1;
+			batch->events = events;
+			batch->alloc = size;
+		}
+		record = &batch->records[batch->nr_records];
+		set_kbuf_record(record, cpu->kbuf, ts, ptr, cpu->cpu);
+
+		kbuffer_next_event(cpu->kbuf, NULL);
+
+		id = tep_data_type(tep, record);
+		batch->events[batch->nr_records] = parallel_find_event(worker->iter, id);
+		if (batch->events[batch->nr_records])
+			batch->nr_records++;
+	}
+
+	return 0;
+}
+
+/* Per CPU thread that feeds the merge with decoded sub-buffers */
+static void *read_cpu_thread(void *data)
+{
+	struct cpu_worker *worker = data;
+	struct record_batch *batch;
+
+	while (iterate_continue(worker->iter)) {
+		batch = ring_pop(&worker->free);
+		if (!batch) {
+			sched_yield();
+			continue;
+		}
+		if (read_batch(worker, batch) < 0)
+			break;
+		/* All batches fit in the ring, this can not fail */
+		ring_push(&worker->full, batch);
+	}
+
+	__atomic_store_n(&worker->done, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/* Per CPU thread that calls the callback directly, in unordered mode */
+static void *iterate_cpu_thread(void *data)
+{
+	struct cpu_worker *worker = data;
+	struct parallel_iterate *iter = worker->iter;
+	struct cpu_iterate *cpu = worker->cpu;
+
+	while (iterate_continue(iter)) {
+		if (read_next_record(iter->tep, cpu) < 0)
+			break;
+		if (iter->callback(cpu->event, &cpu->record, cpu->cpu,
+				   iter->callback_context)) {
+			iterate_abort(iter);
+			break;
+		}
+	}
+
+	__atomic_store_n(&worker->done, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/*
+ * Make sure that the current batch of @worker has a record to read.
+ * Waits for the reader thread if it did not produce it yet.
+ * Returns 0 if there's a record, or -1 if the CPU has no more data.
+ */
+static int worker_head(struct cpu_worker *worker)
+{
+	for (;;) {
+		if (worker->curr) {
+			if (worker->curr->next < worker->curr->nr_records)
+				return 0;
+			ring_push(&worker->free, worker->curr);
+			worker->curr = NULL;
+		}
+
+		worker->curr = ring_pop(&worker->full);
+		if (worker->curr)
+			continue;
+
+		if (__atomic_load_n(&worker->done, __ATOMIC_ACQUIRE)) {
+			/* The last batch could have been pushed before done */
+			worker->curr = ring_pop(&worker->full);
+			if (!worker->curr)
+				return -1;
+			continue;
+		}
+
+		if (!iterate_continue(worker->iter))
+			return -1;
+		sched_yield();
+	}
+}
+
+static unsigned long long worker_ts(struct cpu_worker *worker)
+{
+	return worker->curr->records[worker->curr->next].ts;
+}
+
+static void merge_cpu_workers(struct parallel_iterate *iter,
+			      struct cpu_worker *workers, int count)
+{
+	struct record_batch *batch;
+	struct cpu_worker *worker;
+	struct ts_heap heap;
+	int i;
+
+	if (ts_heap_init(&heap, count) < 0) {
+		iterate_abort(iter);
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!worker_head(&workers[i]))
+			ts_heap_add(&heap, worker_ts(&workers[i]), i);
+	}
+	ts_heap_build(&heap);
+
+	while (heap.nr && iterate_continue(iter)) {
+		worker = &workers[heap.nodes[0].idx];
+		batch = worker->curr;
+		if (iter->callback(batch->events[batch->next],
+				   &batch->records[batch->next],
+				   worker->cpu->cpu, iter->callback_context)) {
+			iterate_abort(iter);
+			break;
+		}
+		batch->next++;
+
+		if (!worker_head(worker))
+			ts_heap_replace_top(&heap, worker_ts(worker));
+		else
+			ts_heap_pop(&heap);
+	}
+
+	free(heap.nodes);
+}
+
+static void free_cpu_workers(struct cpu_worker *workers, int count)
+{
+	int i, b;
+
+	for (i = 0; i < count; i++) {
+		for (b = 0; b < NR_CPU_BATCHES; b++) {
+			free(workers[i].batches[b].page);
+			free(workers[i].batches[b].records);
+			free(workers[i].batches[b].events);
+		}
+	}
+	free(workers);
+}
+
+static int run_cpu_workers(struct parallel_iterate *iter,
+			   struct cpu_iterate *cpus, int count, bool ordered)
+{
+	void *(*thread_func)(void *);
+	struct cpu_worker *workers;
+	struct record_batch *batch;
+	int started = 0;
+	int ret = -1;
+	int i, b;
+
+	workers = calloc(count, sizeof(*workers));
+	if (!workers)
+		return -1;
+
+	thread_func = ordered ? read_cpu_thread : iterate_cpu_thread;
+
+	for (i = 0; i < count; i++) {
+		workers[i].iter = iter;
+		workers[i].cpu = &cpus[i];
+		if (iter->events) {
+			cpus[i].events = iter->events;
+			cpus[i].nr_events = iter->nr_ids;
+		}
+		if (!ordered)
+			continue;
+		cpus[i].kbuf = tep_kbuffer_alloc(iter->tep);
+		if (!cpus[i].kbuf)
+			goto out;
+		/* Like read_next_page(), map the ring buffer if possible */
+		if (!is_regular_file(cpus[i].fd))
+			cpus[i].mapping = trace_mmap(cpus[i].fd, cpus[i].kbuf);
+		else
+			cpus[i].psize = recorded_subbuf_size(iter->tep, &cpus[i]);
+		workers[i].page_size = cpus[i].psize;
+		if (cpus[i].mapping &&
+		    trace_mmap_subbuf_size(cpus[i].mapping) > cpus[i].psize)
+			workers[i].page_size = trace_mmap_subbuf_size(cpus[i].mapping);
+		for (b = 0; b < NR_CPU_BATCHES; b++) {
+			batch = &workers[i].batches[b];
+			batch->page = malloc(workers[i].page_size);
+			if (!batch->page)
+				goto out;
+			ring_push(&workers[i].free, batch);
+		}
+	}
+
+	for (started = 0; started < count; started++) {
+		if (pthread_create(&workers[started].thread, NULL,
+				   thread_func, &workers[started]))
+			break;
+	}
+
+	if (started < count)
+		iterate_abort(iter);
+	else if (ordered)
+		merge_cpu_workers(iter, workers, count);
+
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	if (started == count)
+		ret = 0;
+ out:
+	free_cpu_workers(workers, count);
+	return ret;
+}
+
+/**
+ * tracefs_iterate_raw_events_parallel - Iterate through events in trace_pipe_raw,
+ *					 reading each CPU buffer on its own thread
+ * @tep: a handle to the trace event parser context
+ * @instance: ftrace instance, can be NULL for the top instance
+ * @cpus: Iterate only through the buffers of CPUs, set in the mask.
+ *	  If NULL, iterate through all CPUs.
+ * @cpu_size: size of @cpus set
+ * @flags: TRACEFS_ITERATE_* flags that modify the iteration
+ * @callback: A user function, called for each record from the file
+ * @callback_context: A custom context, passed to the user callback function
+ *
+ * Like tracefs_iterate_raw_events(), but a thread is created for each
+ * CPU buffer, that reads and decodes its sub-buffers. The records are
+ * merged by timestamp and @callback is called for them on the calling
+ * thread, oldest first.
+ *
+ * If TRACEFS_ITERATE_UNORDERED is set in @flags, the records are not
+ * merged, and @callback is called directly from the per CPU threads.
+ * In that case, @callback may be called concurrently for different CPUs.
+ *
+ * If the @callback returns non-zero, the iteration stops.
+ *
+ * Returns -1 in case of an error, or 0 otherwise
+ */
+int tracefs_iterate_raw_events_parallel(struct tep_handle *tep,
+					struct tracefs_instance *instance,
+					cpu_set_t *cpus, int cpu_size,
+					unsigned int flags,
+					int (*callback)(struct tep_event *,
+							struct tep_record *,
+							int, void *),
+					void *callback_context)
+{
+	bool *keep_going = instance ? &instance->iterate_keep_going :
+				      &top_iterate_keep_going;
+	struct parallel_iterate iter = { };
+	struct cpu_iterate *all_cpus = NULL;
+	int count = 0;
+	int ret;
+
+	(*(volatile bool *)keep_going) = true;
+
+	if (!tep || !callback)
+		return -1;
+
+	iter.tep = tep;
+	iter.lazy = trace_lazy_events(tep);
+	iter.callback = callback;
+	iter.callback_context = callback_context;
+	iter.keep_going = keep_going;
+
+	ret = init_event_table(&iter);
+	if (ret < 0)
+		goto out;
+
+	ret = trace_open_cpu_files(instance, cpus, cpu_size, &all_cpus, &count);
+	if (ret < 0)
+		goto out;
+
+	ret = run_cpu_workers(&iter, all_cpus, count,
+			      !(flags & TRACEFS_ITERATE_UNORDERED));
+out:
+	trace_close_cpu_files(all_cpus, count);
+	trace_put_lazy_events(iter.lazy);
+	free(iter.events);
+	return ret;
+}
+
+static int read_cpu_batches(struct tep_handle *tep, struct cpu_iterate *cpus,
+			    int count, int batch_size,
+			    int (*callback)(struct tep_event **,
+					    struct tep_record *,
+					    int, void *),
+			    void *callback_context,
+			    bool *keep_going)
+{
+	struct tep_record *records = NULL;
+	struct tep_event **events = NULL;
+	struct ts_heap heap = { };
+	bool stop = false;
+	int ret = -1;
+	int nr = 0;
+	int i, j;
+
+	records = calloc(batch_size, sizeof(*records));
+	events = calloc(batch_size, sizeof(*events));
+	if (!records || !events || ts_heap_init(&heap, count) < 0)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		if (!read_next_record(tep, cpus + i))
+			ts_heap_add(&heap, cpus[i].record.ts, i);
+	}
+	ts_heap_build(&heap);
+
+	while (heap.nr && *(volatile bool *)keep_going) {
+		j = heap.nodes[0].idx;
+		records[nr] = cpus[j].record;
+		events[nr++] = cpus[j].event;
+		cpus[j].event = NULL;
+
+		if (nr == batch_size) {
+			stop = callback(events, records, nr, callback_context);
+			nr = 0;
+			if (stop)
+				break;
+		}
+
+		if (!read_page_record(tep, cpus + j)) {
+			ts_heap_replace_top(&heap, cpus[j].record.ts);
+			continue;
+		}
+
+		/*
+		 * The page of this CPU is consumed, and reading the next one
+		 * overwrites it. Pass the records that point into it first.
+		 */
+		if (nr) {
+			stop = callback(events, records, nr, callback_context);
+			nr = 0;
+			if (stop)
+				break;
+		}
+
+		if (!read_next_record(tep, cpus + j))
+			ts_heap_replace_top(&heap, cpus[j].record.ts);
+		else
+			ts_heap_pop(&heap);
+	}
+
+	/* The records were consumed from the buffers, do not lose them */
+	if (nr && !stop)
+		callback(events, records, nr, callback_context);
+
+	ret = 0;
+ out:
+	free(heap.nodes);
+	free(records);
+	free(events);
+	return ret;
+}
+
+/**
+ * tracefs_iterate_raw_events_batch - Iterate through events in trace_pipe_raw,
+ *				      passing them to the callback in batches
+ * @tep: a handle to the trace event parser context
+ * @instance: ftrace instance, can be NULL for the top instance
+ * @cpus: Iterate only through the buffers of CPUs, set in the mask.
+ *	  If NULL, iterate through all CPUs.
+ * @cpu_size: size of @cpus set
+ * @batch_size: The maximum number of records passed to @callback at once
+ * @callback: A user function, called with an array of records
+ * @callback_context: A custom context, passed to the user callback function
+ *
+ * Like tracefs_iterate_raw_events(), but instead of calling @callback for
+ * every record, the records are collected in an array that is passed to
+ * @callback together with the array of their events and the number of
+ * records in it. The records of all CPUs are merged, oldest first, as
+ * with tracefs_iterate_raw_events(). The CPU of each record is in its
+ * cpu field.
+ *
+ * A batch may be passed to @callback before it is full, as the records
+ * point into the per CPU pages, and a batch is flushed when one of these
+ * pages needs to be refilled. The arrays are reused for every batch and
+ * are only valid until @callback returns.
+ *
+ * If the @callback returns non-zero, the iteration stops - in that case all
+ * records from the current page will be lost from future reads.
+ *
+ * Returns -1 in case of an error, or 0 otherwise
+ */
+int tracefs_iterate_raw_events_batch(struct tep_handle *tep,
+				     struct tracefs_instance *instance,
+				     cpu_set_t *cpus, int cpu_size,
+				     int batch_size,
+				     int (*callback)(struct tep_event **,
+						     struct tep_record *,
+						     int, void *),
+				     void *callback_context)
+{
+	bool *keep_going = instance ? &instance->iterate_keep_going :
+				      &top_iterate_keep_going;
+	struct cpu_iterate *all_cpus = NULL;
+	int count = 0;
+	int ret;
+
+	(*(volatile bool *)keep_going) = true;
+
+	if (!tep || !callback || batch_size < 1)
+		return -1;
+
+	ret = trace_open_cpu_files(instance, cpus, cpu_size, &all_cpus, &count);
+	if (ret < 0)
+		goto out;
+	ret = read_cpu_batches(tep, all_cpus, count, batch_size,
+			       callback, callback_context,
+			       keep_going);
+out:
+	trace_close_cpu_files(all_cpus, count);
+	return ret;
+}
+
+struct tracefs_iterator {
+	struct tep_handle		*tep;
+	struct tracefs_instance		*instance;
+	struct cpu_iterate		*cpus;
+	struct epoll_event		*events;
+	int				nr_cpus;
+	int				epoll_fd;
+};
+
+/**
+ * tracefs_iterator_open - open the per CPU buffers for streaming
+ * @tep: a handle to the trace event parser context
+ * @instance: ftrace instance, can be NULL for the top instance
+ * @cpus: Iterate only through the buffers of CPUs, set in the mask.
+ *	  If NULL, iterate through all CPUs.
+ * @cpu_size: size of @cpus set
+ *
+ * Opens the trace_pipe_raw files of the CPUs and keeps them open until
+ * tracefs_iterator_close() is called, so that the buffers can be read
+ * continuously with tracefs_iterator_read().
+ *
+ * Returns an iterator that must be freed with tracefs_iterator_close(),
+ * or NULL on error.
+ */
+struct tracefs_iterator *tracefs_iterator_open(struct tep_handle *tep,
+					       struct tracefs_instance *instance,
+					       cpu_set_t *cpus, int cpu_size)
+{
+	struct tracefs_iterator *iter;
+	struct epoll_event ee = { };
+	int i;
+
+	if (!tep)
+		return NULL;
+
+	iter = calloc(1, sizeof(*iter));
+	if (!iter)
+		return NULL;
+
+	iter->tep = tep;
+	iter->epoll_fd = -1;
+
+	if (instance) {
+		if (trace_get_instance(instance) < 0) {
+			free(iter);
+			return NULL;
+		}
+		iter->instance = instance;
+	}
+
+	if (trace_open_cpu_files(instance, cpus, cpu_size, &iter->cpus, &iter->nr_cpus) < 0 ||
+	    !iter->nr_cpus)
+		goto error;
+
+	iter->events = calloc(iter->nr_cpus, sizeof(*iter->events));
+	if (!iter->events)
+		goto error;
+
+	iter->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (iter->epoll_fd < 0)
+		goto error;
+
+	ee.events = EPOLLIN;
+	for (i = 0; i < iter->nr_cpus; i++) {
+		ee.data.u32 = i;
+		if (epoll_ctl(iter->epoll_fd, EPOLL_CTL_ADD, iter->cpus[i].fd, &ee) < 0)
+			goto error;
+	}
+
+	return iter;
+ error:
+	tracefs_iterator_close(iter);
+	return NULL;
+}
+
+/**
+ * tracefs_iterator_close - close an iterator
+ * @iter: The iterator returned by tracefs_iterator_open()
+ *
+ * Closes the per CPU buffers and frees @iter.
+ */
+void tracefs_iterator_close(struct tracefs_iterator *iter)
+{
+	if (!iter)
+		return;
+
+	if (iter->epoll_fd >= 0)
+		close(iter->epoll_fd);
+	trace_close_cpu_files(iter->cpus, iter->nr_cpus);
+	if (iter->instance)
+		trace_put_instance(iter->instance);
+	free(iter->events);
+	free(iter);
+}
+
+/**
+ * tracefs_iterator_fd - get a file descriptor to wait on for data
+ * @iter: The iterator returned by tracefs_iterator_open()
+ *
+ * Returns a file descriptor that can be passed to poll(), select() or
+ * added to an epoll set of the application. It becomes readable when
+ * any of the per CPU buffers of @iter have data to read, at which point
+ * tracefs_iterator_read() can be called with a zero timeout.
+ *
+ * The file descriptor belongs to @iter and must not be closed.
+ */
+int tracefs_iterator_fd(struct tracefs_iterator *iter)
+{
+	if (!iter) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return iter->epoll_fd;
+}
+
+/**
+ * tracefs_iterator_set_watermark - set when readers of the buffers are woken
+ * @iter: The iterator returned by tracefs_iterator_open()
+ * @percent: How full (0 to 100) a CPU buffer must be to wake up a reader
+ *
+ * Sets the buffer_percent file of the instance of @iter, so that waiting
+ * for data only wakes up when a CPU buffer is at least @percent full.
+ * Note, this affects all the readers of the instance.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+int tracefs_iterator_set_watermark(struct tracefs_iterator *iter, int percent)
+{
+	char val[16];
+	int ret;
+
+	if (!iter || percent < 0 || percent > 100) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	snprintf(val, sizeof(val), "%d", percent);
+	ret = tracefs_instance_file_write(iter->instance, "buffer_percent", val);
+
+	return ret < 0 ? -1 : 0;
+}
+
+/**
+ * tracefs_iterator_read - wait for events and iterate through them
+ * @iter: The iterator returned by tracefs_iterator_open()
+ * @timeout: Milliseconds to wait for data, 0 to not wait, -1 to wait forever
+ * @callback: A user function, called for each record read
+ * @callback_context: A custom context, passed to the user callback function
+ *
+ * Sleeps until one of the CPU buffers of @iter has data, or until @timeout
+ * expires, without spinning on empty buffers. How much data a CPU buffer
+ * must have to wake up the reader is given by the buffer_percent file of
+ * the instance (see tracefs_iterator_set_watermark()). Then all the data
+ * that is currently in the buffers is read, and @callback is called for
+ * each record, oldest first, like tracefs_iterate_raw_events() does.
+ *
+ * If @callback returns non-zero, the iteration stops, and the records
+ * that were not read yet are kept for the next call.
+ *
+ * Returns the number of records passed to @callback, 0 if @timeout
+ * expired or a signal interrupted the wait, or -1 on error.
+ */
+int tracefs_iterator_read(struct tracefs_iterator *iter, int timeout,
+			  int (*callback)(struct tep_event *,
+					  struct tep_record *,
+					  int, void *),
+			  void *callback_context)
+{
+	bool *keep_going;
+	int ret;
+	int i;
+
+	if (!iter || (!callback && !has_followers(iter->instance))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	keep_going = iter->instance ? &iter->instance->iterate_keep_going :
+				      &top_iterate_keep_going;
+	(*(volatile bool *)keep_going) = true;
+
+	/* Do not wait if records were left over by the previous call */
+	for (i = 0; i < iter->nr_cpus; i++) {
+		if (iter->cpus[i].event) {
+			timeout = 0;
+			break;
+		}
+	}
+
+	ret = epoll_wait(iter->epoll_fd, iter->events, iter->nr_cpus, timeout);
+	if (ret < 0)
+		return errno == EINTR ? 0 : -1;
+	if (!ret && i == iter->nr_cpus)
+		return 0;
+
+	return iterate_cpus(iter->tep, iter->instance, iter->cpus, iter->nr_cpus,
+			    callback, callback_context, keep_going);
+}
+
+/**
+ * tracefs_iterate_stop - stop the iteration over the raw events.
+ * @instance: ftrace instance, can be NULL for top tracing instance.
+ */
+void tracefs_iterate_stop(struct tracefs_instance *instance)
+{
+	if (instance)
+		instance->iterate_keep_going = false;
+	else
+		top_iterate_keep_going = false;
+}
+
+static int add_list_string(char ***list, const char *name)
+{
+	char **tmp;
+
+	tmp = tracefs_list_add(*list, name);
+	if (!tmp) {
+		tracefs_list_free(*list);
+		*list = NULL;
+		return -1;
+	}
+
+	*list = tmp;
+	return 0;
+}
+
+__hidden char *trace_append_file(const char *dir, const char *name)
+{
+	char *file;
+	int ret;
+
+	ret = asprintf(&file, "%s/%s", dir, name);
+
+	return ret < 0 ? NULL : file;
+}
+
+static int event_file(char **path, const char *system,
+		      const char *event, const char *file)
+{
+	if (!system || !event || !file)
+		return -1;
+
+	return asprintf(path, "events/%s/%s/%s",
+			system, event, file);
+}
+
+/**
+ * tracefs_event_get_file - return a file in an event directory
+ * @instance: The instance the event is in (NULL for top level)
+ * @system: The system name that the event file is in
+ * @event: The event name of the event
+ * @file: The name of the file in the event directory.
+ *
+ * Returns a path to a file in the event director.
+ * or NULL on error. The path returned must be freed with
+ * tracefs_put_tracing_file().
+ */
+char *tracefs_event_get_file(struct tracefs_instance *instance,
+			     const char *system, const char *event,
+			     const char *file)
+{
+	char *instance_path;
+	char *path;
+	int ret;
+
+	ret = event_file(&path, system, event, file);
+	if (ret < 0)
+		return NULL;
+
+	instance_path = tracefs_instance_get_file(instance, path);
+	free(path);
+
+	return instance_path;
+}
+
+/**
+ * tracefs_event_file_read - read the content from an event file
+ * @instance: The instance the event is in (NULL for top level)
+ * @system: The system name that the event file is in
+ * @event: The event name of the event
+ * @file: The name of the file in the event directory.
+ * @psize: the size of the content read.
+ *
+ * Reads the content of the event file that is passed via the
+ * arguments and returns the content.
+ *
+ * Return a string containing the content of the file or NULL
+ * on error. The string returned must be freed with free().
+ */
+char *tracefs_event_file_read(struct tracefs_instance *instance,
+			      const char *system, const char *event,
+			      const char *file, int *psize)
+{
+	char *content;
+	char *path;
+	int ret;
+
+	ret = event_file(&path, system, event, file);
+	if (ret < 0)
+		return NULL;
+
+	content = tracefs_instance_file_read(instance, path, psize);
+	free(path);
+	return content;
+}
+
+/**
+ * tracefs_event_file_write - write to an event file
+ * @instance: The instance the event is in (NULL for top level)
+ * @system: The system name that the event file is in
+ * @event: The event name of the event
+ * @file: The name of the file in the event directory.
+ * @str: The string to write into the file
+ *
+ * Writes the content of @str to a file in the instance directory.
+ * The content of the file will be overwritten by @str.
+ *
+ * Return 0 on success, and -1 on error.
+ */
+int tracefs_event_file_write(struct tracefs_instance *instance,
+			     const char *system, const char *event,
+			     const char *file, const char *str)
+{
+	char *path;
+	int ret;
+
+	ret = event_file(&path, system, event, file);
+	if (ret < 0)
+		return -1;
+
+	ret = tracefs_instance_file_write(instance, path, str);
+	free(path);
+	return ret;
+}
+
+/**
+ * tracefs_event_file_append - write to an event file
+ * @instance: The instance the event is in (NULL for top level)
+ * @system: The system name that the event file is in
+ * @event: The event name of the event
+ * @file: The name of the file in the event directory.
+ * @str: The string to write into the file
+ *
+ * Writes the content of @str to a file in the instance directory.
+ * The content of @str will be appended to the content of the file.
+ * The current content should not be lost.
+ *
+ * Return 0 on success, and -1 on error.
+ */
+int tracefs_event_file_append(struct tracefs_instance *instance,
+			      const char *system, const char *event,
+			      const char *file, const char *str)
+{
+	char *path;
+	int ret;
+
+	ret = event_file(&path, system, event, file);
+	if (ret < 0)
+		return -1;
+
+	ret = tracefs_instance_file_append(instance, path, str);
+	free(path);
+	return ret;
+}
+
+/**
+ * tracefs_event_file_clear - clear an event file
+ * @instance: The instance the event is in (NULL for top level)
+ * @system: The system name that the event file is in
+ * @event: The event name of the event
+ * @file: The name of the file in the event directory.
+ *
+ * Clears the content of the event file. That is, it is opened
+ * with O_TRUNC and then closed.
+ *
+ * Return 0 on success, and -1 on error.
+ */
+int tracefs_event_file_clear(struct tracefs_instance *instance,
+			     const char *system, const char *event,
+			     const char *file)
+{
+	char *path;
+	int ret;
+
+	ret = event_file(&path, system, event, file);
+	if (ret < 0)
+		return -1;
+
+	ret = tracefs_instance_file_clear(instance, path);
+	free(path);
+	return ret;
+}
+
+/**
+ * tracefs_event_file_exits - test if a file exists
+ * @instance: The instance the event is in (NULL for top level)
+ * @system: The system name that the event file is in
+ * @event: The event name of the event
+ * @file: The name of the file in the event directory.
+ *
+ * Return true if the file exists, false if it odes not or
+ * an error occurred.
+ */
+bool tracefs_event_file_exists(struct tracefs_instance *instance,
+			       const char *system, const char *event,
+			       const char *file)
+{
+	char *path;
+	bool ret;
+
+	if (event_file(&path, system, event, file) < 0)
+		return false;
+
+	ret = tracefs_file_exists(instance, path);
+	free(path);
+	return ret;
+}
+
+/**
+ * tracefs_event_systems - return list of systems for tracing
+ * @tracing_dir: directory holding the "events" directory
+ *		 if NULL, top tracing directory is used
+ *
+ * Returns an allocated list of system names. Both the names and
+ * the list must be freed with tracefs_list_free()
+ * The list returned ends with a "NULL" pointer
+ */
+char **tracefs_event_systems(const char *tracing_dir)
+{
+	struct dirent *dent;
+	char **systems = NULL;
+	char *events_dir;
+	DIR *dir;
+
+	if (!tracing_dir)
+		tracing_dir = tracefs_tracing_dir();
+
+	if (!tracing_dir)
+		return NULL;
+
+	events_dir = trace_append_file(tracing_dir, "events");
+	if (!events_dir)
+		return NULL;
+
+	/*
+	 * Search all the directories in the events directory,
+	 * and collect the ones that have the "enable" file.
+	 */
+	dir = trace_opendir_at(AT_FDCWD, events_dir);
+	if (!dir)
+		goto out_free;
+
+	/* Look up the entries relative to the directory, not by full path */
+	while ((dent = readdir(dir))) {
+		const char *name = dent->d_name;
+
+		if (strcmp(name, ".") == 0 ||
+		    strcmp(name, "..") == 0)
+			continue;
+
+		if (!trace_dirent_is_dir(dir, dent) ||
+		    !trace_dirent_has_file(dir, dent, "enable"))
+			continue;
+
+		if (add_list_string(&systems, name) < 0)
+			break;
+	}
+
+	closedir(dir);
+
+ out_free:
+	free(events_dir);
+	return systems;
+}
+
+/**
  * tracefs_system_events - return list of events for system
  * @tracing_dir: directory holding the "events" directory
  * @system: the system to return the events for
@@ -569,393 +1929,1276 @@ char **tracefs_event_systems(const char *tracing_dir)
  */
 char **tracefs_system_events(const char *tracing_dir, const char *system)
 {
-	struct dirent *dent;
-	char **events = NULL;
-	char *system_dir = NULL;
-	struct stat st;
-	DIR *dir;
+	struct dirent *dent;
+	char **events = NULL;
+	char *system_dir = NULL;
+	DIR *dir;
+
+	if (!tracing_dir)
+		tracing_dir = tracefs_tracing_dir();
+
+	if (!tracing_dir || !system)
+		return NULL;
+
+	asprintf(&system_dir, "%s/events/%s", tracing_dir, system);
+	if (!system_dir)
+		return NULL;
+
+	dir = trace_opendir_at(AT_FDCWD, system_dir);
+	if (!dir)
+		goto out_free;
+
+	while ((dent = readdir(dir))) {
+		const char *name = dent->d_name;
+
+		if (strcmp(name, ".") == 0 ||
+		    strcmp(name, "..") == 0)
+			continue;
+
+		if (!trace_dirent_is_dir(dir, dent))
+			continue;
+
+		if (add_list_string(&events, name) < 0)
+			break;
+	}
+
+	closedir(dir);
+
+ out_free:
+	free(system_dir);
+
+	return events;
+}
+
+/**
+ * tracefs_tracers - returns an array of available tracers
+ * @tracing_dir: The directory that contains the tracing directory
+ *
+ * Returns an allocate list of plugins. The array ends with NULL
+ * Both the plugin names and array must be freed with tracefs_list_free()
+ */
+char **tracefs_tracers(const char *tracing_dir)
+{
+	char *available_tracers;
+	struct stat st;
+	char **plugins = NULL;
+	char *buf;
+	char *str, *saveptr;
+	char *plugin;
+	int slen;
+	int len;
+	int ret;
+
+	if (!tracing_dir)
+		tracing_dir = tracefs_tracing_dir();
+
+	if (!tracing_dir)
+		return NULL;
+
+	available_tracers = trace_append_file(tracing_dir, "available_tracers");
+	if (!available_tracers)
+		return NULL;
+
+	ret = stat(available_tracers, &st);
+	if (ret < 0)
+		goto out_free;
+
+	len = str_read_file(available_tracers, &buf, true);
+	if (len <= 0)
+		goto out_free;
+
+	for (str = buf; ; str = NULL) {
+		plugin = strtok_r(str, " ", &saveptr);
+		if (!plugin)
+			break;
+		slen = strlen(plugin);
+		if (!slen)
+			continue;
+
+		/* chop off any newlines */
+		if (plugin[slen - 1] == '\n')
+			plugin[slen - 1] = '\0';
+
+		/* Skip the non tracers */
+		if (strcmp(plugin, "nop") == 0 ||
+		    strcmp(plugin, "none") == 0)
+			continue;
+
+		if (add_list_string(&plugins, plugin) < 0)
+			break;
+	}
+	free(buf);
+
+ out_free:
+	free(available_tracers);
+
+	return plugins;
+}
+
+/*
+ * The event cache file starts with a cache_header followed by the
+ * cache key, and then holds the content of every file that was parsed
+ * into the tep, each as a cache_entry followed by the system name and
+ * the file content (both nul terminated). A CACHE_END entry closes it.
+ */
+#define EVENTS_CACHE_MAGIC	"TFSCACHE"
+#define EVENTS_CACHE_VERSION	1
+
+enum cache_type {
+	CACHE_END,
+	CACHE_HEADER_PAGE,
+	CACHE_FORMAT,
+	CACHE_PRINTK_FORMATS,
+};
+
+struct cache_header {
+	char			magic[8];
+	uint32_t		version;
+	uint32_t		key_len;
+};
+
+struct cache_entry {
+	uint32_t		type;
+	uint32_t		sys_len;
+	uint32_t		len;
+};
+
+static void cache_write(FILE *cache, enum cache_type type,
+			const char *system, const char *buf, int len)
+{
+	struct cache_entry entry;
+
+	if (!cache)
+		return;
+
+	entry.type = type;
+	entry.sys_len = system ? strlen(system) + 1 : 0;
+	entry.len = len + 1;
+
+	fwrite(&entry, sizeof(entry), 1, cache);
+	if (system)
+		fwrite(system, entry.sys_len, 1, cache);
+	fwrite(buf, len, 1, cache);
+	fputc('\0', cache);
+}
+
+/* Maximum number of threads reading the event format files */
+#define MAX_FORMAT_THREADS	8
+/* Do not start threads to read less format files than this, per thread */
+#define FORMATS_PER_THREAD	64
+
+struct format_job {
+	const char		*system;
+	char			*path;
+	char			*buf;
+	int			len;
+	/* The index of the system in the failures, or -1 to not count it */
+	int			sys_idx;
+	bool			done;
+};
+
+/*
+ * The format files are read by a pool of threads, in any order, while
+ * the calling thread parses them into the tep in the order of @jobs.
+ */
+struct format_loader {
+	struct format_job	*jobs;
+	int			nr_jobs;
+	/* The next job to read, claimed with an atomic increment */
+	int			next;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+};
+
+static bool read_next_format(struct format_loader *loader)
+{
+	struct format_job *job;
+	int i;
+
+	i = __atomic_fetch_add(&loader->next, 1, __ATOMIC_RELAXED);
+	if (i >= loader->nr_jobs)
+		return false;
+
+	job = &loader->jobs[i];
+	job->len = str_read_file(job->path, &job->buf, true);
+
+	pthread_mutex_lock(&loader->lock);
+	job->done = true;
+	pthread_cond_broadcast(&loader->cond);
+	pthread_mutex_unlock(&loader->lock);
+
+	return true;
+}
+
+static void *format_thread(void *data)
+{
+	struct format_loader *loader = data;
+
+	while (read_next_format(loader))
+		;
+
+	return NULL;
+}
+
+/* Wait for the job at @i to be read, helping the threads meanwhile */
+static void wait_format(struct format_loader *loader, int i)
+{
+	struct format_job *job = &loader->jobs[i];
+	bool done;
+
+	for (;;) {
+		pthread_mutex_lock(&loader->lock);
+		done = job->done;
+		pthread_mutex_unlock(&loader->lock);
+		if (done)
+			return;
+		if (!read_next_format(loader))
+			break;
+	}
+
+	pthread_mutex_lock(&loader->lock);
+	while (!job->done)
+		pthread_cond_wait(&loader->cond, &loader->lock);
+	pthread_mutex_unlock(&loader->lock);
+}
+
+static int add_format_jobs(struct format_loader *loader, const char *tracing_dir,
+			   const char *system, int sys_idx)
+{
+	struct format_job *jobs;
+	char **events;
+	int ret = 0;
+	int i;
+
+	events = tracefs_system_events(tracing_dir, system);
+	if (!events)
+		return -ENOENT;
+
+	for (i = 0; events[i]; i++) {
+		jobs = realloc(loader->jobs, (loader->nr_jobs + 1) * sizeof(*jobs));
+		if (!jobs) {
+			ret = -ENOMEM;
+			break;
+		}
+		loader->jobs = jobs;
+		jobs += loader->nr_jobs;
+		memset(jobs, 0, sizeof(*jobs));
+		if (asprintf(&jobs->path, "%s/events/%s/%s/format",
+			     tracing_dir, system, events[i]) < 0) {
+			ret = -ENOMEM;
+			break;
+		}
+		jobs->system = system;
+		jobs->sys_idx = sys_idx;
+		loader->nr_jobs++;
+	}
+
+	tracefs_list_free(events);
+	return ret;
+}
+
+static int nr_format_threads(int nr_jobs)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int nr = nr_jobs / FORMATS_PER_THREAD;
+
+	/* The calling thread reads formats too */
+	if (nr > cpus - 1)
+		nr = cpus - 1;
+	if (nr > MAX_FORMAT_THREADS)
+		nr = MAX_FORMAT_THREADS;
+
+	return nr > 0 ? nr : 0;
+}
+
+/*
+ * Load the event formats of @systems (and ftrace if @ftrace is set) into
+ * @tep. The systems that had failures are marked in @failed.
+ */
+static void load_events(struct tep_handle *tep, const char *tracing_dir,
+			char **systems, int nr_systems, bool ftrace, bool *failed,
+			FILE *cache)
+{
+	struct format_loader loader = { };
+	struct format_job *job;
+	pthread_t *threads;
+	int nr_threads;
+	int started = 0;
+	int i;
+
+	for (i = 0; i < nr_systems; i++) {
+		if (add_format_jobs(&loader, tracing_dir, systems[i], i))
+			failed[i] = true;
+	}
+
+	/* Include ftrace, as it is excluded for not having "enable" file */
+	if (ftrace)
+		add_format_jobs(&loader, tracing_dir, "ftrace", -1);
+
+	pthread_mutex_init(&loader.lock, NULL);
+	pthread_cond_init(&loader.cond, NULL);
+
+	nr_threads = nr_format_threads(loader.nr_jobs);
+	threads = nr_threads ? calloc(nr_threads, sizeof(*threads)) : NULL;
+	if (threads) {
+		for (; started < nr_threads; started++) {
+			if (pthread_create(&threads[started], NULL,
+					   format_thread, &loader))
+				break;
+		}
+	}
+
+	/* tep is not thread safe, parse the formats in order on this thread */
+	for (i = 0; i < loader.nr_jobs; i++) {
+		job = &loader.jobs[i];
+		wait_format(&loader, i);
+		if (job->len < 0 ||
+		    (job->len > 0 && tep_parse_event(tep, job->buf, job->len, job->system))) {
+			if (job->sys_idx >= 0)
+				failed[job->sys_idx] = true;
+		} else if (job->len > 0) {
+			cache_write(cache, CACHE_FORMAT, job->system, job->buf, job->len);
+		}
+		free(job->buf);
+		free(job->path);
+	}
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	pthread_cond_destroy(&loader.cond);
+	pthread_mutex_destroy(&loader.lock);
+	free(loader.jobs);
+}
+
+static int read_header(struct tep_handle *tep, const char *tracing_dir,
+		       FILE *cache)
+{
+	struct stat st;
+	char *header;
+	char *buf;
+	int len;
+	int ret = -1;
+
+	header = trace_append_file(tracing_dir, "events/header_page");
+
+	ret = stat(header, &st);
+	if (ret < 0)
+		goto out;
+
+	len = str_read_file(header, &buf, true);
+	if (len <= 0)
+		goto out;
+
+	tep_parse_header_page(tep, buf, len, sizeof(long));
+	cache_write(cache, CACHE_HEADER_PAGE, NULL, buf, len);
+
+	free(buf);
+
+	ret = 0;
+ out:
+	free(header);
+	return ret;
+}
+
+static bool contains(const char *name, const char * const *names)
+{
+	if (!names)
+		return false;
+	for (; *names; names++)
+		if (strcmp(name, *names) == 0)
+			return true;
+	return false;
+}
+
+static int load_saved_cmdlines(const char *tracing_dir,
+			       struct tep_handle *tep, bool warn)
+{
+	char *path;
+	char *buf;
+	int ret;
+
+	path = trace_append_file(tracing_dir, "saved_cmdlines");
+	if (!path)
+		return -1;
+
+	ret = str_read_file(path, &buf, false);
+	free(path);
+	if (ret <= 0)
+		return -1;
+
+	ret = tep_parse_saved_cmdlines(tep, buf);
+	free(buf);
+
+	return ret;
+}
+
+static void load_printk_formats(const char *tracing_dir,
+				struct tep_handle *tep, FILE *cache)
+{
+	char *path;
+	char *buf;
 	int ret;
 
+	path = trace_append_file(tracing_dir, "printk_formats");
+	if (!path)
+		return;
+
+	ret = str_read_file(path, &buf, false);
+	free(path);
+	if (ret <= 0)
+		return;
+
+	tep_parse_printk_formats(tep, buf);
+	cache_write(cache, CACHE_PRINTK_FORMATS, NULL, buf, ret);
+	free(buf);
+}
+
+/*
+ * Do a best effort attempt to load kallsyms (when first used), saved_cmdlines
+ * and printk_formats. If they can not be loaded, then this will not
+ * do the mappings. But this does not fail the loading of events.
+ */
+static void load_mappings(const char *tracing_dir,
+			  struct tep_handle *tep, FILE *cache)
+{
+	/* The symbols are only loaded when an address is resolved */
+	trace_load_kallsyms(tep);
+
+	/* If there's no tracing_dir no reason to go further */
 	if (!tracing_dir)
 		tracing_dir = tracefs_tracing_dir();
 
-	if (!tracing_dir || !system)
-		return NULL;
+	if (!tracing_dir)
+		return;
 
-	asprintf(&system_dir, "%s/events/%s", tracing_dir, system);
-	if (!system_dir)
-		return NULL;
+	load_saved_cmdlines(tracing_dir, tep, false);
+	load_printk_formats(tracing_dir, tep, cache);
+}
 
-	ret = stat(system_dir, &st);
-	if (ret < 0 || !S_ISDIR(st.st_mode))
-		goto out_free;
+int tracefs_load_cmdlines(const char *tracing_dir, struct tep_handle *tep)
+{
 
-	dir = opendir(system_dir);
-	if (!dir)
-		goto out_free;
+	if (!tracing_dir)
+		tracing_dir = tracefs_tracing_dir();
 
-	while ((dent = readdir(dir))) {
-		const char *name = dent->d_name;
-		char *event;
+	if (!tracing_dir)
+		return -1;
 
-		if (strcmp(name, ".") == 0 ||
-		    strcmp(name, "..") == 0)
-			continue;
+	return load_saved_cmdlines(tracing_dir, tep, true);
+}
+
+static int fill_local_events_system(const char *tracing_dir,
+				    struct tep_handle *tep,
+				    const char * const *sys_names,
+				    int *parsing_failures, FILE *cache)
+{
+	char **systems = NULL;
+	bool *failed = NULL;
+	int nr_systems = 0;
+	int ret;
+	int i;
+
+	if (!tracing_dir)
+		tracing_dir = tracefs_tracing_dir();
+	if (!tracing_dir)
+		return -1;
+
+	systems = tracefs_event_systems(tracing_dir);
+	if (!systems)
+		return -1;
+
+	ret = read_header(tep, tracing_dir, cache);
+	if (ret < 0) {
+		ret = -1;
+		goto out;
+	}
 
-		event = trace_append_file(system_dir, name);
-		ret = stat(event, &st);
-		if (ret < 0 || !S_ISDIR(st.st_mode)) {
-			free(event);
+	if (parsing_failures)
+		*parsing_failures = 0;
+
+	/* Only keep the requested systems */
+	for (i = 0; systems[i]; i++) {
+		if (sys_names && !contains(systems[i], sys_names)) {
+			free(systems[i]);
 			continue;
 		}
+		systems[nr_systems++] = systems[i];
+	}
+	systems[nr_systems] = NULL;
 
-		if (add_list_string(&events, name) < 0)
-			goto out_free;
+	failed = calloc(nr_systems + 1, sizeof(*failed));
+	if (!failed) {
+		ret = -1;
+		goto out;
+	}
 
-		free(event);
+	load_events(tep, tracing_dir, systems, nr_systems,
+		    !sys_names || contains("ftrace", sys_names), failed, cache);
+
+	for (i = 0; i < nr_systems; i++) {
+		if (failed[i] && parsing_failures)
+			(*parsing_failures)++;
 	}
 
-	closedir(dir);
+	load_mappings(tracing_dir, tep, cache);
 
- out_free:
-	free(system_dir);
+	/* always succeed because parsing failures are not critical */
+	ret = 0;
+out:
+	free(failed);
+	tracefs_list_free(systems);
+	return ret;
+}
 
-	return events;
+/**
+ * tracefs_local_events_system - create a tep from the events of the specified subsystem.
+ *
+ * @tracing_dir: The directory that contains the events.
+ * @sys_name: Array of system names, to load the events from.
+ * The last element from the array must be NULL
+ *
+ * Returns a tep structure that contains the tep local to
+ * the system.
+ */
+struct tep_handle *tracefs_local_events_system(const char *tracing_dir,
+					       const char * const *sys_names)
+{
+	struct tep_handle *tep = NULL;
+
+	tep = tep_alloc();
+	if (!tep)
+		return NULL;
+
+	if (fill_local_events_system(tracing_dir, tep, sys_names, NULL, NULL)) {
+		tep_free(tep);
+		tep = NULL;
+	}
+
+	return tep;
 }
 
 /**
- * tracefs_tracers - returns an array of available tracers
- * @tracing_dir: The directory that contains the tracing directory
+ * tracefs_local_events - create a tep from the events on system
+ * @tracing_dir: The directory that contains the events.
  *
- * Returns an allocate list of plugins. The array ends with NULL
- * Both the plugin names and array must be freed with tracefs_list_free()
+ * Returns a tep structure that contains the teps local to
+ * the system.
  */
-char **tracefs_tracers(const char *tracing_dir)
+struct tep_handle *tracefs_local_events(const char *tracing_dir)
 {
-	char *available_tracers;
-	struct stat st;
-	char **plugins = NULL;
-	char *buf;
-	char *str, *saveptr;
-	char *plugin;
-	int slen;
-	int len;
-	int ret;
+	return tracefs_local_events_system(tracing_dir, NULL);
+}
 
-	if (!tracing_dir)
-		tracing_dir = tracefs_tracing_dir();
+/**
+ * tracefs_fill_local_events - Fill a tep with the events on system
+ * @tracing_dir: The directory that contains the events.
+ * @tep: Allocated tep handler which will be filled
+ * @parsing_failures: return number of failures while parsing the event files
+ *
+ * Returns whether the operation succeeded
+ */
+int tracefs_fill_local_events(const char *tracing_dir,
+			       struct tep_handle *tep, int *parsing_failures)
+{
+	return fill_local_events_system(tracing_dir, tep,
+					NULL, parsing_failures, NULL);
+}
 
-	if (!tracing_dir)
+/*
+ * The cache is only valid for the same kernel, booted the same time
+ * with the same modules, and with the same events (new ones come with
+ * modules, but also with dynamic events).
+ */
+static char *events_cache_key(const char *tracing_dir)
+{
+	unsigned long long events_hash;
+	char *kernel_id;
+	char *path;
+	char *key;
+	int ret;
+
+	kernel_id = trace_kernel_id();
+	if (!kernel_id)
 		return NULL;
 
-	available_tracers = trace_append_file(tracing_dir, "available_tracers");
-	if (!available_tracers)
+	path = trace_append_file(tracing_dir, "available_events");
+	if (!path) {
+		free(kernel_id);
 		return NULL;
+	}
+	events_hash = trace_hash_file(path, false);
+	free(path);
 
-	ret = stat(available_tracers, &st);
-	if (ret < 0)
-		goto out_free;
+	ret = asprintf(&key, "%s\n%s\n%llx", kernel_id, tracing_dir, events_hash);
+	free(kernel_id);
 
-	len = str_read_file(available_tracers, &buf, true);
-	if (len <= 0)
-		goto out_free;
+	return ret < 0 ? NULL : key;
+}
 
-	for (str = buf; ; str = NULL) {
-		plugin = strtok_r(str, " ", &saveptr);
-		if (!plugin)
+static int parse_cache_entry(struct tep_handle *tep, struct cache_entry *entry,
+			     const char *system, char *buf)
+{
+	switch (entry->type) {
+	case CACHE_HEADER_PAGE:
+		return tep_parse_header_page(tep, buf, entry->len - 1, sizeof(long));
+	case CACHE_FORMAT:
+		if (!system)
+			return -1;
+		tep_parse_event(tep, buf, entry->len - 1, system);
+		return 0;
+	case CACHE_PRINTK_FORMATS:
+		tep_parse_printk_formats(tep, buf);
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/* Returns 0 if @tep was filled from @cache_file, -1 if it is not valid */
+static int load_events_cache(struct tep_handle *tep, const char *cache_file,
+			     const char *key)
+{
+	struct cache_header *header;
+	struct cache_entry entry;
+	size_t key_len = strlen(key);
+	const char *system;
+	struct stat st;
+	char *map = NULL;
+	char *end;
+	char *p;
+	int ret = -1;
+	int fd;
+
+	fd = open(cache_file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*header) + key_len)
+		goto out;
+
+	/* Private and writable, as the tep parsers do not take const buffers */
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		map = NULL;
+		goto out;
+	}
+	end = map + st.st_size;
+
+	header = (struct cache_header *)map;
+	if (memcmp(header->magic, EVENTS_CACHE_MAGIC, sizeof(header->magic)) ||
+	    header->version != EVENTS_CACHE_VERSION ||
+	    header->key_len != key_len ||
+	    memcmp(map + sizeof(*header), key, key_len))
+		goto out;
+
+	for (p = map + sizeof(*header) + key_len; ; ) {
+		if (end - p < sizeof(entry))
+			goto out;
+		memcpy(&entry, p, sizeof(entry));
+		p += sizeof(entry);
+
+		if (entry.type == CACHE_END)
 			break;
-		slen = strlen(plugin);
-		if (!slen)
-			continue;
 
-		/* chop off any newlines */
-		if (plugin[slen - 1] == '\n')
-			plugin[slen - 1] = '\0';
+		if (!entry.len || entry.sys_len > end - p ||
+		    entry.len > end - p - entry.sys_len)
+			goto out;
+
+		system = entry.sys_len ? p : NULL;
+		if (system && p[entry.sys_len - 1] != '\0')
+			goto out;
+		p += entry.sys_len;
+		if (p[entry.len - 1] != '\0')
+			goto out;
+
+		if (parse_cache_entry(tep, &entry, system, p))
+			goto out;
+		p += entry.len;
+	}
+	ret = 0;
+ out:
+	if (map)
+		munmap(map, st.st_size);
+	close(fd);
+	return ret;
+}
+
+/* Start a new cache in a temporary file, it is renamed when complete */
+static FILE *create_events_cache(const char *cache_file, const char *key,
+				 char **tmp_file)
+{
+	struct cache_header header = { };
+	FILE *cache;
+	int fd;
+
+	if (asprintf(tmp_file, "%s.XXXXXX", cache_file) < 0) {
+		*tmp_file = NULL;
+		return NULL;
+	}
+
+	/* mkstemp() creates it 0600, only the owner needs it */
+	fd = mkstemp(*tmp_file);
+	if (fd < 0)
+		goto fail;
+
+	cache = fdopen(fd, "w");
+	if (!cache) {
+		close(fd);
+		unlink(*tmp_file);
+		goto fail;
+	}
+
+	memcpy(header.magic, EVENTS_CACHE_MAGIC, sizeof(header.magic));
+	header.version = EVENTS_CACHE_VERSION;
+	header.key_len = strlen(key);
+	fwrite(&header, sizeof(header), 1, cache);
+	fwrite(key, header.key_len, 1, cache);
+
+	return cache;
+ fail:
+	free(*tmp_file);
+	*tmp_file = NULL;
+	return NULL;
+}
+
+static void close_events_cache(FILE *cache, char *tmp_file,
+			       const char *cache_file, bool commit)
+{
+	struct cache_entry entry = { .type = CACHE_END };
+
+	if (!cache)
+		return;
+
+	fwrite(&entry, sizeof(entry), 1, cache);
+	if (ferror(cache))
+		commit = false;
+	if (fclose(cache))
+		commit = false;
+
+	if (!commit || rename(tmp_file, cache_file) < 0)
+		unlink(tmp_file);
+	free(tmp_file);
+}
+
+/**
+ * tracefs_local_events_cached - create a tep from the events on system, using a cache
+ * @tracing_dir: The directory that contains the events.
+ * @cache_file: The file to cache the events in.
+ *
+ * Like tracefs_local_events(), but if @cache_file holds the events of
+ * the running kernel (same kernel, same boot, same events and modules),
+ * the tep is built from it instead of the many files of @tracing_dir.
+ * Otherwise the events are loaded from @tracing_dir, and @cache_file
+ * is (re)created with them. If @cache_file is NULL, this is the same
+ * as tracefs_local_events().
+ *
+ * Note, the saved_cmdlines are not cached, they are always read from
+ * @tracing_dir.
+ *
+ * Returns a tep structure that contains the teps local to
+ * the system, or NULL on error.
+ */
+struct tep_handle *tracefs_local_events_cached(const char *tracing_dir,
+					       const char *cache_file)
+{
+	struct tep_handle *tep;
+	char *tmp_file = NULL;
+	FILE *cache = NULL;
+	char *key;
+
+	if (!cache_file)
+		return tracefs_local_events(tracing_dir);
+
+	if (!tracing_dir)
+		tracing_dir = tracefs_tracing_dir();
+	if (!tracing_dir)
+		return NULL;
 
-		/* Skip the non tracers */
-		if (strcmp(plugin, "nop") == 0 ||
-		    strcmp(plugin, "none") == 0)
-			continue;
+	key = events_cache_key(tracing_dir);
 
-		if (add_list_string(&plugins, plugin) < 0)
-			break;
+	tep = tep_alloc();
+	if (!tep)
+		goto out;
+
+	if (key && !load_events_cache(tep, cache_file, key)) {
+		trace_load_kallsyms(tep);
+		load_saved_cmdlines(tracing_dir, tep, false);
+		goto out;
 	}
-	free(buf);
 
- out_free:
-	free(available_tracers);
+	/* The cache may have been partially loaded */
+	tep_free(tep);
+	tep = tep_alloc();
+	if (!tep)
+		goto out;
 
-	return plugins;
+	if (key)
+		cache = create_events_cache(cache_file, key, &tmp_file);
+
+	if (fill_local_events_system(tracing_dir, tep, NULL, NULL, cache)) {
+		tep_free(tep);
+		tep = NULL;
+	}
+
+	close_events_cache(cache, tmp_file, cache_file, tep != NULL);
+ out:
+	free(key);
+	return tep;
 }
 
-static int load_events(struct tep_handle *tep,
-		       const char *tracing_dir, const char *system)
-{
-	int ret = 0, failure = 0;
-	char **events = NULL;
-	struct stat st;
-	int len = 0;
-	int i;
+struct lazy_event {
+	char			*system;
+	char			*name;
+	/* The event in the tep, once it was looked up */
+	struct tep_event	*event;
+	/* Set once its format was parsed (or failed to) */
+	bool			loaded;
+};
 
-	events = tracefs_system_events(tracing_dir, system);
-	if (!events)
-		return -ENOENT;
+/*
+ * Loads the event formats into a tep only when they are first looked up.
+ * The id of an event is only known by reading its "id" file, so the
+ * index from ids to events is built incrementally: a lookup of an
+ * unknown id continues the walk of the events directory where the
+ * previous one stopped, until the id is found.
+ */
+struct tracefs_lazy_events {
+	struct tracefs_lazy_events	*next;
+	struct tep_handle		*tep;
+	char				*tracing_dir;
+	/*
+	 * Protects the tep and the index. Looking up an event in the tep
+	 * writes to it, so it is only done with the lock held for write,
+	 * and the events found are kept in the index, that is read with
+	 * the lock held for read.
+	 */
+	pthread_rwlock_t		lock;
+	/* Held by lazy_list, and by the iterators that use it */
+	int				ref;
+	/* Indexed by the event ids */
+	struct lazy_event		*index;
+	int				nr_index;
+	/* Where the walk of the events directory is at */
+	char				**systems;
+	char				**events;
+	int				next_system;
+	int				next_event;
+	bool				walked;
+};
 
-	for (i = 0; events[i]; i++) {
-		char *format;
-		char *buf;
+static pthread_mutex_t lazy_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tracefs_lazy_events *lazy_list;
 
-		ret = asprintf(&format, "%s/events/%s/%s/format",
-			       tracing_dir, system, events[i]);
-		if (ret < 0) {
-			failure = -ENOMEM;
+/*
+ * Returns the lazy loader attached to @tep, or NULL if it has none.
+ * The reference taken on it must be dropped with trace_put_lazy_events(),
+ * so that tracefs_lazy_events_free() does not free it while in use.
+ */
+__hidden struct tracefs_lazy_events *trace_lazy_events(struct tep_handle *tep)
+{
+	struct tracefs_lazy_events *lazy;
+
+	/* Quick check to not take the lock if nothing is lazy */
+	if (!__atomic_load_n(&lazy_list, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	pthread_mutex_lock(&lazy_lock);
+	for (lazy = lazy_list; lazy; lazy = lazy->next) {
+		if (lazy->tep == tep) {
+			lazy->ref++;
 			break;
 		}
+	}
+	pthread_mutex_unlock(&lazy_lock);
 
-		ret = stat(format, &st);
-		if (ret < 0)
-			goto next_event;
+	return lazy;
+}
 
-		len = str_read_file(format, &buf, true);
-		if (len <= 0)
-			goto next_event;
+static void free_lazy_events(struct tracefs_lazy_events *lazy)
+{
+	int i;
 
-		ret = tep_parse_event(tep, buf, len, system);
-		free(buf);
-next_event:
-		free(format);
-		if (ret)
-			failure = ret;
+	for (i = 0; i < lazy->nr_index; i++) {
+		free(lazy->index[i].system);
+		free(lazy->index[i].name);
 	}
-
-	tracefs_list_free(events);
-	return failure;
+	free(lazy->index);
+	tracefs_list_free(lazy->events);
+	tracefs_list_free(lazy->systems);
+	pthread_rwlock_destroy(&lazy->lock);
+	free(lazy->tracing_dir);
+	free(lazy);
 }
 
-static int read_header(struct tep_handle *tep, const char *tracing_dir)
+__hidden void trace_put_lazy_events(struct tracefs_lazy_events *lazy)
 {
-	struct stat st;
-	char *header;
-	char *buf;
-	int len;
-	int ret = -1;
+	bool last;
 
-	header = trace_append_file(tracing_dir, "events/header_page");
+	if (!lazy)
+		return;
 
-	ret = stat(header, &st);
-	if (ret < 0)
-		goto out;
+	pthread_mutex_lock(&lazy_lock);
+	last = !--lazy->ref;
+	pthread_mutex_unlock(&lazy_lock);
 
-	len = str_read_file(header, &buf, true);
-	if (len <= 0)
-		goto out;
+	if (last)
+		free_lazy_events(lazy);
+}
 
-	tep_parse_header_page(tep, buf, len, sizeof(long));
+/* Must be called with the lazy lock held for write */
+static int grow_lazy_index(struct tracefs_lazy_events *lazy, int id)
+{
+	struct lazy_event *index;
 
-	free(buf);
+	if (id < lazy->nr_index)
+		return 0;
 
-	ret = 0;
- out:
-	free(header);
-	return ret;
-}
+	index = realloc(lazy->index, (id + 1) * sizeof(*index));
+	if (!index)
+		return -1;
+	memset(index + lazy->nr_index, 0,
+	       (id + 1 - lazy->nr_index) * sizeof(*index));
+	lazy->index = index;
+	lazy->nr_index = id + 1;
 
-static bool contains(const char *name, const char * const *names)
-{
-	if (!names)
-		return false;
-	for (; *names; names++)
-		if (strcmp(name, *names) == 0)
-			return true;
-	return false;
+	return 0;
 }
 
-static void load_kallsyms(struct tep_handle *tep)
+static int add_lazy_event(struct tracefs_lazy_events *lazy, int id,
+			  const char *system, const char *name)
 {
-	char *buf;
+	if (grow_lazy_index(lazy, id) < 0)
+		return -1;
 
-	if (str_read_file("/proc/kallsyms", &buf, false) <= 0)
-		return;
+	/* An id can only belong to one event */
+	if (lazy->index[id].system)
+		return 0;
+
+	lazy->index[id].system = strdup(system);
+	lazy->index[id].name = strdup(name);
+	if (!lazy->index[id].system || !lazy->index[id].name) {
+		free(lazy->index[id].system);
+		free(lazy->index[id].name);
+		lazy->index[id].system = NULL;
+		lazy->index[id].name = NULL;
+		return -1;
+	}
 
-	tep_parse_kallsyms(tep, buf);
-	free(buf);
+	return 0;
 }
 
-static int load_saved_cmdlines(const char *tracing_dir,
-			       struct tep_handle *tep, bool warn)
+static int read_event_id(const char *tracing_dir, const char *system,
+			 const char *name)
 {
 	char *path;
 	char *buf;
-	int ret;
+	int id;
 
-	path = trace_append_file(tracing_dir, "saved_cmdlines");
-	if (!path)
+	if (asprintf(&path, "%s/events/%s/%s/id", tracing_dir, system, name) < 0)
 		return -1;
 
-	ret = str_read_file(path, &buf, false);
+	id = str_read_file(path, &buf, false) > 0 ? atoi(buf) : -1;
+	if (id >= 0)
+		free(buf);
 	free(path);
-	if (ret <= 0)
-		return -1;
 
-	ret = tep_parse_saved_cmdlines(tep, buf);
-	free(buf);
+	return id;
+}
 
-	return ret;
+/* Continue the walk of the events directory until @id is indexed */
+static void walk_lazy_events(struct tracefs_lazy_events *lazy, int id)
+{
+	const char *system;
+	const char *name;
+	int ev_id;
+
+	while (!lazy->walked) {
+		if (!lazy->events) {
+			system = lazy->systems[lazy->next_system];
+			if (!system) {
+				lazy->walked = true;
+				break;
+			}
+			lazy->events = tracefs_system_events(lazy->tracing_dir,
+							     system);
+			lazy->next_event = 0;
+			if (!lazy->events) {
+				lazy->next_system++;
+				continue;
+			}
+		}
+
+		system = lazy->systems[lazy->next_system];
+		name = lazy->events[lazy->next_event];
+		if (!name) {
+			tracefs_list_free(lazy->events);
+			lazy->events = NULL;
+			lazy->next_system++;
+			continue;
+		}
+		lazy->next_event++;
+
+		ev_id = read_event_id(lazy->tracing_dir, system, name);
+		if (ev_id < 0 || add_lazy_event(lazy, ev_id, system, name))
+			continue;
+		if (ev_id == id)
+			break;
+	}
 }
 
-static void load_printk_formats(const char *tracing_dir,
-				struct tep_handle *tep)
+/* Must be called with the lazy lock held for write */
+static struct tep_event *load_lazy_event(struct tracefs_lazy_events *lazy, int id)
 {
+	struct lazy_event *entry;
 	char *path;
 	char *buf;
-	int ret;
+	int len;
 
-	path = trace_append_file(tracing_dir, "printk_formats");
-	if (!path)
-		return;
+	if (id >= lazy->nr_index || !lazy->index[id].system)
+		walk_lazy_events(lazy, id);
+	if (id >= lazy->nr_index || !lazy->index[id].system)
+		return NULL;
 
-	ret = str_read_file(path, &buf, false);
+	entry = &lazy->index[id];
+	if (entry->loaded)
+		return NULL;
+	entry->loaded = true;
+
+	if (asprintf(&path, "%s/events/%s/%s/format", lazy->tracing_dir,
+		     entry->system, entry->name) < 0)
+		return NULL;
+
+	len = str_read_file(path, &buf, true);
 	free(path);
-	if (ret <= 0)
-		return;
+	if (len <= 0)
+		return NULL;
 
-	tep_parse_printk_formats(tep, buf);
+	tep_parse_event(lazy->tep, buf, len, entry->system);
 	free(buf);
+
+	return tep_find_event(lazy->tep, id);
 }
 
 /*
- * Do a best effort attempt to load kallsyms, saved_cmdlines and
- * printk_formats. If they can not be loaded, then this will not
- * do the mappings. But this does not fail the loading of events.
+ * The type of a record is read from its common fields, and the tep only
+ * knows where they are from the events it has. Load one event that is
+ * always there, or tep_data_type() fails on all the records and nothing
+ * would ever be loaded by the iterators.
  */
-static void load_mappings(const char *tracing_dir,
-			  struct tep_handle *tep)
+static void load_lazy_common_fields(struct tracefs_lazy_events *lazy)
 {
-	load_kallsyms(tep);
-
-	/* If there's no tracing_dir no reason to go further */
-	if (!tracing_dir)
-		tracing_dir = tracefs_tracing_dir();
+	const char *names[] = { "print", "function" };
+	struct tep_event *event;
+	int id;
+	int i;
 
-	if (!tracing_dir)
+	if (tep_get_events_count(lazy->tep))
 		return;
 
-	load_saved_cmdlines(tracing_dir, tep, false);
-	load_printk_formats(tracing_dir, tep);
+	for (i = 0; i < ARRAY_SIZE(names); i++) {
+		id = read_event_id(lazy->tracing_dir, "ftrace", names[i]);
+		if (id < 0 || add_lazy_event(lazy, id, "ftrace", names[i]))
+			continue;
+		event = load_lazy_event(lazy, id);
+		lazy->index[id].event = event;
+		if (event)
+			return;
+	}
 }
 
-int tracefs_load_cmdlines(const char *tracing_dir, struct tep_handle *tep)
+/**
+ * tracefs_lazy_events_alloc - load the events of a tep when they are used
+ * @tracing_dir: The directory that contains the events.
+ * @tep: The tep handle to load the events into.
+ *
+ * Instead of parsing all the event formats up front like
+ * tracefs_local_events(), only the header page, the mappings (kallsyms,
+ * saved_cmdlines and printk_formats) and the ftrace print event (for the
+ * layout of the common fields of the records) are loaded into @tep.
+ * The format of an event is then parsed into @tep the first time that
+ * its id is read by one of the tracefs iterators, or is looked up with
+ * tracefs_lazy_find_event() or tracefs_lazy_find_event_by_name().
+ *
+ * @tep can already hold events (they are used as is), and it must not be
+ * freed before the returned handle.
+ *
+ * Returns a handle to pass to tracefs_lazy_events_free(), or NULL on
+ * error.
+ */
+struct tracefs_lazy_events *tracefs_lazy_events_alloc(const char *tracing_dir,
+						      struct tep_handle *tep)
 {
+	struct tracefs_lazy_events *lazy;
+	char **systems;
+
+	if (!tep) {
+		errno = EINVAL;
+		return NULL;
+	}
 
 	if (!tracing_dir)
 		tracing_dir = tracefs_tracing_dir();
-
 	if (!tracing_dir)
-		return -1;
+		return NULL;
 
-	return load_saved_cmdlines(tracing_dir, tep, true);
-}
+	lazy = trace_lazy_events(tep);
+	if (lazy) {
+		trace_put_lazy_events(lazy);
+		errno = EBUSY;
+		return NULL;
+	}
 
-static int fill_local_events_system(const char *tracing_dir,
-				    struct tep_handle *tep,
-				    const char * const *sys_names,
-				    int *parsing_failures)
-{
-	char **systems = NULL;
-	int ret;
-	int i;
+	lazy = calloc(1, sizeof(*lazy));
+	if (!lazy)
+		return NULL;
 
-	if (!tracing_dir)
-		tracing_dir = tracefs_tracing_dir();
-	if (!tracing_dir)
-		return -1;
+	lazy->tep = tep;
+	lazy->ref = 1;
+	lazy->tracing_dir = strdup(tracing_dir);
+	if (!lazy->tracing_dir)
+		goto fail;
 
-	systems = tracefs_event_systems(tracing_dir);
+	lazy->systems = tracefs_event_systems(tracing_dir);
+	if (!lazy->systems)
+		goto fail;
+
+	/* Include ftrace, as it is excluded for not having "enable" file */
+	systems = tracefs_list_add(lazy->systems, "ftrace");
 	if (!systems)
-		return -1;
+		goto fail;
+	lazy->systems = systems;
 
-	ret = read_header(tep, tracing_dir);
-	if (ret < 0) {
-		ret = -1;
-		goto out;
-	}
+	if (read_header(tep, tracing_dir, NULL) < 0)
+		goto fail;
 
-	if (parsing_failures)
-		*parsing_failures = 0;
+	load_mappings(tracing_dir, tep, NULL);
 
-	for (i = 0; systems[i]; i++) {
-		if (sys_names && !contains(systems[i], sys_names))
-			continue;
-		ret = load_events(tep, tracing_dir, systems[i]);
-		if (ret && parsing_failures)
-			(*parsing_failures)++;
-	}
+	load_lazy_common_fields(lazy);
 
-	/* Include ftrace, as it is excluded for not having "enable" file */
-	if (!sys_names || contains("ftrace", sys_names))
-		load_events(tep, tracing_dir, "ftrace");
+	pthread_rwlock_init(&lazy->lock, NULL);
 
-	load_mappings(tracing_dir, tep);
+	pthread_mutex_lock(&lazy_lock);
+	lazy->next = lazy_list;
+	__atomic_store_n(&lazy_list, lazy, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&lazy_lock);
 
-	/* always succeed because parsing failures are not critical */
-	ret = 0;
-out:
-	tracefs_list_free(systems);
-	return ret;
+	return lazy;
+ fail:
+	tracefs_list_free(lazy->systems);
+	free(lazy->tracing_dir);
+	free(lazy);
+	return NULL;
 }
 
 /**
- * tracefs_local_events_system - create a tep from the events of the specified subsystem.
- *
- * @tracing_dir: The directory that contains the events.
- * @sys_name: Array of system names, to load the events from.
- * The last element from the array must be NULL
+ * tracefs_lazy_events_free - stop loading the events of a tep lazily
+ * @lazy: The handle returned by tracefs_lazy_events_alloc()
  *
- * Returns a tep structure that contains the tep local to
- * the system.
+ * The events that were loaded stay in the tep. The iterations that were
+ * started on the tep before keep loading its events until they end, and
+ * @lazy is only freed then.
  */
-struct tep_handle *tracefs_local_events_system(const char *tracing_dir,
-					       const char * const *sys_names)
+void tracefs_lazy_events_free(struct tracefs_lazy_events *lazy)
 {
-	struct tep_handle *tep = NULL;
+	struct tracefs_lazy_events **last;
 
-	tep = tep_alloc();
-	if (!tep)
-		return NULL;
+	if (!lazy)
+		return;
 
-	if (fill_local_events_system(tracing_dir, tep, sys_names, NULL)) {
-		tep_free(tep);
-		tep = NULL;
+	pthread_mutex_lock(&lazy_lock);
+	for (last = &lazy_list; *last; last = &(*last)->next) {
+		if (*last == lazy) {
+			*last = lazy->next;
+			break;
+		}
 	}
+	pthread_mutex_unlock(&lazy_lock);
 
-	return tep;
+	trace_put_lazy_events(lazy);
 }
 
 /**
- * tracefs_local_events - create a tep from the events on system
- * @tracing_dir: The directory that contains the events.
+ * tracefs_lazy_find_event - find an event by id, loading it if needed
+ * @lazy: The handle returned by tracefs_lazy_events_alloc()
+ * @id: The id of the event
  *
- * Returns a tep structure that contains the teps local to
- * the system.
+ * Returns the event with @id in the tep of @lazy, after parsing its
+ * format if it was not already loaded, or NULL if there is no such event.
  */
-struct tep_handle *tracefs_local_events(const char *tracing_dir)
+struct tep_event *tracefs_lazy_find_event(struct tracefs_lazy_events *lazy, int id)
 {
-	return tracefs_local_events_system(tracing_dir, NULL);
+	struct tep_event *event = NULL;
+	bool found = false;
+
+	if (!lazy || id < 0)
+		return NULL;
+
+	pthread_rwlock_rdlock(&lazy->lock);
+	/* The ids that have no event are kept in the index too */
+	if (id < lazy->nr_index && lazy->index[id].loaded) {
+		event = lazy->index[id].event;
+		found = true;
+	}
+	pthread_rwlock_unlock(&lazy->lock);
+	if (found)
+		return event;
+
+	pthread_rwlock_wrlock(&lazy->lock);
+	if (id < lazy->nr_index && lazy->index[id].loaded) {
+		event = lazy->index[id].event;
+	} else {
+		/* The tep may have had the event before it was lazy */
+		event = tep_find_event(lazy->tep, id);
+		if (!event)
+			event = load_lazy_event(lazy, id);
+		if (!grow_lazy_index(lazy, id)) {
+			lazy->index[id].event = event;
+			lazy->index[id].loaded = true;
+		}
+	}
+	pthread_rwlock_unlock(&lazy->lock);
+
+	return event;
 }
 
 /**
- * tracefs_fill_local_events - Fill a tep with the events on system
- * @tracing_dir: The directory that contains the events.
- * @tep: Allocated tep handler which will be filled
- * @parsing_failures: return number of failures while parsing the event files
+ * tracefs_lazy_find_event_by_name - find an event by name, loading it if needed
+ * @lazy: The handle returned by tracefs_lazy_events_alloc()
+ * @system: The system of the event
+ * @event_name: The name of the event
  *
- * Returns whether the operation succeeded
+ * Returns the event in the tep of @lazy, after parsing its format if it
+ * was not already loaded, or NULL if there is no such event.
  */
-int tracefs_fill_local_events(const char *tracing_dir,
-			       struct tep_handle *tep, int *parsing_failures)
+struct tep_event *
+tracefs_lazy_find_event_by_name(struct tracefs_lazy_events *lazy,
+				const char *system, const char *event_name)
 {
-	return fill_local_events_system(tracing_dir, tep,
-					NULL, parsing_failures);
+	struct tep_event *event;
+	int id;
+
+	if (!lazy || !system || !event_name)
+		return NULL;
+
+	/* This writes the tep too, but it is not on the path of the records */
+	pthread_rwlock_wrlock(&lazy->lock);
+	event = tep_find_event_by_name(lazy->tep, system, event_name);
+	pthread_rwlock_unlock(&lazy->lock);
+	if (event)
+		return event;
+
+	/* The id file leads to the format without walking the directory */
+	id = read_event_id(lazy->tracing_dir, system, event_name);
+	if (id < 0)
+		return NULL;
+
+	pthread_rwlock_wrlock(&lazy->lock);
+	add_lazy_event(lazy, id, system, event_name);
+	pthread_rwlock_unlock(&lazy->lock);
+
+	return tracefs_lazy_find_event(lazy, id);
 }
 
 static bool match(const char *str, regex_t *re)
@@ -51,6 +51,7 @@ enabled_opts_mask(struct tracefs_instance *instance)
 static struct tracefs_instance *instance_alloc(const char *trace_dir, const char *name)
 {
 	struct tracefs_instance *instance;
+	int i;
 
 	instance = calloc(1, sizeof(*instance));
 	if (!instance)
@@ -72,6 +73,9 @@ static struct tracefs_instance *instance_alloc(const char *trace_dir, const char
 	instance->ftrace_marker_fd = -1;
 	instance->ftrace_marker_raw_fd = -1;
 
+	for (i = 0; i < NR_CACHED_FILES; i++)
+		instance->file_cache.files[i].fd = -1;
+
 	return instance;
 
 error:
@@ -84,6 +88,146 @@ error:
 }
 
 
+/*
+ * The control files that are written the most (tracing_on, the options,
+ * ...) can be kept open, to not look up their path on every write. Only
+ * files where a write does the same with or without O_TRUNC, that act on
+ * every write() (and not when closed), and that do not pin anything
+ * while open (the event files pin their module or dynamic event) can
+ * be cached.
+ */
+static const char * const cacheable_files[] = {
+	"tracing_on",
+	"buffer_size_kb",
+	"buffer_percent",
+	"current_tracer",
+	"trace_clock",
+	"trace_options",
+	"tracing_cpumask",
+	"tracing_thresh",
+	"tracing_max_latency",
+	"events/enable",
+};
+
+/* For the top instance of the default tracing directory */
+static struct file_cache top_file_cache = {
+	.files = { [0 ... NR_CACHED_FILES - 1] = { .fd = -1 } },
+};
+
+static bool cacheable_file(const char *file)
+{
+	int i;
+
+	if (strncmp(file, "options/", 8) == 0)
+		return !strchr(file + 8, '/');
+
+	for (i = 0; i < ARRAY_SIZE(cacheable_files); i++) {
+		if (strcmp(file, cacheable_files[i]) == 0)
+			return true;
+	}
+	return false;
+}
+
+static void close_cached_files(struct file_cache *cache)
+{
+	int i;
+
+	for (i = 0; i < NR_CACHED_FILES; i++) {
+		if (cache->files[i].fd >= 0)
+			close(cache->files[i].fd);
+		free(cache->files[i].file);
+		cache->files[i].fd = -1;
+		cache->files[i].file = NULL;
+	}
+	free(cache->tracing_dir);
+	cache->tracing_dir = NULL;
+}
+
+/* Must be called with the instance lock held */
+static int get_cached_file(struct tracefs_instance *instance,
+			   struct file_cache *cache, const char *file)
+{
+	struct cached_file *cached;
+	char *path;
+	char *name;
+	int fd;
+	int i;
+
+	/* The files of the top instance are in the current tracing directory */
+	if (!instance) {
+		path = (char *)tracefs_tracing_dir();
+		if (!path)
+			return -1;
+		if (!cache->tracing_dir || strcmp(cache->tracing_dir, path) != 0) {
+			close_cached_files(cache);
+			cache->tracing_dir = strdup(path);
+			if (!cache->tracing_dir)
+				return -1;
+		}
+	}
+
+	for (i = 0; i < NR_CACHED_FILES; i++) {
+		if (cache->files[i].file && strcmp(cache->files[i].file, file) == 0)
+			return cache->files[i].fd;
+	}
+
+	path = tracefs_instance_get_file(instance, file);
+	if (!path)
+		return -1;
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	tracefs_put_tracing_file(path);
+	if (fd < 0)
+		return -1;
+
+	name = strdup(file);
+	if (!name) {
+		close(fd);
+		return -1;
+	}
+
+	cached = &cache->files[cache->next];
+	cache->next = (cache->next + 1) % NR_CACHED_FILES;
+	if (cached->fd >= 0)
+		close(cached->fd);
+	free(cached->file);
+	cached->file = name;
+	cached->fd = fd;
+
+	return fd;
+}
+
+/*
+ * Write @str to @file through its cached file descriptor. Returns the
+ * result of the write, or -2 if the files of @instance are not cached,
+ * or if the file could not be opened.
+ */
+static int cached_file_write(struct tracefs_instance *instance,
+			     const char *file, const char *str)
+{
+	pthread_mutex_t *lock = trace_get_lock(instance);
+	struct file_cache *cache;
+	int len = strlen(str);
+	int ret = -2;
+	int fd;
+
+	cache = instance ? &instance->file_cache : &top_file_cache;
+
+	pthread_mutex_lock(lock);
+	if (!cache->enabled) {
+		pthread_mutex_unlock(lock);
+		return -2;
+	}
+	fd = get_cached_file(instance, cache, file);
+	if (fd >= 0) {
+		ret = pwrite(fd, str, len, 0);
+		if (ret < 0 && errno == ESPIPE)
+			ret = write(fd, str, len);
+	}
+	pthread_mutex_unlock(lock);
+
+	return ret;
+}
+
 __hidden int trace_get_instance(struct tracefs_instance *instance)
 {
 	int ret;
@@ -121,6 +265,8 @@ __hidden void trace_put_instance(struct tracefs_instance *instance)
 	if (instance->ftrace_marker_raw_fd >= 0)
 		close(instance->ftrace_marker_raw_fd);
 
+	close_cached_files(&instance->file_cache);
+	free(instance->followers);
 	free(instance->trace_dir);
 	free(instance->name);
 	pthread_mutex_destroy(&instance->lock);
@@ -138,9 +284,61 @@ void tracefs_instance_free(struct tracefs_instance *instance)
 	if (!instance)
 		return;
 
+	/* Others may still hold the instance, but must not keep it busy */
+	tracefs_instance_file_cache_close(instance);
 	trace_put_instance(instance);
 }
 
+/**
+ * tracefs_instance_file_cache_init - keep the control files of an instance open
+ * @instance: ftrace instance, can be NULL for the top instance
+ *
+ * Makes tracefs_instance_file_write() (and the functions that use it, like
+ * tracefs_trace_on() and tracefs_option_enable()) keep the most written
+ * control files of @instance open, instead of opening them on every
+ * write. An instance can not be removed while its files are open, by this
+ * process or any other, so they must be closed with
+ * tracefs_instance_file_cache_close() when the instance is no longer
+ * controlled. They are also closed by tracefs_instance_destroy() and
+ * tracefs_instance_free().
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+int tracefs_instance_file_cache_init(struct tracefs_instance *instance)
+{
+	pthread_mutex_t *lock = trace_get_lock(instance);
+
+	pthread_mutex_lock(lock);
+	if (instance)
+		instance->file_cache.enabled = true;
+	else
+		top_file_cache.enabled = true;
+	pthread_mutex_unlock(lock);
+
+	return 0;
+}
+
+/**
+ * tracefs_instance_file_cache_close - close the kept open control files
+ * @instance: ftrace instance, can be NULL for the top instance
+ *
+ * Closes the files that tracefs_instance_file_cache_init() kept open, and
+ * goes back to opening them on every write. It must also be called if the
+ * tracing directory of the top instance was unmounted or mounted again.
+ */
+void tracefs_instance_file_cache_close(struct tracefs_instance *instance)
+{
+	pthread_mutex_t *lock = trace_get_lock(instance);
+	struct file_cache *cache;
+
+	cache = instance ? &instance->file_cache : &top_file_cache;
+
+	pthread_mutex_lock(lock);
+	close_cached_files(cache);
+	cache->enabled = false;
+	pthread_mutex_unlock(lock);
+}
+
 static mode_t get_trace_file_permissions(char *name)
 {
 	mode_t rmode = 0;
@@ -277,6 +475,11 @@ int tracefs_instance_destroy(struct tracefs_instance *instance)
 		return -1;
 	}
 
+	/* The instance can not be removed while its files are open */
+	pthread_mutex_lock(&instance->lock);
+	close_cached_files(&instance->file_cache);
+	pthread_mutex_unlock(&instance->lock);
+
 	path = tracefs_instance_get_dir(instance);
 	if (path)
 		ret = rmdir(path);
@@ -401,6 +604,13 @@ static int instance_file_write(struct tracefs_instance *instance,
 	char *path;
 	int ret;
 
+	/* An append must not go through a file that was not opened to append */
+	if (str && (flags & O_TRUNC) && cacheable_file(file)) {
+		ret = cached_file_write(instance, file, str);
+		if (ret != -2)
+			return ret;
+	}
+
 	path = tracefs_instance_get_file(instance, file);
 	if (!path)
 		return -1;
@@ -630,31 +840,21 @@ int tracefs_instances_walk(int (*callback)(const char *, void *), void *context)
 	struct dirent *dent;
 	char *path = NULL;
 	DIR *dir = NULL;
-	struct stat st;
 	int fret = -1;
-	int ret;
 
 	path = tracefs_get_tracing_file("instances");
 	if (!path)
 		return -1;
-	ret = stat(path, &st);
-	if (ret < 0 || !S_ISDIR(st.st_mode))
-		goto out;
 
-	dir = opendir(path);
+	dir = trace_opendir_at(AT_FDCWD, path);
 	if (!dir)
 		goto out;
 	fret = 0;
 	while ((dent = readdir(dir))) {
-		char *instance;
-
 		if (strcmp(dent->d_name, ".") == 0 ||
 		    strcmp(dent->d_name, "..") == 0)
 			continue;
-		instance = trace_append_file(path, dent->d_name);
-		ret = stat(instance, &st);
-		free(instance);
-		if (ret < 0 || !S_ISDIR(st.st_mode))
+		if (!trace_dirent_is_dir(dir, dent))
 			continue;
 		if (callback(dent->d_name, context)) {
 			fret = 1;
@@ -0,0 +1,421 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Lazy resolution of kernel addresses to symbols.
+ *
+ * Instead of parsing all of /proc/kallsyms into every tep, the teps are
+ * given a function resolver that uses a single symbol table shared by
+ * the process. The table is only built the first time an address needs
+ * to be resolved, and can be kept in a cache file so that the next
+ * processes map it instead of parsing /proc/kallsyms again.
+ *
+ * The table is an array of addresses, sorted for a binary search, with
+ * the offsets of the names (and modules) of the symbols in a string pool.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tracefs.h"
+#include "tracefs-local.h"
+
+#define KALLSYMS_CACHE_MAGIC	"TFSKSYMS"
+#define KALLSYMS_CACHE_VERSION	1
+
+/* The module offset of the symbols of the core kernel */
+#define NO_MODULE		UINT32_MAX
+
+struct ksym_names {
+	uint32_t		name;
+	uint32_t		mod;
+};
+
+/*
+ * The cache file is this header, the key, padded to 8 bytes, followed
+ * by the addresses, the names and the string pool, exactly as they
+ * are used in memory.
+ */
+struct kallsyms_header {
+	char			magic[8];
+	uint32_t		version;
+	uint32_t		key_len;
+	uint32_t		nr_syms;
+	uint32_t		pool_size;
+};
+
+struct kallsyms {
+	pthread_mutex_t		lock;
+	char			*cache_file;
+	unsigned long long	*addrs;
+	struct ksym_names	*names;
+	char			*pool;
+	int			nr_syms;
+	/* Set if the table points into a mapping of the cache file */
+	void			*map;
+	size_t			map_size;
+	bool			loaded;
+};
+
+static struct kallsyms kallsyms = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Used to sort the symbols before they are split into their arrays */
+struct ksym {
+	unsigned long long	addr;
+	struct ksym_names	names;
+};
+
+static int cmp_ksym(const void *a, const void *b)
+{
+	const struct ksym *ka = a;
+	const struct ksym *kb = b;
+
+	if (ka->addr < kb->addr)
+		return -1;
+	return ka->addr > kb->addr;
+}
+
+static size_t cache_data_offset(size_t key_len)
+{
+	return (sizeof(struct kallsyms_header) + key_len + 7) & ~7UL;
+}
+
+static size_t cache_size(size_t key_len, int nr_syms, size_t pool_size)
+{
+	return cache_data_offset(key_len) +
+		nr_syms * (sizeof(unsigned long long) + sizeof(struct ksym_names)) +
+		pool_size;
+}
+
+static int load_kallsyms_cache(struct kallsyms *ks, const char *key)
+{
+	struct kallsyms_header *header;
+	unsigned long long *addrs;
+	size_t key_len = strlen(key);
+	struct ksym_names *names;
+	struct stat st;
+	void *map;
+	int ret = -1;
+	int fd;
+	int i;
+
+	fd = open(ks->cache_file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || st.st_size < cache_data_offset(key_len))
+		goto out;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		goto out;
+
+	header = map;
+	if (memcmp(header->magic, KALLSYMS_CACHE_MAGIC, sizeof(header->magic)) ||
+	    header->version != KALLSYMS_CACHE_VERSION ||
+	    header->key_len != key_len ||
+	    memcmp(map + sizeof(*header), key, key_len) ||
+	    st.st_size != cache_size(key_len, header->nr_syms, header->pool_size) ||
+	    !header->pool_size || ((char *)map)[st.st_size - 1] != '\0')
+		goto fail;
+
+	addrs = map + cache_data_offset(key_len);
+	names = (void *)(addrs + header->nr_syms);
+	for (i = 0; i < header->nr_syms; i++) {
+		if (names[i].name >= header->pool_size ||
+		    (names[i].mod != NO_MODULE && names[i].mod >= header->pool_size))
+			goto fail;
+	}
+
+	ks->map = map;
+	ks->map_size = st.st_size;
+	ks->nr_syms = header->nr_syms;
+	ks->addrs = addrs;
+	ks->names = names;
+	ks->pool = (void *)(names + header->nr_syms);
+	ret = 0;
+ out:
+	close(fd);
+	return ret;
+ fail:
+	munmap(map, st.st_size);
+	goto out;
+}
+
+static void write_kallsyms_cache(struct kallsyms *ks, const char *key,
+				 size_t pool_size)
+{
+	struct kallsyms_header header = { };
+	char pad[8] = { };
+	char *tmp_file;
+	FILE *cache;
+	bool ok;
+	int fd;
+
+	if (asprintf(&tmp_file, "%s.XXXXXX", ks->cache_file) < 0)
+		return;
+
+	/* mkstemp() creates it 0600, kernel addresses are not for everyone */
+	fd = mkstemp(tmp_file);
+	if (fd < 0)
+		goto out;
+
+	cache = fdopen(fd, "w");
+	if (!cache) {
+		close(fd);
+		unlink(tmp_file);
+		goto out;
+	}
+
+	memcpy(header.magic, KALLSYMS_CACHE_MAGIC, sizeof(header.magic));
+	header.version = KALLSYMS_CACHE_VERSION;
+	header.key_len = strlen(key);
+	header.nr_syms = ks->nr_syms;
+	header.pool_size = pool_size;
+
+	fwrite(&header, sizeof(header), 1, cache);
+	fwrite(key, header.key_len, 1, cache);
+	fwrite(pad, cache_data_offset(header.key_len) - sizeof(header) - header.key_len,
+	       1, cache);
+	fwrite(ks->addrs, sizeof(*ks->addrs), ks->nr_syms, cache);
+	fwrite(ks->names, sizeof(*ks->names), ks->nr_syms, cache);
+	fwrite(ks->pool, pool_size, 1, cache);
+
+	ok = !ferror(cache);
+	if (fclose(cache))
+		ok = false;
+
+	if (!ok || rename(tmp_file, ks->cache_file) < 0)
+		unlink(tmp_file);
+ out:
+	free(tmp_file);
+}
+
+/* Parse /proc/kallsyms into @ks, returns the size of the string pool */
+static size_t parse_kallsyms(struct kallsyms *ks)
+{
+	struct ksym *syms = NULL;
+	struct ksym *tmp;
+	char *line, *next;
+	char *name, *mod;
+	char *last_mod = NULL;
+	uint32_t mod_offset = NO_MODULE;
+	unsigned long long addr;
+	size_t pool_size = 0;
+	int nr_syms = 0;
+	int alloc = 0;
+	char *buf;
+	char type;
+	int len;
+	int i;
+
+	len = str_read_file("/proc/kallsyms", &buf, false);
+	if (len <= 0)
+		return 0;
+
+	/*
+	 * The names are moved to the front of the same buffer, which
+	 * becomes the string pool, as they are never longer than the line
+	 * they come from.
+	 */
+	for (line = buf; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+
+		addr = strtoull(line, &name, 16);
+		if (*name++ != ' ' || !*name)
+			continue;
+		type = *name++;
+		if (*name++ != ' ')
+			continue;
+
+		/* Hidden addresses (kptr_restrict) and absolute symbols are useless */
+		if (!addr || type == 'a' || type == 'A')
+			continue;
+
+		mod = strchr(name, '\t');
+		if (mod) {
+			*mod++ = '\0';
+			if (*mod == '[')
+				mod++;
+			mod[strcspn(mod, "]")] = '\0';
+		}
+
+		if (nr_syms == alloc) {
+			alloc = alloc ? alloc * 2 : 4096;
+			tmp = realloc(syms, alloc * sizeof(*syms));
+			if (!tmp)
+				goto fail;
+			syms = tmp;
+		}
+
+		syms[nr_syms].addr = addr;
+		syms[nr_syms].names.name = pool_size;
+		len = strlen(name) + 1;
+		memmove(buf + pool_size, name, len);
+		pool_size += len;
+
+		/* The symbols of a module are listed together */
+		if (mod && (!last_mod || strcmp(mod, last_mod) != 0)) {
+			mod_offset = pool_size;
+			len = strlen(mod) + 1;
+			memmove(buf + pool_size, mod, len);
+			last_mod = buf + pool_size;
+			pool_size += len;
+		}
+		syms[nr_syms].names.mod = mod ? mod_offset : NO_MODULE;
+		nr_syms++;
+	}
+
+	if (!nr_syms)
+		goto fail;
+
+	qsort(syms, nr_syms, sizeof(*syms), cmp_ksym);
+
+	ks->addrs = malloc(nr_syms * sizeof(*ks->addrs));
+	ks->names = malloc(nr_syms * sizeof(*ks->names));
+	if (!ks->addrs || !ks->names) {
+		free(ks->addrs);
+		free(ks->names);
+		ks->addrs = NULL;
+		ks->names = NULL;
+		goto fail;
+	}
+
+	for (i = 0; i < nr_syms; i++) {
+		ks->addrs[i] = syms[i].addr;
+		ks->names[i] = syms[i].names;
+	}
+	free(syms);
+
+	/* Give back what the lines took, besides the names */
+	ks->pool = realloc(buf, pool_size) ? : buf;
+	ks->nr_syms = nr_syms;
+
+	return pool_size;
+ fail:
+	free(syms);
+	free(buf);
+	return 0;
+}
+
+static void load_kallsyms_table(struct kallsyms *ks)
+{
+	size_t pool_size;
+	char *key = NULL;
+
+	if (ks->cache_file) {
+		key = trace_kernel_id();
+		if (key && !load_kallsyms_cache(ks, key))
+			goto out;
+	}
+
+	pool_size = parse_kallsyms(ks);
+	if (pool_size && key)
+		write_kallsyms_cache(ks, key, pool_size);
+ out:
+	free(key);
+}
+
+/* Find the symbol that @addr is in: the last one that starts at or before it */
+static int find_ksym(struct kallsyms *ks, unsigned long long addr)
+{
+	int start = 0;
+	int end = ks->nr_syms;
+	int mid;
+
+	if (!ks->nr_syms || addr < ks->addrs[0])
+		return -1;
+
+	while (end - start > 1) {
+		mid = start + (end - start) / 2;
+		if (ks->addrs[mid] <= addr)
+			start = mid;
+		else
+			end = mid;
+	}
+
+	return start;
+}
+
+static char *kallsyms_resolve(void *priv, unsigned long long *addrp, char **modp)
+{
+	struct kallsyms *ks = priv;
+	int i;
+
+	if (!__atomic_load_n(&ks->loaded, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&ks->lock);
+		if (!ks->loaded) {
+			load_kallsyms_table(ks);
+			__atomic_store_n(&ks->loaded, true, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&ks->lock);
+	}
+
+	i = find_ksym(ks, *addrp);
+	if (i < 0)
+		return NULL;
+
+	*addrp = ks->addrs[i];
+	*modp = ks->names[i].mod == NO_MODULE ? NULL : ks->pool + ks->names[i].mod;
+	return ks->pool + ks->names[i].name;
+}
+
+/*
+ * Make @tep resolve the kernel addresses with the shared symbol table,
+ * that is only built from /proc/kallsyms when it is first needed.
+ */
+__hidden int trace_load_kallsyms(struct tep_handle *tep)
+{
+	return tep_set_function_resolver(tep, kallsyms_resolve, &kallsyms);
+}
+
+/**
+ * tracefs_kallsyms_set_cache - keep the kernel symbols in a cache file
+ * @cache_file: The file to keep the symbols in, or NULL to not use one
+ *
+ * The teps created by this library resolve the kernel addresses with
+ * a symbol table that is built from /proc/kallsyms the first time an
+ * address is resolved. If @cache_file is set, the table is mapped from
+ * that file instead, if it was made for the running kernel (the same
+ * kernel, booted the same time, with the same modules). Otherwise,
+ * the table is built from /proc/kallsyms and written to @cache_file.
+ *
+ * Must be called before the first address is resolved.
+ *
+ * Returns 0 on success, and -1 on error or if the symbols were already
+ * loaded.
+ */
+int tracefs_kallsyms_set_cache(const char *cache_file)
+{
+	char *file = NULL;
+	int ret = -1;
+
+	if (cache_file) {
+		file = strdup(cache_file);
+		if (!file)
+			return -1;
+	}
+
+	pthread_mutex_lock(&kallsyms.lock);
+	if (kallsyms.loaded) {
+		errno = EBUSY;
+		goto out;
+	}
+	free(kallsyms.cache_file);
+	kallsyms.cache_file = file;
+	file = NULL;
+	ret = 0;
+ out:
+	pthread_mutex_unlock(&kallsyms.lock);
+	free(file);
+	return ret;
+}
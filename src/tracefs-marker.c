@@ -5,13 +5,25 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <errno.h>
 #include <pthread.h>
 
 #include "tracefs.h"
 #include "tracefs-local.h"
 
+/*
+ * The strings of tracefs_printf() are formatted into a buffer of the
+ * thread, so that markers do not need an allocation. The ones that do not
+ * fit (the kernel would cut them at about this size anyway) are allocated.
+ */
+#define MARKER_BUF_SIZE		4096
+
+static __thread char marker_buf[MARKER_BUF_SIZE] __attribute__((aligned(64)));
+
 /* File descriptors for Top level trace markers */
 static int ftrace_marker_fd = -1;
 static int ftrace_marker_raw_fd = -1;
@@ -114,12 +126,22 @@ int tracefs_print_init(struct tracefs_instance *instance)
 int tracefs_vprintf(struct tracefs_instance *instance, const char *fmt, va_list ap)
 {
 	char *str = NULL;
+	va_list aq;
+	int len;
 	int ret;
 
-	ret = vasprintf(&str, fmt, ap);
-	if (ret < 0)
-		return ret;
-	ret = marker_write(instance, false, str, strlen(str));
+	va_copy(aq, ap);
+	len = vsnprintf(marker_buf, MARKER_BUF_SIZE, fmt, aq);
+	va_end(aq);
+	if (len < 0)
+		return len;
+	if (len < MARKER_BUF_SIZE)
+		return marker_write(instance, false, marker_buf, len);
+
+	len = vasprintf(&str, fmt, ap);
+	if (len < 0)
+		return len;
+	ret = marker_write(instance, false, str, len);
 	free(str);
 
 	return ret;
@@ -197,3 +219,535 @@ void tracefs_binary_close(struct tracefs_instance *instance)
 {
 	marker_close(instance, true);
 }
+
+/*
+ * Marker schemas give a fixed layout to the data written to the raw
+ * trace marker. The kernel records the first 4 bytes of a write as the
+ * id of the raw_data event, which is used as the id of the schema, and
+ * the fields follow it, packed in the order they were added.
+ */
+/* The kernel refuses writes to trace_marker_raw of more than 3K (RAW_DATA_MAX_SIZE) */
+#define MARKER_RAW_MAX		(1024 * 3)
+#define MARKER_SCHEMA_MAX	(MARKER_RAW_MAX - sizeof(unsigned int))
+
+struct marker_field {
+	char				*name;
+	enum tracefs_marker_type	type;
+	int				offset;
+	int				size;
+};
+
+struct tracefs_marker_schema {
+	struct tracefs_marker_schema	*next;
+	char				*name;
+	unsigned int			id;
+	struct marker_field		*fields;
+	int				nr_fields;
+	/* The size of the fields, without the id */
+	int				size;
+};
+
+/*
+ * The schemas of the process, to decode the records by their ids. The
+ * lock also protects the fields of the schemas, which the decoding
+ * walks while another thread may add to them or free the schema.
+ */
+static pthread_mutex_t schema_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tracefs_marker_schema *schemas;
+
+static struct tracefs_marker_schema *find_schema(unsigned int id)
+{
+	struct tracefs_marker_schema *schema;
+
+	for (schema = schemas; schema; schema = schema->next) {
+		if (schema->id == id)
+			break;
+	}
+	return schema;
+}
+
+/**
+ * tracefs_marker_schema_alloc - create a layout for raw trace markers
+ * @id: The id of the records written with this schema
+ * @name: The name of the schema
+ *
+ * Creates a schema, to write records of typed fields to the raw trace
+ * marker with tracefs_marker_schema_write(), and to read them back. The
+ * @id is the first word of the records, and is what the raw_data events
+ * show as their id. The schemas are kept by the process, so that the
+ * records can be matched to them by their id.
+ *
+ * Returns the schema, that must be freed with tracefs_marker_schema_free(),
+ * or NULL on error. If a schema with @id already exists, errno is set to
+ * EEXIST.
+ */
+struct tracefs_marker_schema *tracefs_marker_schema_alloc(unsigned int id,
+							 const char *name)
+{
+	struct tracefs_marker_schema *schema;
+
+	if (!name) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	schema = calloc(1, sizeof(*schema));
+	if (!schema)
+		return NULL;
+
+	schema->id = id;
+	schema->name = strdup(name);
+	if (!schema->name) {
+		free(schema);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&schema_lock);
+	if (find_schema(id)) {
+		pthread_mutex_unlock(&schema_lock);
+		free(schema->name);
+		free(schema);
+		errno = EEXIST;
+		return NULL;
+	}
+	schema->next = schemas;
+	schemas = schema;
+	pthread_mutex_unlock(&schema_lock);
+
+	return schema;
+}
+
+/**
+ * tracefs_marker_schema_free - free a schema of raw trace markers
+ * @schema: The schema to free
+ *
+ * The records written with @schema can no longer be decoded by the process.
+ */
+void tracefs_marker_schema_free(struct tracefs_marker_schema *schema)
+{
+	struct tracefs_marker_schema **last;
+	int i;
+
+	if (!schema)
+		return;
+
+	pthread_mutex_lock(&schema_lock);
+	for (last = &schemas; *last; last = &(*last)->next) {
+		if (*last == schema) {
+			*last = schema->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&schema_lock);
+
+	for (i = 0; i < schema->nr_fields; i++)
+		free(schema->fields[i].name);
+	free(schema->fields);
+	free(schema->name);
+	free(schema);
+}
+
+static int marker_type_size(enum tracefs_marker_type type, int len)
+{
+	switch (type) {
+	case TRACEFS_MARKER_U8:
+	case TRACEFS_MARKER_S8:
+		return 1;
+	case TRACEFS_MARKER_U16:
+	case TRACEFS_MARKER_S16:
+		return 2;
+	case TRACEFS_MARKER_U32:
+	case TRACEFS_MARKER_S32:
+		return 4;
+	case TRACEFS_MARKER_U64:
+	case TRACEFS_MARKER_S64:
+		return 8;
+	case TRACEFS_MARKER_STRING:
+		return len;
+	}
+	return -1;
+}
+
+/**
+ * tracefs_marker_schema_add_field - add a field to a schema
+ * @schema: The schema to add the field to
+ * @name: The name of the field
+ * @type: The type of the field
+ * @len: The number of bytes of a TRACEFS_MARKER_STRING field, ignored otherwise
+ *
+ * Adds a field after the ones that @schema already has. There is no
+ * padding between the fields. A string field takes @len bytes, and is
+ * not nul terminated if the string fills it.
+ *
+ * The fields take at most 3068 bytes, as a write to the raw trace marker
+ * is limited to 3K, the id included.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int tracefs_marker_schema_add_field(struct tracefs_marker_schema *schema,
+				    const char *name,
+				    enum tracefs_marker_type type, int len)
+{
+	struct marker_field *fields;
+	struct marker_field *field;
+	int ret = -1;
+	int size;
+	int i;
+
+	size = marker_type_size(type, len);
+	if (!schema || !name || size <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&schema_lock);
+	if (schema->size + size > MARKER_SCHEMA_MAX) {
+		errno = EINVAL;
+		goto out;
+	}
+
+	for (i = 0; i < schema->nr_fields; i++) {
+		if (strcmp(schema->fields[i].name, name) == 0) {
+			errno = EEXIST;
+			goto out;
+		}
+	}
+
+	fields = realloc(schema->fields, (schema->nr_fields + 1) * sizeof(*fields));
+	if (!fields)
+		goto out;
+	schema->fields = fields;
+
+	field = &fields[schema->nr_fields];
+	field->name = strdup(name);
+	if (!field->name)
+		goto out;
+	field->type = type;
+	field->offset = schema->size;
+	field->size = size;
+
+	schema->nr_fields++;
+	schema->size += size;
+	ret = 0;
+ out:
+	pthread_mutex_unlock(&schema_lock);
+	return ret;
+}
+
+/**
+ * tracefs_marker_schema_write - write a record of a schema in the raw trace marker
+ * @instance: ftrace instance, can be NULL for top tracing instance.
+ * @schema: The schema of the record
+ * @...: The values of the fields of @schema, in their order
+ *
+ * The values are taken like printf() would: an int for the fields of 32
+ * bits or less, a long long for the 64 bit fields and a const char * for
+ * strings. They are copied in place, with no formatting, and the record
+ * is written with a single write.
+ *
+ * Returns 0 if the record is written correctly, or -1 in case of an error
+ */
+int tracefs_marker_schema_write(struct tracefs_instance *instance,
+				struct tracefs_marker_schema *schema, ...)
+{
+	struct marker_field *field;
+	unsigned long long v64;
+	char *data = marker_buf;
+	const char *str;
+	va_list ap;
+	uint16_t v16;
+	uint32_t v32;
+	int i;
+
+	if (!schema) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memcpy(data, &schema->id, sizeof(schema->id));
+	data += sizeof(schema->id);
+
+	va_start(ap, schema);
+	for (i = 0; i < schema->nr_fields; i++) {
+		field = &schema->fields[i];
+		switch (field->type) {
+		case TRACEFS_MARKER_U8:
+		case TRACEFS_MARKER_S8:
+			data[field->offset] = va_arg(ap, int);
+			break;
+		case TRACEFS_MARKER_U16:
+		case TRACEFS_MARKER_S16:
+			v16 = va_arg(ap, int);
+			memcpy(data + field->offset, &v16, sizeof(v16));
+			break;
+		case TRACEFS_MARKER_U32:
+		case TRACEFS_MARKER_S32:
+			v32 = va_arg(ap, int);
+			memcpy(data + field->offset, &v32, sizeof(v32));
+			break;
+		case TRACEFS_MARKER_U64:
+		case TRACEFS_MARKER_S64:
+			v64 = va_arg(ap, long long);
+			memcpy(data + field->offset, &v64, sizeof(v64));
+			break;
+		case TRACEFS_MARKER_STRING:
+			str = va_arg(ap, const char *);
+			strncpy(data + field->offset, str ? : "", field->size);
+			break;
+		}
+	}
+	va_end(ap);
+
+	return marker_write(instance, true, marker_buf,
+			    sizeof(schema->id) + schema->size);
+}
+
+/* Get the id and the data of a raw_data record */
+static int raw_record_data(struct tep_handle *tep, struct tep_record *record,
+			   unsigned int *id, void **data, int *size)
+{
+	struct tep_format_field *id_field;
+	struct tep_format_field *buf_field;
+	struct tep_event *event;
+	unsigned long long val;
+
+	if (!tep || !record) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	event = tep_find_event_by_name(tep, "ftrace", "raw_data");
+	if (!event || tep_data_type(tep, record) != event->id)
+		return -1;
+
+	id_field = tep_find_field(event, "id");
+	buf_field = tep_find_field(event, "buf");
+	if (!id_field || !buf_field ||
+	    tep_read_number_field(id_field, record->data, &val) < 0)
+		return -1;
+
+	*id = val;
+	*data = record->data + buf_field->offset;
+	*size = record->size - buf_field->offset;
+
+	return 0;
+}
+
+/**
+ * tracefs_marker_schema_find - find the schema of a raw_data record
+ * @tep: The tep handle of the record
+ * @record: A record of the ftrace raw_data event
+ *
+ * The schema stays valid until it is freed with tracefs_marker_schema_free(),
+ * which must not be done while another thread still uses it.
+ *
+ * Returns the schema whose id is the one of @record, or NULL if @record
+ * is not a raw_data event, or if there is no schema with its id.
+ */
+struct tracefs_marker_schema *
+tracefs_marker_schema_find(struct tep_handle *tep, struct tep_record *record)
+{
+	struct tracefs_marker_schema *schema;
+	unsigned int id;
+	void *data;
+	int size;
+
+	if (raw_record_data(tep, record, &id, &data, &size) < 0)
+		return NULL;
+
+	pthread_mutex_lock(&schema_lock);
+	schema = find_schema(id);
+	if (schema && size < schema->size)
+		schema = NULL;
+	pthread_mutex_unlock(&schema_lock);
+
+	return schema;
+}
+
+/*
+ * Get the field @name of @schema and where it is in @record.
+ * Must be called with schema_lock held, and the field used under it.
+ */
+static struct marker_field *
+record_field(struct tracefs_marker_schema *schema, struct tep_handle *tep,
+	     struct tep_record *record, const char *name, void **data)
+{
+	unsigned int id;
+	int size;
+	int i;
+
+	if (!schema || !name) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (raw_record_data(tep, record, &id, data, &size) < 0 ||
+	    id != schema->id || size < schema->size) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	for (i = 0; i < schema->nr_fields; i++) {
+		if (strcmp(schema->fields[i].name, name) == 0)
+			return &schema->fields[i];
+	}
+
+	errno = ENOENT;
+	return NULL;
+}
+
+static unsigned long long read_field(struct tep_handle *tep, void *data,
+				     struct marker_field *field)
+{
+	unsigned long long val;
+
+	val = tep_read_number(tep, data + field->offset, field->size);
+
+	switch (field->type) {
+	case TRACEFS_MARKER_S8:
+		return (long long)(int8_t)val;
+	case TRACEFS_MARKER_S16:
+		return (long long)(int16_t)val;
+	case TRACEFS_MARKER_S32:
+		return (long long)(int32_t)val;
+	default:
+		return val;
+	}
+}
+
+/**
+ * tracefs_marker_schema_read - read a number field of a raw_data record
+ * @schema: The schema of @record
+ * @tep: The tep handle of @record
+ * @record: A record written with @schema
+ * @name: The name of the field to read
+ * @val: Where to store the value of the field
+ *
+ * The signed fields are sign extended into @val.
+ *
+ * Returns 0 on success, -1 if @record does not have the id of @schema,
+ * or @name is not a number field of @schema.
+ */
+int tracefs_marker_schema_read(struct tracefs_marker_schema *schema,
+			       struct tep_handle *tep, struct tep_record *record,
+			       const char *name, unsigned long long *val)
+{
+	struct marker_field *field;
+	void *data;
+	int ret = -1;
+
+	pthread_mutex_lock(&schema_lock);
+	field = record_field(schema, tep, record, name, &data);
+	if (!field)
+		goto out;
+
+	if (field->type == TRACEFS_MARKER_STRING) {
+		errno = EINVAL;
+		goto out;
+	}
+
+	*val = read_field(tep, data, field);
+	ret = 0;
+ out:
+	pthread_mutex_unlock(&schema_lock);
+	return ret;
+}
+
+/**
+ * tracefs_marker_schema_read_string - read a string field of a raw_data record
+ * @schema: The schema of @record
+ * @tep: The tep handle of @record
+ * @record: A record written with @schema
+ * @name: The name of the field to read
+ * @str: Where to store a pointer to the string, in @record
+ *
+ * The string is not nul terminated if it fills its field.
+ *
+ * Returns the length of the string, or -1 if @record does not have the
+ * id of @schema, or @name is not a string field of @schema.
+ */
+int tracefs_marker_schema_read_string(struct tracefs_marker_schema *schema,
+				      struct tep_handle *tep,
+				      struct tep_record *record,
+				      const char *name, const char **str)
+{
+	struct marker_field *field;
+	void *data;
+	int ret = -1;
+
+	pthread_mutex_lock(&schema_lock);
+	field = record_field(schema, tep, record, name, &data);
+	if (!field)
+		goto out;
+
+	if (field->type != TRACEFS_MARKER_STRING) {
+		errno = EINVAL;
+		goto out;
+	}
+
+	*str = data + field->offset;
+	ret = strnlen(*str, field->size);
+ out:
+	pthread_mutex_unlock(&schema_lock);
+	return ret;
+}
+
+/**
+ * tracefs_marker_schema_print - print the fields of a raw_data record
+ * @seq: The trace_seq to print to
+ * @tep: The tep handle of @record
+ * @record: A record of the ftrace raw_data event
+ *
+ * Prints the name of the schema of @record, followed by its fields as
+ * "name=value".
+ *
+ * Returns 0 on success, or -1 if @record was not written with a schema
+ * of the process.
+ */
+int tracefs_marker_schema_print(struct trace_seq *seq, struct tep_handle *tep,
+				struct tep_record *record)
+{
+	struct tracefs_marker_schema *schema;
+	struct marker_field *field;
+	unsigned int id;
+	void *data;
+	int size;
+	int i;
+
+	if (raw_record_data(tep, record, &id, &data, &size) < 0)
+		return -1;
+
+	/* Hold the lock, so that the schema can not be freed while printed */
+	pthread_mutex_lock(&schema_lock);
+	schema = find_schema(id);
+	if (!schema || size < schema->size) {
+		pthread_mutex_unlock(&schema_lock);
+		return -1;
+	}
+
+	trace_seq_printf(seq, "%s:", schema->name);
+	for (i = 0; i < schema->nr_fields; i++) {
+		field = &schema->fields[i];
+		switch (field->type) {
+		case TRACEFS_MARKER_STRING:
+			trace_seq_printf(seq, " %s=%.*s", field->name,
+					 (int)strnlen(data + field->offset, field->size),
+					 (char *)data + field->offset);
+			break;
+		case TRACEFS_MARKER_S8:
+		case TRACEFS_MARKER_S16:
+		case TRACEFS_MARKER_S32:
+		case TRACEFS_MARKER_S64:
+			trace_seq_printf(seq, " %s=%lld", field->name,
+					 (long long)read_field(tep, data, field));
+			break;
+		default:
+			trace_seq_printf(seq, " %s=%llu", field->name,
+					 read_field(tep, data, field));
+			break;
+		}
+	}
+	pthread_mutex_unlock(&schema_lock);
+
+	return 0;
+}
@@ -0,0 +1,298 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Memory mapping of the per CPU ring buffers.
+ *
+ * Newer kernels allow trace_pipe_raw to be mapped into user space.
+ * The first pages of the mapping hold a meta page that describes the
+ * layout of the ring buffer, followed by all the sub-buffers. The
+ * sub-buffer that is currently safe to read (the reader page) is
+ * given by the meta page, and a new one is requested by the
+ * TRACE_MMAP_IOCTL_GET_READER ioctl.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/types.h>
+
+#include <kbuffer.h>
+
+#include "tracefs.h"
+#include "tracefs-local.h"
+
+#if defined(__has_include) && __has_include(<linux/trace_mmap.h>)
+#include <linux/trace_mmap.h>
+#endif
+
+#ifndef TRACE_MMAP_IOCTL_GET_READER
+/* Taken from include/uapi/linux/trace_mmap.h of the Linux kernel */
+struct trace_buffer_meta {
+	__u32		meta_page_size;
+	__u32		meta_struct_len;
+
+	__u32		subbuf_size;
+	__u32		nr_subbufs;
+
+	struct {
+		__u64	lost_events;
+		__u32	id;
+		__u32	read;
+	} reader;
+
+	__u64	flags;
+
+	__u64	entries;
+	__u64	overrun;
+	__u64	read;
+
+	__u64	Reserved1;
+	__u64	Reserved2;
+};
+
+#define TRACE_MMAP_IOCTL_GET_READER		_IO('R', 0x20)
+#endif
+
+struct trace_mmap {
+	struct trace_buffer_meta	*map;
+	void				*data;
+	int				fd;
+	int				last_idx;
+	int				meta_len;
+	int				data_len;
+	bool				loaded;
+	bool				pending;
+};
+
+/**
+ * trace_mmap - try to memory map a trace_pipe_raw file
+ * @fd: The file descriptor of the opened trace_pipe_raw file
+ * @kbuf: The kbuffer that will be used to read the mapped sub-buffers
+ *
+ * Returns a handle to the mapping, or NULL if the kernel does not
+ * support mapping the ring buffer (or on any other error). In that
+ * case the caller should fall back to read() of the file.
+ */
+__hidden void *trace_mmap(int fd, struct kbuffer *kbuf)
+{
+	struct trace_mmap *tmap;
+	int page_size;
+	void *meta;
+	void *data;
+
+	if (fd < 0 || !kbuf)
+		return NULL;
+
+	page_size = getpagesize();
+	meta = mmap(NULL, page_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (meta == MAP_FAILED)
+		return NULL;
+
+	tmap = calloc(1, sizeof(*tmap));
+	if (!tmap) {
+		munmap(meta, page_size);
+		return NULL;
+	}
+
+	tmap->fd = fd;
+	tmap->map = meta;
+	tmap->meta_len = tmap->map->meta_page_size;
+
+	/* Make sure this really is a ring buffer meta page */
+	if (tmap->meta_len < page_size || tmap->meta_len % page_size ||
+	    !tmap->map->nr_subbufs || tmap->map->subbuf_size < page_size) {
+		munmap(meta, page_size);
+		free(tmap);
+		return NULL;
+	}
+
+	if (tmap->meta_len > page_size) {
+		munmap(meta, page_size);
+		meta = mmap(NULL, tmap->meta_len, PROT_READ, MAP_SHARED, fd, 0);
+		if (meta == MAP_FAILED) {
+			free(tmap);
+			return NULL;
+		}
+		tmap->map = meta;
+	}
+
+	tmap->data_len = tmap->map->subbuf_size * tmap->map->nr_subbufs;
+	data = mmap(NULL, tmap->data_len, PROT_READ, MAP_SHARED,
+		    fd, tmap->meta_len);
+	if (data == MAP_FAILED) {
+		munmap(meta, tmap->meta_len);
+		free(tmap);
+		return NULL;
+	}
+	tmap->data = data;
+
+	return tmap;
+}
+
+/**
+ * trace_unmap - unmap a ring buffer mapped by trace_mmap()
+ * @mapping: The handle returned by trace_mmap()
+ *
+ * If events were read from the current reader page, the kernel is told
+ * that the page was consumed, otherwise the next mapping would return
+ * those events again. Like reading a page from trace_pipe_raw, any events
+ * left on that page are lost.
+ *
+ * Note, the file descriptor that was mapped is not closed.
+ */
+__hidden void trace_unmap(void *mapping)
+{
+	struct trace_mmap *tmap = mapping;
+
+	if (!tmap)
+		return;
+
+	if (tmap->pending)
+		ioctl(tmap->fd, TRACE_MMAP_IOCTL_GET_READER);
+
+	munmap(tmap->data, tmap->data_len);
+	munmap(tmap->map, tmap->meta_len);
+	free(tmap);
+}
+
+/*
+ * Load the current reader sub-buffer into @kbuf and skip the
+ * first @read bytes of its data, as they were already consumed.
+ * Returns 1 if there are events left to read, 0 otherwise.
+ */
+static int load_subbuf(struct trace_mmap *tmap, struct kbuffer *kbuf, int read)
+{
+	void *data;
+	int offset;
+
+	data = tmap->data + tmap->map->subbuf_size * tmap->last_idx;
+	kbuffer_load_subbuffer(kbuf, data);
+	tmap->loaded = true;
+
+	offset = kbuffer_start_of_data(kbuf) + read;
+	while (kbuffer_curr_offset(kbuf) < offset) {
+		if (!kbuffer_next_event(kbuf, NULL))
+			break;
+	}
+
+	if (!kbuffer_read_event(kbuf, NULL))
+		return 0;
+
+	tmap->pending = true;
+	return 1;
+}
+
+/**
+ * trace_mmap_load_subbuf - load the next mapped sub-buffer to read
+ * @mapping: The handle returned by trace_mmap()
+ * @kbuf: The kbuffer to load the sub-buffer into
+ *
+ * Must be called when all the events of @kbuf have been consumed (or
+ * for the first read). The events of the loaded sub-buffer point
+ * directly into the mapped ring buffer; they are valid until the
+ * next call of this function.
+ *
+ * Returns 1 if a sub-buffer with events was loaded, 0 if there is
+ * no more data to read, and -1 on error.
+ */
+__hidden int trace_mmap_load_subbuf(void *mapping, struct kbuffer *kbuf)
+{
+	struct trace_mmap *tmap = mapping;
+	int read = 0;
+
+	if (!tmap || !kbuf)
+		return -1;
+
+	if (!tmap->loaded) {
+		/*
+		 * The reader page could have been partially consumed
+		 * by a previous reader. The meta page tells how much.
+		 */
+		tmap->last_idx = tmap->map->reader.id;
+		read = tmap->map->reader.read;
+		if (load_subbuf(tmap, kbuf, read))
+			return 1;
+	} else {
+		/*
+		 * The reader page may also be the page the kernel is
+		 * writing to. Reload it in case more events were added
+		 * since the last time it was read.
+		 */
+		read = kbuffer_curr_offset(kbuf) - kbuffer_start_of_data(kbuf);
+		if (load_subbuf(tmap, kbuf, read))
+			return 1;
+	}
+
+	/* Everything on the reader page was consumed, ask for a new one */
+	if (ioctl(tmap->fd, TRACE_MMAP_IOCTL_GET_READER) < 0)
+		return errno == EAGAIN ? 0 : -1;
+	tmap->pending = false;
+
+	/*
+	 * If the reader page did not change, then only events that were
+	 * added after it was reloaded above are left to read.
+	 */
+	if (tmap->map->reader.id == tmap->last_idx)
+		return load_subbuf(tmap, kbuf, read);
+
+	tmap->last_idx = tmap->map->reader.id;
+
+	return load_subbuf(tmap, kbuf, tmap->map->reader.read);
+}
+
+/**
+ * trace_mmap_subbuf_size - get the size of the mapped sub-buffers
+ * @mapping: The handle returned by trace_mmap()
+ */
+__hidden int trace_mmap_subbuf_size(void *mapping)
+{
+	struct trace_mmap *tmap = mapping;
+
+	return tmap->map->subbuf_size;
+}
+
+/**
+ * trace_mmap_copy_subbuf - load a copy of the next mapped sub-buffer
+ * @mapping: The handle returned by trace_mmap()
+ * @kbuf: The kbuffer to load the copy into
+ * @buf: Where to copy the sub-buffer
+ * @size: The size of @buf, at least trace_mmap_subbuf_size()
+ *
+ * Like trace_mmap_load_subbuf(), but the sub-buffer is copied into @buf,
+ * and @kbuf is loaded with the copy, at the same event. The events read
+ * from it stay valid after the next call, as long as @buf is not reused.
+ * All the events of @kbuf must still be consumed before the next call.
+ *
+ * Returns 1 if a sub-buffer with events was loaded, 0 if there is
+ * no more data to read, and -1 on error.
+ */
+__hidden int trace_mmap_copy_subbuf(void *mapping, struct kbuffer *kbuf,
+				    void *buf, int size)
+{
+	struct trace_mmap *tmap = mapping;
+	int offset;
+	int ret;
+
+	if (!tmap || size < (int)tmap->map->subbuf_size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ret = trace_mmap_load_subbuf(mapping, kbuf);
+	if (ret <= 0)
+		return ret;
+
+	offset = kbuffer_curr_offset(kbuf);
+	memcpy(buf, tmap->data + tmap->map->subbuf_size * tmap->last_idx,
+	       tmap->map->subbuf_size);
+
+	/* The next load computes what was read from the offset in @kbuf */
+	kbuffer_load_subbuffer(kbuf, buf);
+	while (kbuffer_curr_offset(kbuf) < offset) {
+		if (!kbuffer_next_event(kbuf, NULL))
+			break;
+	}
+
+	return 1;
+}
@@ -0,0 +1,778 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Reading and recording of the per CPU raw buffers.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+
+#include <kbuffer.h>
+
+#include "tracefs.h"
+#include "tracefs-local.h"
+
+struct tracefs_cpu_reader {
+	struct tracefs_instance		*instance;
+	struct cpu_iterate		cpu_iter;
+	bool				nonblock;
+};
+
+/**
+ * tracefs_cpu_reader_open - open the raw buffer of a CPU for reading
+ * @instance: ftrace instance, can be NULL for the top instance
+ * @cpu: The CPU to read the buffer of
+ * @nonblock: If true, do not wait for data when reading
+ *
+ * Opens the trace_pipe_raw file of @cpu and allocates everything that is
+ * needed to read it. The same reader can then be read over and over with
+ * tracefs_cpu_reader_read(), without reopening the file or reallocating
+ * the buffers every time.
+ *
+ * Returns a reader that must be freed with tracefs_cpu_reader_close(),
+ * or NULL on error.
+ */
+struct tracefs_cpu_reader *
+tracefs_cpu_reader_open(struct tracefs_instance *instance, int cpu, bool nonblock)
+{
+	struct tracefs_cpu_reader *reader;
+	char *path;
+	int ret;
+
+	if (cpu < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	reader = calloc(1, sizeof(*reader));
+	if (!reader)
+		return NULL;
+
+	if (instance && trace_get_instance(instance) < 0)
+		goto error;
+	reader->instance = instance;
+	reader->nonblock = nonblock;
+
+	path = tracefs_instance_get_file(instance, "per_cpu");
+	if (!path)
+		goto error_put;
+
+	/* Blocking is done with poll(), so that the reads never block */
+	ret = trace_cpu_iterate_open(&reader->cpu_iter, path, cpu,
+				     trace_instance_subbuf_size(instance), true);
+	tracefs_put_tracing_file(path);
+	if (ret < 0)
+		goto error_put;
+
+	return reader;
+
+ error_put:
+	if (instance)
+		trace_put_instance(instance);
+ error:
+	free(reader);
+	return NULL;
+}
+
+/**
+ * tracefs_cpu_reader_close - close a CPU reader
+ * @reader: The reader returned by tracefs_cpu_reader_open()
+ *
+ * Closes the raw buffer of the CPU and frees @reader.
+ */
+void tracefs_cpu_reader_close(struct tracefs_cpu_reader *reader)
+{
+	if (!reader)
+		return;
+
+	trace_cpu_iterate_close(&reader->cpu_iter);
+	if (reader->instance)
+		trace_put_instance(reader->instance);
+	free(reader);
+}
+
+/**
+ * tracefs_cpu_reader_fd - get the file descriptor of a CPU reader
+ * @reader: The reader returned by tracefs_cpu_reader_open()
+ *
+ * Returns the file descriptor of the trace_pipe_raw file of @reader,
+ * that can be used to wait for data with poll(), select() or epoll.
+ * It belongs to @reader and must not be closed.
+ */
+int tracefs_cpu_reader_fd(struct tracefs_cpu_reader *reader)
+{
+	if (!reader) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return reader->cpu_iter.fd;
+}
+
+/**
+ * tracefs_cpu_reader_read - iterate through the events of a CPU
+ * @reader: The reader returned by tracefs_cpu_reader_open()
+ * @tep: a handle to the trace event parser context
+ * @callback: A user function, called for each record read
+ * @callback_context: A custom context, passed to the user callback function
+ *
+ * Calls @callback for each record that is currently in the buffer of the
+ * CPU of @reader, oldest first, with the same parameters as
+ * tracefs_iterate_raw_events(). If @reader was not opened as non blocking,
+ * it first waits for the buffer to have data. @tep must be the same for
+ * all the reads of @reader.
+ *
+ * If the @callback returns non-zero, the iteration stops.
+ *
+ * Returns the number of records passed to @callback, or -1 on error.
+ */
+int tracefs_cpu_reader_read(struct tracefs_cpu_reader *reader,
+			    struct tep_handle *tep,
+			    int (*callback)(struct tep_event *,
+					    struct tep_record *,
+					    int, void *),
+			    void *callback_context)
+{
+	struct cpu_iterate *cpu;
+	struct pollfd pfd;
+	int nr = 0;
+
+	if (!reader || !tep || !callback) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	cpu = &reader->cpu_iter;
+
+	if (!reader->nonblock) {
+		pfd.fd = cpu->fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, -1) < 0)
+			return errno == EINTR ? 0 : -1;
+	}
+
+	while (!read_next_record(tep, cpu)) {
+		nr++;
+		if (callback(cpu->event, &cpu->record, cpu->cpu, callback_context))
+			break;
+	}
+
+	return nr;
+}
+
+/*
+ * The header of each sub-buffer in a multiplexed recording, followed
+ * by @size bytes of the sub-buffer read from the buffer of @cpu.
+ */
+struct record_header {
+	uint32_t	cpu;
+	uint32_t	size;
+};
+
+struct tracefs_recorder {
+	struct tracefs_instance		*instance;
+	struct cpu_iterate		*cpus;
+	struct epoll_event		*events;
+	/* Output file of each CPU, or the single output if multiplexed */
+	int				*out_fds;
+	int				nr_cpus;
+	int				epoll_fd;
+	int				pipe_fds[2];
+	int				pipe_size;
+	unsigned int			flags;
+	bool				no_splice;
+};
+
+static int write_all(int fd, const void *data, size_t size)
+{
+	ssize_t ret;
+
+	while (size) {
+		ret = write(fd, data, size);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		data += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+/* Move all the @size bytes that are in the pipe to @fd */
+static int splice_all(struct tracefs_recorder *rec, int fd, ssize_t size)
+{
+	ssize_t ret;
+
+	while (size) {
+		ret = splice(rec->pipe_fds[0], NULL, fd, NULL, size, SPLICE_F_MOVE);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * The pipe that the sub-buffers are spliced through is shared by all the
+ * CPUs, so it must be empty whenever a CPU starts to use it. It must also
+ * hold a whole sub-buffer, as the kernel does not splice less, otherwise
+ * the data is copied instead.
+ */
+static int open_pipe(struct tracefs_recorder *rec)
+{
+	if (pipe2(rec->pipe_fds, O_CLOEXEC) < 0)
+		return -1;
+	rec->pipe_size = fcntl(rec->pipe_fds[0], F_GETPIPE_SZ);
+	if (rec->pipe_size < rec->cpus[0].psize)
+		rec->pipe_size = fcntl(rec->pipe_fds[0], F_SETPIPE_SZ,
+				       rec->cpus[0].psize);
+	if (rec->pipe_size < rec->cpus[0].psize)
+		rec->no_splice = true;
+	return 0;
+}
+
+/*
+ * A failed write to the output leaves the rest of the sub-buffer in the
+ * pipe, where it would be written to the output of the next CPU. Drop it
+ * along with the pipe, and copy the data from now on if a new pipe can
+ * not be made.
+ */
+static void reset_pipe(struct tracefs_recorder *rec)
+{
+	close(rec->pipe_fds[0]);
+	close(rec->pipe_fds[1]);
+	rec->pipe_fds[0] = -1;
+	rec->pipe_fds[1] = -1;
+
+	if (open_pipe(rec) < 0)
+		rec->no_splice = true;
+}
+
+static int out_fd(struct tracefs_recorder *rec, int i)
+{
+	return rec->flags & TRACEFS_RECORD_MULTIPLEX ? rec->out_fds[0] : rec->out_fds[i];
+}
+
+static int write_header(struct tracefs_recorder *rec, struct cpu_iterate *cpu, int size)
+{
+	struct record_header header;
+
+	if (!(rec->flags & TRACEFS_RECORD_MULTIPLEX))
+		return 0;
+
+	header.cpu = cpu->cpu;
+	header.size = size;
+	return write_all(rec->out_fds[0], &header, sizeof(header));
+}
+
+/*
+ * Splice the full sub-buffers of the CPU at @i to its output.
+ * Returns the number of bytes recorded, or -1 on error.
+ */
+static ssize_t splice_cpu(struct tracefs_recorder *rec, int i)
+{
+	struct cpu_iterate *cpu = &rec->cpus[i];
+	ssize_t total = 0;
+	ssize_t ret;
+	int size;
+
+	/* A multiplexed recording needs a header for each sub-buffer */
+	if (rec->flags & TRACEFS_RECORD_MULTIPLEX)
+		size = cpu->psize;
+	else
+		size = rec->pipe_size;
+
+	for (;;) {
+		ret = splice(cpu->fd, NULL, rec->pipe_fds[1], NULL, size,
+			     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EINVAL && !total) {
+			/* The file does not support splice, copy it instead */
+			rec->no_splice = true;
+			return 0;
+		}
+		if (ret <= 0)
+			break;
+		if (write_header(rec, cpu, ret) < 0 ||
+		    splice_all(rec, out_fd(rec, i), ret) < 0) {
+			reset_pipe(rec);
+			return -1;
+		}
+		total += ret;
+	}
+
+	if (ret < 0 && errno != EAGAIN)
+		return -1;
+
+	return total;
+}
+
+/*
+ * Copy the sub-buffers of the CPU at @i to its output, including the
+ * last one that the kernel may still be writing to, and that can not
+ * be spliced. Returns the number of bytes recorded, or -1 on error.
+ */
+static ssize_t copy_cpu(struct tracefs_recorder *rec, int i)
+{
+	struct cpu_iterate *cpu = &rec->cpus[i];
+	ssize_t total = 0;
+	ssize_t ret;
+
+	for (;;) {
+		ret = read(cpu->fd, cpu->page, cpu->psize);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		if (write_header(rec, cpu, ret) < 0 ||
+		    write_all(out_fd(rec, i), cpu->page, ret) < 0)
+			return -1;
+		total += ret;
+	}
+
+	if (ret < 0 && errno != EAGAIN)
+		return -1;
+
+	return total;
+}
+
+static ssize_t record_cpu(struct tracefs_recorder *rec, int i, bool flush)
+{
+	ssize_t total = 0;
+	ssize_t ret;
+
+	if (!rec->no_splice) {
+		total = splice_cpu(rec, i);
+		if (total < 0)
+			return -1;
+		if (!flush && !rec->no_splice)
+			return total;
+	}
+
+	ret = copy_cpu(rec, i);
+	if (ret < 0)
+		return -1;
+
+	return total + ret;
+}
+
+static int make_dir(const char *path)
+{
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		return -1;
+	return 0;
+}
+
+static int open_cpu_output(const char *output, int cpu)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, PATH_MAX, "%s/per_cpu", output);
+	if (make_dir(path) < 0)
+		return -1;
+	snprintf(path, PATH_MAX, "%s/per_cpu/cpu%d", output, cpu);
+	if (make_dir(path) < 0)
+		return -1;
+	snprintf(path, PATH_MAX, "%s/per_cpu/cpu%d/trace_pipe_raw", output, cpu);
+
+	return open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+/**
+ * tracefs_recorder_open - create a recorder of the raw per CPU buffers
+ * @instance: ftrace instance, can be NULL for the top instance
+ * @cpus: Record only the buffers of CPUs, set in the mask.
+ *	  If NULL, record all CPUs.
+ * @cpu_size: size of @cpus set
+ * @output: Where to write the recording to
+ * @flags: TRACEFS_RECORD_* flags
+ *
+ * Creates a recorder that copies the binary sub-buffers of the per CPU
+ * buffers to files, with splice() and without any formatting. By default,
+ * @output is a directory and the data of each CPU is written to the file
+ * per_cpu/cpu<N>/trace_pipe_raw under it, the same layout as the tracefs
+ * directory. An instance allocated with tracefs_instance_alloc() on
+ * @output can then be read by the raw event iterators.
+ *
+ * If @flags has TRACEFS_RECORD_MULTIPLEX, all the CPUs are written to the
+ * single file @output, each sub-buffer preceded by a header with its CPU
+ * and size.
+ *
+ * Returns a recorder that must be freed with tracefs_recorder_close(),
+ * or NULL on error.
+ */
+struct tracefs_recorder *
+tracefs_recorder_open(struct tracefs_instance *instance, cpu_set_t *cpus,
+		      int cpu_size, const char *output, unsigned int flags)
+{
+	struct tracefs_recorder *rec;
+	struct epoll_event ee = { };
+	int nr_out;
+	int i;
+
+	if (!output) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	rec = calloc(1, sizeof(*rec));
+	if (!rec)
+		return NULL;
+
+	rec->flags = flags;
+	rec->epoll_fd = -1;
+	rec->pipe_fds[0] = -1;
+	rec->pipe_fds[1] = -1;
+
+	if (instance) {
+		if (trace_get_instance(instance) < 0) {
+			free(rec);
+			return NULL;
+		}
+		rec->instance = instance;
+	}
+
+	if (trace_open_cpu_files(instance, cpus, cpu_size, &rec->cpus, &rec->nr_cpus) < 0 ||
+	    !rec->nr_cpus)
+		goto error;
+
+	nr_out = flags & TRACEFS_RECORD_MULTIPLEX ? 1 : rec->nr_cpus;
+	rec->out_fds = malloc(nr_out * sizeof(*rec->out_fds));
+	rec->events = calloc(rec->nr_cpus, sizeof(*rec->events));
+	if (!rec->out_fds || !rec->events)
+		goto error;
+	for (i = 0; i < nr_out; i++)
+		rec->out_fds[i] = -1;
+
+	if (flags & TRACEFS_RECORD_MULTIPLEX) {
+		rec->out_fds[0] = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (rec->out_fds[0] < 0)
+			goto error;
+	} else {
+		if (make_dir(output) < 0)
+			goto error;
+		for (i = 0; i < nr_out; i++) {
+			rec->out_fds[i] = open_cpu_output(output, rec->cpus[i].cpu);
+			if (rec->out_fds[i] < 0)
+				goto error;
+		}
+	}
+
+	if (open_pipe(rec) < 0)
+		goto error;
+
+	rec->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (rec->epoll_fd < 0)
+		goto error;
+
+	ee.events = EPOLLIN;
+	for (i = 0; i < rec->nr_cpus; i++) {
+		ee.data.u32 = i;
+		if (epoll_ctl(rec->epoll_fd, EPOLL_CTL_ADD, rec->cpus[i].fd, &ee) < 0)
+			goto error;
+	}
+
+	return rec;
+ error:
+	tracefs_recorder_close(rec);
+	return NULL;
+}
+
+/**
+ * tracefs_recorder_close - close a recorder
+ * @rec: The recorder returned by tracefs_recorder_open()
+ *
+ * Closes the per CPU buffers and the output files, and frees @rec.
+ * Data that was not recorded yet is not written, tracefs_recorder_flush()
+ * must be called first to record it.
+ */
+void tracefs_recorder_close(struct tracefs_recorder *rec)
+{
+	int nr_out;
+	int i;
+
+	if (!rec)
+		return;
+
+	if (rec->out_fds) {
+		nr_out = rec->flags & TRACEFS_RECORD_MULTIPLEX ? 1 : rec->nr_cpus;
+		for (i = 0; i < nr_out; i++) {
+			if (rec->out_fds[i] >= 0)
+				close(rec->out_fds[i]);
+		}
+	}
+	if (rec->pipe_fds[0] >= 0)
+		close(rec->pipe_fds[0]);
+	if (rec->pipe_fds[1] >= 0)
+		close(rec->pipe_fds[1]);
+	if (rec->epoll_fd >= 0)
+		close(rec->epoll_fd);
+	trace_close_cpu_files(rec->cpus, rec->nr_cpus);
+	if (rec->instance)
+		trace_put_instance(rec->instance);
+	free(rec->out_fds);
+	free(rec->events);
+	free(rec);
+}
+
+/**
+ * tracefs_recorder_fd - get a file descriptor to wait on for data
+ * @rec: The recorder returned by tracefs_recorder_open()
+ *
+ * Returns a file descriptor that becomes readable when any of the per CPU
+ * buffers of @rec have data to record, for poll(), select() or epoll.
+ * It belongs to @rec and must not be closed.
+ */
+int tracefs_recorder_fd(struct tracefs_recorder *rec)
+{
+	if (!rec) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return rec->epoll_fd;
+}
+
+/**
+ * tracefs_recorder_read - wait for data and record it
+ * @rec: The recorder returned by tracefs_recorder_open()
+ * @timeout: Milliseconds to wait for data, 0 to not wait, -1 to wait forever
+ *
+ * Waits until one of the CPU buffers of @rec has data, or until @timeout
+ * expires, and records the full sub-buffers of the buffers that have data.
+ * The sub-buffers are moved to the output with splice(), without copying
+ * them to user space. The last sub-buffer of a CPU, that the kernel may
+ * still be writing to, is left in the buffer. Use tracefs_recorder_flush()
+ * to record it.
+ *
+ * Returns the number of bytes recorded, 0 if @timeout expired or a
+ * signal interrupted the wait, or -1 on error.
+ */
+ssize_t tracefs_recorder_read(struct tracefs_recorder *rec, int timeout)
+{
+	ssize_t total = 0;
+	ssize_t ret;
+	int nr;
+	int i;
+
+	if (!rec) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	nr = epoll_wait(rec->epoll_fd, rec->events, rec->nr_cpus, timeout);
+	if (nr < 0)
+		return errno == EINTR ? 0 : -1;
+
+	for (i = 0; i < nr; i++) {
+		ret = record_cpu(rec, rec->events[i].data.u32, false);
+		if (ret < 0)
+			return -1;
+		total += ret;
+	}
+
+	return total;
+}
+
+/**
+ * tracefs_recorder_flush - record all the data left in the buffers
+ * @rec: The recorder returned by tracefs_recorder_open()
+ *
+ * Records everything that is in the CPU buffers of @rec without waiting,
+ * including the sub-buffers the kernel is still writing to. This should
+ * be called after tracing is stopped, and before tracefs_recorder_close().
+ *
+ * Returns the number of bytes recorded, or -1 on error.
+ */
+ssize_t tracefs_recorder_flush(struct tracefs_recorder *rec)
+{
+	ssize_t total = 0;
+	ssize_t ret;
+	int i;
+
+	if (!rec) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < rec->nr_cpus; i++) {
+		ret = record_cpu(rec, i, true);
+		if (ret < 0)
+			return -1;
+		total += ret;
+	}
+
+	return total;
+}
+
+/*
+ * The recorder writes whole sub-buffers, so the biggest one of a CPU is
+ * the size of the sub-buffers it was recorded with.
+ */
+static struct cpu_iterate *find_file_cpu(struct cpu_iterate **all_cpus, int *count,
+					 int cpu, int size)
+{
+	struct cpu_iterate *tmp;
+	int i;
+
+	for (i = 0; i < *count; i++) {
+		if ((*all_cpus)[i].cpu == cpu) {
+			tmp = &(*all_cpus)[i];
+			if (size > tmp->psize)
+				tmp->psize = size;
+			return tmp;
+		}
+	}
+
+	tmp = realloc(*all_cpus, (*count + 1) * sizeof(*tmp));
+	if (!tmp)
+		return NULL;
+	*all_cpus = tmp;
+	tmp += (*count)++;
+	memset(tmp, 0, sizeof(*tmp));
+	tmp->cpu = cpu;
+	tmp->fd = -1;
+	tmp->psize = size > getpagesize() ? size : getpagesize();
+	tmp->offline = true;
+
+	return tmp;
+}
+
+/*
+ * Walk the sub-buffers of a multiplexed recording. The first pass
+ * (@fill false) counts the sub-buffers of each CPU, and the second one
+ * fills them in.
+ */
+static int scan_file_pages(void *map, size_t size, cpu_set_t *cpus, int cpu_size,
+			   struct cpu_iterate **all_cpus, int *count, bool fill)
+{
+	struct record_header *header;
+	struct trace_file_page *page;
+	struct cpu_iterate *cpu;
+	size_t offset = 0;
+
+	while (offset + sizeof(*header) <= size) {
+		header = map + offset;
+		offset += sizeof(*header);
+		/* Ignore a sub-buffer that was not completely written */
+		if (!header->size || header->size > size - offset)
+			break;
+
+		if (cpus && !CPU_ISSET_S(header->cpu, cpu_size, cpus)) {
+			offset += header->size;
+			continue;
+		}
+
+		cpu = find_file_cpu(all_cpus, count, header->cpu, header->size);
+		if (!cpu)
+			return -1;
+
+		if (fill) {
+			page = &cpu->file_pages[cpu->next_file_page++];
+			page->offset = offset;
+			page->size = header->size;
+		} else {
+			cpu->nr_file_pages++;
+		}
+		offset += header->size;
+	}
+
+	return 0;
+}
+
+/**
+ * tracefs_iterate_raw_file - Iterate through the events of a recording
+ * @tep: a handle to the trace event parser context
+ * @file: The file written by a multiplexed recorder
+ * @cpus: Iterate only through the buffers of CPUs, set in the mask.
+ *	  If NULL, iterate through all CPUs.
+ * @cpu_size: size of @cpus set
+ * @callback: A user function, called for each record from the file
+ * @callback_context: A custom context, passed to the user callback function
+ *
+ * Iterates through the events of a file recorded by a recorder opened with
+ * TRACEFS_RECORD_MULTIPLEX, with the same parameters and in the same order
+ * as tracefs_iterate_raw_events() reads the live buffers. The file is
+ * mapped, and the records point directly into it.
+ *
+ * To read a recording of separate CPU files, allocate an instance on its
+ * directory with tracefs_instance_alloc() and iterate it with
+ * tracefs_iterate_raw_events().
+ *
+ * Returns -1 in case of an error, or 0 otherwise
+ */
+int tracefs_iterate_raw_file(struct tep_handle *tep, const char *file,
+			     cpu_set_t *cpus, int cpu_size,
+			     int (*callback)(struct tep_event *,
+					     struct tep_record *,
+					     int, void *),
+			     void *callback_context)
+{
+	struct cpu_iterate *all_cpus = NULL;
+	bool keep_going = true;
+	void *map = MAP_FAILED;
+	struct stat st;
+	int count = 0;
+	int ret = -1;
+	int fd;
+	int i;
+
+	if (!tep || !file || !callback) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0)
+		goto out;
+	if (!st.st_size) {
+		ret = 0;
+		goto out;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		goto out;
+
+	if (scan_file_pages(map, st.st_size, cpus, cpu_size, &all_cpus, &count, false) < 0)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		all_cpus[i].file_map = map;
+		all_cpus[i].file_pages = calloc(all_cpus[i].nr_file_pages,
+						sizeof(*all_cpus[i].file_pages));
+		if (!all_cpus[i].file_pages)
+			goto out;
+	}
+
+	scan_file_pages(map, st.st_size, cpus, cpu_size, &all_cpus, &count, true);
+	for (i = 0; i < count; i++)
+		all_cpus[i].next_file_page = 0;
+
+	ret = trace_read_cpu_pages(tep, all_cpus, count, callback,
+				   callback_context, &keep_going);
+	if (ret > 0)
+		ret = 0;
+ out:
+	trace_close_cpu_files(all_cpus, count);
+	if (map != MAP_FAILED)
+		munmap(map, st.st_size);
+	close(fd);
+	return ret;
+}
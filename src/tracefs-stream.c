@@ -0,0 +1,1060 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Streaming of the trace_pipe files of many instances from one thread.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "tracefs.h"
+#include "tracefs-local.h"
+
+/* The epoll data of the file descriptor that wakes up the streamer */
+#define STREAM_WAKE		UINT64_MAX
+/* Set in the epoll data of the destination of a stream */
+#define STREAM_OUT		1ULL
+/* The epoll data of the io_uring, and the data of its cancel request */
+#define STREAM_URING		(UINT64_MAX - 1)
+
+/* The size of the io_uring, and its registered files and buffers */
+#define URING_ENTRIES		256
+#define URING_BUFFERS		256
+#define URING_FILES		(URING_BUFFERS * NR_URING_FILES)
+
+/* The registered files of a stream, from its first slot */
+enum {
+	URING_IN,
+	URING_OUT,
+	URING_PIPE_OUT,
+	URING_PIPE_IN,
+	NR_URING_FILES,
+};
+
+/* The requests of a stream in the io_uring, in the low bits of their data */
+enum {
+	REQ_IN,
+	REQ_OUT,
+	REQ_POLL,
+};
+#define REQ_SHIFT		2
+#define REQ_MASK		((1ULL << REQ_SHIFT) - 1)
+
+/*
+ * Number of transfers in a row that fill at least half of the pipe or of
+ * the bounce buffer of an adaptive stream, before it is doubled.
+ */
+#define STREAM_GROW_LOADED	4
+/* The largest bounce buffer of an adaptive stream, if not set */
+#define STREAM_BUF_MAX		(1 << 20)
+/* The default of /proc/sys/fs/pipe-max-size */
+#define PIPE_MAX_SIZE		(1 << 20)
+
+struct pipe_stream {
+	struct tracefs_instance		*instance;
+	/* The bounce buffer, if the destination does not support splice */
+	char				*buf;
+	/* Bytes read that are not written to the destination yet */
+	size_t				pending;
+	size_t				buf_offset;
+	size_t				buf_size;
+	unsigned long long		bytes;
+	unsigned long long		stalls;
+	int				in_fd;
+	int				out_fd;
+	int				pipe_fds[2];
+	int				pipe_size;
+	int				error;
+	/* The slots of the registered files and buffer, or -1 */
+	int				file_slot;
+	int				buf_slot;
+	/*
+	 * The limits of an adaptive stream, from the streamer sizes and flags
+	 * when the stream was added.
+	 */
+	size_t				max_buf_size;
+	int				max_pipe_size;
+	/* Number of loaded transfers in a row, for adaptive streams */
+	int				loaded;
+	bool				adaptive;
+	bool				no_splice;
+	/* The destination is in the epoll set, and can push back */
+	bool				pollable;
+	bool				blocked;
+	bool				done;
+};
+
+struct tracefs_streamer {
+	struct pipe_stream		*streams;
+	struct epoll_event		*events;
+	/* If set, the streams are moved by io_uring requests, not epoll */
+	struct trace_uring		*uring;
+	/* What the io_uring read from the wake up eventfd */
+	unsigned long long		wake_val;
+	int				nr_inflight;
+	int				nr_streams;
+	int				nr_active;
+	int				epoll_fd;
+	int				wake_fd;
+	/* The sizes set by tracefs_streamer_set_sizes() */
+	int				pipe_size;
+	int				buf_size;
+	unsigned int			flags;
+	bool				cancel;
+	bool				keep_going;
+};
+
+static int pipe_max_size(void)
+{
+	static int max_size;
+	char *buf;
+	int size = 0;
+
+	if (max_size)
+		return max_size;
+
+	if (str_read_file("/proc/sys/fs/pipe-max-size", &buf, false) > 0) {
+		size = atoi(buf);
+		free(buf);
+	}
+
+	max_size = size > 0 ? size : PIPE_MAX_SIZE;
+
+	return max_size;
+}
+
+/*
+ * The kernel rounds the size of a pipe up to a power of two pages, and
+ * refuses to grow it past the limit of pipe buffers of the user. The
+ * pipe keeps its size then, which is not an error.
+ */
+static void resize_pipe(struct pipe_stream *stream, int size)
+{
+	int ret;
+
+	if (size > pipe_max_size())
+		size = pipe_max_size();
+	if (size == stream->pipe_size)
+		return;
+
+	ret = fcntl(stream->pipe_fds[1], F_SETPIPE_SZ, size);
+	if (ret > 0)
+		stream->pipe_size = ret;
+}
+
+static void resize_buf(struct pipe_stream *stream, size_t size)
+{
+	char *buf;
+
+	if (size <= stream->buf_size)
+		return;
+
+	buf = realloc(stream->buf, size);
+	if (!buf)
+		return;
+
+	stream->buf = buf;
+	stream->buf_size = size;
+}
+
+/* Grow the pipe or the bounce buffer of a stream that keeps filling it */
+static void stream_adapt(struct tracefs_streamer *streamer,
+			 struct pipe_stream *stream, size_t size)
+{
+	size_t max;
+	size_t cur;
+
+	cur = stream->no_splice ? stream->buf_size : stream->pipe_size;
+	if (size < cur / 2) {
+		stream->loaded = 0;
+		return;
+	}
+
+	if (++stream->loaded < STREAM_GROW_LOADED)
+		return;
+	stream->loaded = 0;
+
+	if (stream->no_splice) {
+		max = stream->max_buf_size;
+		resize_buf(stream, cur * 2 < max ? cur * 2 : max);
+		if (stream->buf_slot >= 0 &&
+		    trace_uring_set_buffer(streamer->uring, stream->buf_slot,
+					   stream->buf, stream->buf_size) < 0)
+			stream->buf_slot = -1;
+	} else {
+		max = stream->max_pipe_size;
+		resize_pipe(stream, cur * 2 < max ? cur * 2 : max);
+	}
+}
+
+static void close_stream(struct pipe_stream *stream)
+{
+	if (stream->in_fd >= 0)
+		close(stream->in_fd);
+	if (stream->out_fd >= 0)
+		close(stream->out_fd);
+	if (stream->pipe_fds[0] >= 0)
+		close(stream->pipe_fds[0]);
+	if (stream->pipe_fds[1] >= 0)
+		close(stream->pipe_fds[1]);
+	if (stream->instance)
+		trace_put_instance(stream->instance);
+	free(stream->buf);
+}
+
+static int stream_watch(struct tracefs_streamer *streamer, int i,
+			int op, bool out, unsigned int events)
+{
+	struct pipe_stream *stream = &streamer->streams[i];
+	struct epoll_event ee = { };
+
+	ee.events = events;
+	ee.data.u64 = ((uint64_t)i << 1) | (out ? STREAM_OUT : 0);
+
+	return epoll_ctl(streamer->epoll_fd, op,
+			 out ? stream->out_fd : stream->in_fd, &ee);
+}
+
+/*
+ * Stop a stream that failed, or that reached the end of its trace_pipe,
+ * and keep the others going.
+ */
+static void stream_done(struct tracefs_streamer *streamer, int i, int error)
+{
+	struct pipe_stream *stream = &streamer->streams[i];
+
+	stream->error = error;
+	stream->done = true;
+	streamer->nr_active--;
+
+	if (streamer->uring)
+		return;
+
+	epoll_ctl(streamer->epoll_fd, EPOLL_CTL_DEL, stream->in_fd, NULL);
+	if (stream->pollable)
+		epoll_ctl(streamer->epoll_fd, EPOLL_CTL_DEL, stream->out_fd, NULL);
+}
+
+/*
+ * While the destination of a stream is full, stop reading its trace_pipe
+ * and wait for the destination to be writable instead.
+ */
+static void stream_block(struct tracefs_streamer *streamer, int i, bool block)
+{
+	struct pipe_stream *stream = &streamer->streams[i];
+
+	if (stream->blocked == block)
+		return;
+
+	stream->blocked = block;
+	if (block)
+		stream->stalls++;
+
+	stream_watch(streamer, i, EPOLL_CTL_MOD, false, block ? 0 : EPOLLIN);
+	stream_watch(streamer, i, EPOLL_CTL_MOD, true, block ? EPOLLOUT : 0);
+}
+
+/*
+ * Write what is pending of the stream at @i to its destination.
+ * Returns the number of bytes written.
+ */
+static ssize_t drain_stream(struct tracefs_streamer *streamer, int i)
+{
+	struct pipe_stream *stream = &streamer->streams[i];
+	ssize_t total = 0;
+	ssize_t ret;
+
+	while (stream->pending) {
+		if (stream->no_splice)
+			ret = write(stream->out_fd, stream->buf + stream->buf_offset,
+				    stream->pending);
+		else
+			ret = splice(stream->pipe_fds[0], NULL, stream->out_fd, NULL,
+				     stream->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EAGAIN && stream->pollable) {
+			stream_block(streamer, i, true);
+			return total;
+		}
+		if (ret <= 0) {
+			stream_done(streamer, i, ret < 0 ? errno : ENOSPC);
+			return total;
+		}
+		stream->pending -= ret;
+		stream->buf_offset += ret;
+		stream->bytes += ret;
+		total += ret;
+	}
+
+	stream_block(streamer, i, false);
+
+	return total;
+}
+
+/*
+ * A read of trace_pipe returns at most a page, fill the bounce buffer
+ * with as many as it takes, to write it out at once.
+ */
+static ssize_t read_stream(struct pipe_stream *stream)
+{
+	size_t len = 0;
+	ssize_t ret;
+
+	do {
+		ret = read(stream->in_fd, stream->buf + len, stream->buf_size - len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		len += ret;
+	} while (len < stream->buf_size);
+
+	return len ? len : ret;
+}
+
+/*
+ * Move what is in the trace_pipe of the stream at @i to its destination,
+ * at most the size of its pipe or buffer at a time, so that a busy instance
+ * does not hold up the others. Returns the number of bytes written.
+ */
+static ssize_t fill_stream(struct tracefs_streamer *streamer, int i)
+{
+	struct pipe_stream *stream = &streamer->streams[i];
+	ssize_t ret;
+
+	if (stream->pending)
+		return drain_stream(streamer, i);
+
+	if (stream->no_splice) {
+		ret = read_stream(stream);
+	} else {
+		do {
+			ret = splice(stream->in_fd, NULL, stream->pipe_fds[1], NULL,
+				     stream->pipe_size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		} while (ret < 0 && errno == EINTR);
+	}
+
+	if (ret <= 0) {
+		if (!ret || errno != EAGAIN)
+			stream_done(streamer, i, ret ? errno : 0);
+		return 0;
+	}
+
+	stream->pending = ret;
+	stream->buf_offset = 0;
+
+	if (stream->adaptive)
+		stream_adapt(streamer, stream, ret);
+
+	return drain_stream(streamer, i);
+}
+
+/* The file of a stream to pass to a request, its slot if it is registered */
+static int uring_file(struct pipe_stream *stream, int file)
+{
+	if (stream->file_slot >= 0)
+		return stream->file_slot + file;
+
+	switch (file) {
+	case URING_IN:
+		return stream->in_fd;
+	case URING_OUT:
+		return stream->out_fd;
+	case URING_PIPE_OUT:
+		return stream->pipe_fds[0];
+	default:
+		return stream->pipe_fds[1];
+	}
+}
+
+/*
+ * Queue the next request of the stream at @i. A stream has a single
+ * request in flight: it reads its trace_pipe, writes what it read to its
+ * destination until all of it is written, and reads again. If the
+ * destination is full, it polls it before writing again.
+ */
+static void uring_queue(struct tracefs_streamer *streamer, int i, int req)
+{
+	struct pipe_stream *stream = &streamer->streams[i];
+	unsigned long long data = ((unsigned long long)i << REQ_SHIFT) | req;
+	struct trace_uring *ring = streamer->uring;
+	bool fixed = stream->file_slot >= 0;
+	int ret;
+
+	switch (req) {
+	case REQ_IN:
+		if (stream->no_splice)
+			ret = trace_uring_rw(ring, false, uring_file(stream, URING_IN),
+					     fixed, stream->buf, stream->buf_size,
+					     stream->buf_slot, data);
+		else
+			ret = trace_uring_splice(ring, uring_file(stream, URING_IN),
+						 uring_file(stream, URING_PIPE_IN),
+						 stream->pipe_size, fixed, data);
+		break;
+	case REQ_OUT:
+		if (stream->no_splice)
+			ret = trace_uring_rw(ring, true, uring_file(stream, URING_OUT),
+					     fixed, stream->buf + stream->buf_offset,
+					     stream->pending, stream->buf_slot, data);
+		else
+			ret = trace_uring_splice(ring, uring_file(stream, URING_PIPE_OUT),
+						 uring_file(stream, URING_OUT),
+						 stream->pending, fixed, data);
+		break;
+	default:
+		ret = trace_uring_poll(ring, uring_file(stream, URING_OUT), fixed,
+				       POLLOUT, data);
+		break;
+	}
+
+	if (ret < 0)
+		stream_done(streamer, i, errno);
+	else
+		streamer->nr_inflight++;
+}
+
+/* Register the files and the buffer of the stream at @i, if there is room */
+static void uring_register_stream(struct tracefs_streamer *streamer, int i)
+{
+	struct pipe_stream *stream = &streamer->streams[i];
+	int slot = i * NR_URING_FILES;
+	int file;
+
+	if (slot + NR_URING_FILES <= URING_FILES) {
+		for (file = 0; file < NR_URING_FILES; file++) {
+			if (trace_uring_set_file(streamer->uring, slot + file,
+						 uring_file(stream, file)) < 0)
+				break;
+		}
+		if (file == NR_URING_FILES)
+			stream->file_slot = slot;
+	}
+
+	if (stream->no_splice && i < URING_BUFFERS &&
+	    !trace_uring_set_buffer(streamer->uring, i, stream->buf, stream->buf_size))
+		stream->buf_slot = i;
+}
+
+static int uring_queue_wake(struct tracefs_streamer *streamer)
+{
+	if (trace_uring_rw(streamer->uring, false, streamer->wake_fd, false,
+			   &streamer->wake_val, sizeof(streamer->wake_val),
+			   -1, STREAM_WAKE) < 0)
+		return -1;
+
+	streamer->nr_inflight++;
+
+	return 0;
+}
+
+/*
+ * Handle the completion of a request with @data and result @res, and
+ * queue the next request of its stream. Returns the number of bytes
+ * written to the destination of the stream.
+ */
+static ssize_t uring_complete(struct tracefs_streamer *streamer,
+			      unsigned long long data, int res)
+{
+	struct pipe_stream *stream;
+	int req = data & REQ_MASK;
+	int i = data >> REQ_SHIFT;
+
+	/* The cancel request itself is not counted */
+	if (data == STREAM_URING)
+		return 0;
+
+	streamer->nr_inflight--;
+	if (streamer->cancel)
+		return 0;
+
+	if (data == STREAM_WAKE) {
+		if (uring_queue_wake(streamer) < 0)
+			tracefs_warning("Failed to wait for the streamer to stop");
+		return 0;
+	}
+
+	stream = &streamer->streams[i];
+
+	switch (req) {
+	case REQ_IN:
+		if (res == -EINTR || res == -EAGAIN) {
+			uring_queue(streamer, i, REQ_IN);
+		} else if (res <= 0) {
+			stream_done(streamer, i, -res);
+		} else {
+			stream->pending = res;
+			stream->buf_offset = 0;
+			if (stream->adaptive)
+				stream_adapt(streamer, stream, res);
+			uring_queue(streamer, i, REQ_OUT);
+		}
+		return 0;
+	case REQ_OUT:
+		if (res == -EAGAIN) {
+			stream->blocked = true;
+			stream->stalls++;
+			uring_queue(streamer, i, REQ_POLL);
+		} else if (res == -EINTR) {
+			uring_queue(streamer, i, REQ_OUT);
+		} else if (res <= 0) {
+			stream_done(streamer, i, res ? -res : ENOSPC);
+		} else {
+			stream->pending -= res;
+			stream->buf_offset += res;
+			stream->bytes += res;
+			if (!stream->pending)
+				stream->blocked = false;
+			uring_queue(streamer, i, stream->pending ? REQ_OUT : REQ_IN);
+			return res;
+		}
+		return 0;
+	default:
+		if (res < 0 && res != -EINTR)
+			stream_done(streamer, i, -res);
+		else if (res > 0 && !(res & POLLOUT))
+			stream_done(streamer, i, EPIPE);
+		else
+			uring_queue(streamer, i, REQ_OUT);
+		return 0;
+	}
+}
+
+/*
+ * Wait for the completions of the io_uring, and handle them. If @submit
+ * is not set, the requests they queue are left to be submitted by the
+ * next wait, to save a system call.
+ */
+static ssize_t uring_read(struct tracefs_streamer *streamer, int timeout,
+			  bool submit)
+{
+	unsigned long long data;
+	ssize_t total = 0;
+	int res;
+
+	if (trace_uring_submit(streamer->uring, timeout) < 0)
+		return -1;
+
+	while (trace_uring_reap(streamer->uring, &data, &res))
+		total += uring_complete(streamer, data, res);
+
+	if (submit && trace_uring_submit(streamer->uring, 0) < 0)
+		return -1;
+
+	return total;
+}
+
+/*
+ * Cancel all the requests and wait for them to complete, as they use
+ * the buffers of the streams, then close the io_uring.
+ */
+static void uring_close(struct tracefs_streamer *streamer)
+{
+	unsigned long long data;
+	int res;
+
+	streamer->cancel = true;
+	if (streamer->nr_inflight &&
+	    trace_uring_cancel(streamer->uring, STREAM_URING) < 0)
+		tracefs_warning("Failed to cancel the streamer requests");
+
+	while (streamer->nr_inflight > 0) {
+		if (trace_uring_submit(streamer->uring, -1) < 0)
+			break;
+		while (trace_uring_reap(streamer->uring, &data, &res))
+			uring_complete(streamer, data, res);
+	}
+
+	trace_uring_free(streamer->uring);
+	streamer->uring = NULL;
+}
+
+/**
+ * tracefs_streamer_alloc - allocate a streamer of trace_pipe files
+ *
+ * Allocates a streamer, that moves the trace data of many instances to
+ * their destinations, all from the thread that calls tracefs_streamer_read()
+ * or tracefs_streamer_run(). The instances are added to it with
+ * tracefs_streamer_add().
+ *
+ * Returns a streamer that must be freed with tracefs_streamer_free(),
+ * or NULL on error.
+ */
+struct tracefs_streamer *tracefs_streamer_alloc(void)
+{
+	struct tracefs_streamer *streamer;
+	struct epoll_event ee = { };
+
+	streamer = calloc(1, sizeof(*streamer));
+	if (!streamer)
+		return NULL;
+
+	streamer->keep_going = true;
+	streamer->wake_fd = -1;
+	streamer->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (streamer->epoll_fd < 0)
+		goto error;
+
+	streamer->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (streamer->wake_fd < 0)
+		goto error;
+
+	ee.events = EPOLLIN;
+	ee.data.u64 = STREAM_WAKE;
+	if (epoll_ctl(streamer->epoll_fd, EPOLL_CTL_ADD, streamer->wake_fd, &ee) < 0)
+		goto error;
+
+	return streamer;
+ error:
+	tracefs_streamer_free(streamer);
+	return NULL;
+}
+
+/**
+ * tracefs_streamer_free - free a streamer
+ * @streamer: The streamer returned by tracefs_streamer_alloc()
+ *
+ * Closes the trace_pipe files of all the streams of @streamer, and frees
+ * it. The file descriptors given to tracefs_streamer_add() are not closed.
+ */
+void tracefs_streamer_free(struct tracefs_streamer *streamer)
+{
+	int i;
+
+	if (!streamer)
+		return;
+
+	if (streamer->uring)
+		uring_close(streamer);
+	for (i = 0; i < streamer->nr_streams; i++)
+		close_stream(&streamer->streams[i]);
+	if (streamer->wake_fd >= 0)
+		close(streamer->wake_fd);
+	if (streamer->epoll_fd >= 0)
+		close(streamer->epoll_fd);
+	free(streamer->streams);
+	free(streamer->events);
+	free(streamer);
+}
+
+/**
+ * tracefs_streamer_add - add the trace_pipe of an instance to a streamer
+ * @streamer: The streamer returned by tracefs_streamer_alloc()
+ * @instance: ftrace instance, can be NULL for the top instance
+ * @fd: The file descriptor to write the trace data to
+ *
+ * Adds a stream to @streamer, that moves the data of the trace_pipe file
+ * of @instance to @fd. The data is moved with splice() if @fd supports it,
+ * or copied otherwise. If @fd is non blocking and can be polled, like
+ * a pipe or a socket, the stream pushes back when it is full: its
+ * trace_pipe is not read until @fd can be written to again, and the data
+ * stays in the ring buffer of @instance meanwhile.
+ *
+ * Returns the index of the new stream in @streamer, or -1 on error.
+ */
+int tracefs_streamer_add(struct tracefs_streamer *streamer,
+			 struct tracefs_instance *instance, int fd)
+{
+	struct pipe_stream *streams;
+	struct pipe_stream *stream;
+	struct epoll_event *events;
+	int i;
+
+	if (!streamer || fd < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	i = streamer->nr_streams;
+	streams = realloc(streamer->streams, (i + 1) * sizeof(*streams));
+	if (!streams)
+		return -1;
+	streamer->streams = streams;
+
+	/* One event for each file of each stream, and one to wake up */
+	events = realloc(streamer->events, (2 * (i + 1) + 1) * sizeof(*events));
+	if (!events)
+		return -1;
+	streamer->events = events;
+
+	stream = &streams[i];
+	memset(stream, 0, sizeof(*stream));
+	stream->in_fd = -1;
+	stream->pipe_fds[0] = -1;
+	stream->pipe_fds[1] = -1;
+	stream->file_slot = -1;
+	stream->buf_slot = -1;
+
+	if (instance) {
+		if (trace_get_instance(instance) < 0)
+			return -1;
+		stream->instance = instance;
+	}
+
+	/*
+	 * Use a copy of @fd, as the same destination may be shared by many
+	 * streams, and epoll only takes a file descriptor once.
+	 */
+	stream->out_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (stream->out_fd < 0)
+		goto error;
+
+	/*
+	 * The io_uring requests are retried by the kernel when they would
+	 * block, but fail with EAGAIN on a non blocking trace_pipe.
+	 */
+	stream->in_fd = tracefs_instance_file_open(instance, "trace_pipe",
+						   O_RDONLY | O_CLOEXEC |
+						   (streamer->uring ? 0 : O_NONBLOCK));
+	if (stream->in_fd < 0)
+		goto error;
+
+	if (pipe2(stream->pipe_fds, O_CLOEXEC) < 0)
+		goto error;
+	stream->pipe_size = fcntl(stream->pipe_fds[0], F_GETPIPE_SZ);
+	if (stream->pipe_size <= 0)
+		goto error;
+
+	/*
+	 * Adaptive streams start small, and grow under load. A later
+	 * tracefs_streamer_set_sizes() only applies to the streams added
+	 * after it.
+	 */
+	stream->buf_size = BUFSIZ;
+	if (streamer->flags & TRACEFS_STREAM_ADAPTIVE) {
+		stream->adaptive = true;
+		stream->max_pipe_size = streamer->pipe_size ? : pipe_max_size();
+		stream->max_buf_size = streamer->buf_size ? : STREAM_BUF_MAX;
+	} else {
+		if (streamer->pipe_size)
+			resize_pipe(stream, streamer->pipe_size);
+		if (streamer->buf_size)
+			stream->buf_size = streamer->buf_size;
+	}
+
+	if (!trace_splice_safe(stream->out_fd, stream->pipe_fds[0])) {
+		stream->no_splice = true;
+		stream->buf = malloc(stream->buf_size);
+		if (!stream->buf)
+			goto error;
+	}
+
+	if (streamer->uring) {
+		uring_register_stream(streamer, i);
+		goto out;
+	}
+
+	if (stream_watch(streamer, i, EPOLL_CTL_ADD, false, EPOLLIN) < 0)
+		goto error;
+
+	/* Regular files can not be polled, and are always writable */
+	if (!stream_watch(streamer, i, EPOLL_CTL_ADD, true, 0))
+		stream->pollable = true;
+
+ out:
+	streamer->nr_streams++;
+	streamer->nr_active++;
+
+	if (streamer->uring)
+		uring_queue(streamer, i, REQ_IN);
+
+	return i;
+ error:
+	epoll_ctl(streamer->epoll_fd, EPOLL_CTL_DEL, stream->in_fd, NULL);
+	close_stream(stream);
+	return -1;
+}
+
+/**
+ * tracefs_streamer_set_sizes - set the sizes of the buffers of the streams
+ * @streamer: The streamer returned by tracefs_streamer_alloc()
+ * @pipe_size: The size of the pipe of the streams, 0 for the default
+ * @buf_size: The size of the bounce buffer of the streams, 0 for the default
+ * @flags: TRACEFS_STREAM_* flags
+ *
+ * Sets the size of the pipe that the streams added afterwards splice
+ * through, and of the buffer they copy through when their destination does
+ * not support splice. Larger ones move more data per system call. The pipe
+ * size is at most /proc/sys/fs/pipe-max-size, and may be limited further by
+ * the pipe buffers allowed to the user.
+ *
+ * If @flags has TRACEFS_STREAM_ADAPTIVE, the streams start with the default
+ * sizes instead, and each one doubles its pipe or buffer when it keeps
+ * filling it, up to @pipe_size and @buf_size. If they are 0, the limits are
+ * /proc/sys/fs/pipe-max-size and 1 megabyte.
+ *
+ * The streams that are already added keep the sizes and flags they were
+ * added with.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+int tracefs_streamer_set_sizes(struct tracefs_streamer *streamer, int pipe_size,
+			       int buf_size, unsigned int flags)
+{
+	if (!streamer || pipe_size < 0 || buf_size < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	streamer->pipe_size = pipe_size;
+	streamer->buf_size = buf_size;
+	streamer->flags = flags;
+
+	return 0;
+}
+
+/**
+ * tracefs_streamer_use_uring - move the streams with io_uring
+ * @streamer: The streamer returned by tracefs_streamer_alloc()
+ *
+ * Makes the streams of @streamer move their data with io_uring requests
+ * instead of system calls, which are queued for all the streams at once
+ * and submitted together with the wait for their completions. The files
+ * and the bounce buffers of the streams are registered to the io_uring.
+ * It must be called before any stream is added.
+ *
+ * The reads and splices of a trace_pipe block, so the kernel runs them in
+ * its io-wq worker threads, one for each stream waiting for data. This
+ * pays off only with many busy streams; it is not used by
+ * tracefs_trace_pipe_stream() nor by the recorder.
+ *
+ * If the kernel has no io_uring, or one without what the streamer needs,
+ * or if the library was built without it, -1 is returned and @streamer
+ * keeps working with epoll and system calls.
+ *
+ * Returns 0 if the streams use io_uring, or -1 otherwise.
+ */
+int tracefs_streamer_use_uring(struct tracefs_streamer *streamer)
+{
+	struct epoll_event ee = { };
+
+	if (!streamer) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (streamer->uring)
+		return 0;
+
+	if (streamer->nr_streams) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	streamer->uring = trace_uring_alloc(URING_ENTRIES, URING_FILES, URING_BUFFERS);
+	if (!streamer->uring)
+		return -1;
+
+	/* The wake up is now a read of the eventfd, that must wait */
+	if (fcntl(streamer->wake_fd, F_SETFL, 0) < 0)
+		goto error;
+
+	/* Let the streamer fd tell when the io_uring has completions */
+	ee.events = EPOLLIN;
+	ee.data.u64 = STREAM_URING;
+	if (epoll_ctl(streamer->epoll_fd, EPOLL_CTL_ADD,
+		      trace_uring_fd(streamer->uring), &ee) < 0)
+		goto error;
+
+	if (uring_queue_wake(streamer) < 0 ||
+	    trace_uring_submit(streamer->uring, 0) < 0)
+		goto error;
+
+	return 0;
+ error:
+	fcntl(streamer->wake_fd, F_SETFL, O_NONBLOCK);
+	trace_uring_free(streamer->uring);
+	streamer->uring = NULL;
+	streamer->nr_inflight = 0;
+	return -1;
+}
+
+/**
+ * tracefs_streamer_fd - get a file descriptor to wait on for data
+ * @streamer: The streamer returned by tracefs_streamer_alloc()
+ *
+ * Returns a file descriptor that becomes readable when any of the streams
+ * of @streamer have data to move, for poll(), select() or epoll.
+ * It belongs to @streamer and must not be closed.
+ */
+int tracefs_streamer_fd(struct tracefs_streamer *streamer)
+{
+	if (!streamer) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return streamer->epoll_fd;
+}
+
+/**
+ * tracefs_streamer_read - wait for data and move it
+ * @streamer: The streamer returned by tracefs_streamer_alloc()
+ * @timeout: Milliseconds to wait for data, 0 to not wait, -1 to wait forever
+ *
+ * Waits until one of the streams of @streamer has data, or its destination
+ * can take the data it holds back, or until @timeout expires, and moves the
+ * data of those streams to their destinations. Each stream moves at most
+ * the size of its pipe at a time, so that all of them get their turn.
+ *
+ * A stream that fails, for instance because its destination was closed,
+ * is stopped and the other streams keep going. Its error is reported by
+ * tracefs_streamer_stat().
+ *
+ * Returns the number of bytes written to the destinations, 0 if @timeout
+ * expired, a signal interrupted the wait or tracefs_streamer_stop() was
+ * called, or -1 on error.
+ */
+ssize_t tracefs_streamer_read(struct tracefs_streamer *streamer, int timeout)
+{
+	struct epoll_event *event;
+	ssize_t total = 0;
+	uint64_t val;
+	int nr;
+	int i;
+
+	if (!streamer) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (streamer->uring)
+		return uring_read(streamer, timeout, true);
+
+	nr = epoll_wait(streamer->epoll_fd, streamer->events,
+			2 * streamer->nr_streams + 1, timeout);
+	if (nr < 0)
+		return errno == EINTR ? 0 : -1;
+
+	for (event = streamer->events; event < streamer->events + nr; event++) {
+		if (event->data.u64 == STREAM_WAKE) {
+			if (read(streamer->wake_fd, &val, sizeof(val)) < 0 &&
+			    errno != EAGAIN)
+				return -1;
+			continue;
+		}
+
+		i = event->data.u64 >> 1;
+		if (streamer->streams[i].done)
+			continue;
+
+		if (!(event->data.u64 & STREAM_OUT))
+			total += fill_stream(streamer, i);
+		else if (event->events & EPOLLOUT)
+			total += drain_stream(streamer, i);
+		else if (event->events & (EPOLLERR | EPOLLHUP))
+			stream_done(streamer, i, EPIPE);
+	}
+
+	return total;
+}
+
+/**
+ * tracefs_streamer_run - move the data of the streams until stopped
+ * @streamer: The streamer returned by tracefs_streamer_alloc()
+ *
+ * Calls tracefs_streamer_read() until tracefs_streamer_stop() is called,
+ * or until all the streams of @streamer have stopped, either because they
+ * failed, or because reading their trace_pipe returned end of file, which
+ * happens when tracing is turned off.
+ *
+ * Returns the number of bytes written to the destinations, or -1 on error.
+ */
+ssize_t tracefs_streamer_run(struct tracefs_streamer *streamer)
+{
+	ssize_t total = 0;
+	ssize_t ret;
+
+	if (!streamer) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (*(volatile bool *)&streamer->keep_going && streamer->nr_active) {
+		/* The requests queued are submitted with the next wait */
+		if (streamer->uring)
+			ret = uring_read(streamer, -1, false);
+		else
+			ret = tracefs_streamer_read(streamer, -1);
+		if (ret < 0) {
+			total = -1;
+			break;
+		}
+		total += ret;
+	}
+
+	/* Do not leave queued requests behind */
+	if (streamer->uring && trace_uring_submit(streamer->uring, 0) < 0)
+		total = -1;
+
+	/* Let the next call run again */
+	(*(volatile bool *)&streamer->keep_going) = true;
+
+	return total;
+}
+
+/**
+ * tracefs_streamer_stop - stop tracefs_streamer_run()
+ * @streamer: The streamer returned by tracefs_streamer_alloc()
+ *
+ * Makes tracefs_streamer_run() return, and wakes up a tracefs_streamer_read()
+ * that waits for data. If tracefs_streamer_run() is not running, the next
+ * call to it returns right away. It can be called from another thread,
+ * or from a signal handler.
+ */
+void tracefs_streamer_stop(struct tracefs_streamer *streamer)
+{
+	uint64_t val = 1;
+
+	if (!streamer)
+		return;
+
+	(*(volatile bool *)&streamer->keep_going) = false;
+	if (write(streamer->wake_fd, &val, sizeof(val)) < 0)
+		return;
+}
+
+/**
+ * tracefs_streamer_stat - get the statistics of a stream
+ * @streamer: The streamer returned by tracefs_streamer_alloc()
+ * @stream: The index of the stream, returned by tracefs_streamer_add()
+ * @stat: Where to store the statistics of the stream
+ *
+ * Fills @stat with the number of bytes the stream at @stream wrote to its
+ * destination, the number of times the destination pushed back, and the
+ * bytes held back because of it. If the stream stopped, @stat->error
+ * holds the error that stopped it, or 0 if its trace_pipe ended.
+ * @stat->pipe_size or @stat->buf_size is the current size of the pipe or
+ * the bounce buffer that the stream moves its data through.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+int tracefs_streamer_stat(struct tracefs_streamer *streamer, int stream,
+			  struct tracefs_streamer_stat *stat)
+{
+	struct pipe_stream *s;
+
+	if (!streamer || !stat || stream < 0 || stream >= streamer->nr_streams) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	s = &streamer->streams[stream];
+	stat->bytes = s->bytes;
+	stat->stalls = s->stalls;
+	stat->pending = s->pending;
+	stat->blocked = s->blocked;
+	stat->stopped = s->done;
+	stat->pipe_size = s->no_splice ? 0 : s->pipe_size;
+	stat->buf_size = s->no_splice ? s->buf_size : 0;
+	stat->error = s->error;
+
+	return 0;
+}
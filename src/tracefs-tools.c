@@ -8,6 +8,10 @@
  */
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <fnmatch.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
@@ -115,16 +119,13 @@ static int trace_on_off(int fd, bool on)
 
 static int trace_on_off_file(struct tracefs_instance *instance, bool on)
 {
-	int ret;
-	int fd;
+	const char *val = on ? "1" : "0";
 
-	fd = tracefs_instance_file_open(instance, TRACE_CTRL, O_WRONLY);
-	if (fd < 0)
-		return -1;
-	ret = trace_on_off(fd, on);
-	close(fd);
+	/* Goes through the cached file descriptor of tracing_on */
+	if (tracefs_instance_file_write(instance, TRACE_CTRL, val) == 1)
+		return 0;
 
-	return ret;
+	return -1;
 }
 
 /**
@@ -235,45 +236,101 @@ enum tracefs_option_id tracefs_option_id(const char *name)
 	return TRACEFS_OPTION_INVALID;
 }
 
+/*
+ * The trace_options file lists all the core options and the options of the
+ * current tracer, one per line, with a "no" prefix for the ones that are
+ * disabled. Read it once to get the state of all of them, and set their
+ * bits in @found. Returns -1 if the file can't be read.
+ */
+static int read_trace_options(struct tracefs_instance *instance,
+			      unsigned long long *found,
+			      unsigned long long *enabled)
+{
+	enum tracefs_option_id id;
+	char *line, *saveptr;
+	bool set;
+	char *buf;
+
+	buf = tracefs_instance_file_read(instance, "trace_options", NULL);
+	if (!buf)
+		return -1;
+
+	for (line = strtok_r(buf, "\n", &saveptr); line;
+	     line = strtok_r(NULL, "\n", &saveptr)) {
+		set = true;
+		id = tracefs_option_id(line);
+		if (id == TRACEFS_OPTION_INVALID && strncmp(line, "no", 2) == 0) {
+			id = tracefs_option_id(line + 2);
+			set = false;
+		}
+		if (id == TRACEFS_OPTION_INVALID)
+			continue;
+
+		*found |= 1ULL << (id - 1);
+		if (set)
+			*enabled |= 1ULL << (id - 1);
+	}
+
+	free(buf);
+	return 0;
+}
+
 const static struct tracefs_options_mask *
 trace_get_options(struct tracefs_instance *instance, bool enabled)
 {
 	pthread_mutex_t *lock = trace_get_lock(instance);
 	struct tracefs_options_mask *bitmask;
+	unsigned long long found = 0;
+	unsigned long long on = 0;
+	unsigned long long mask = 0;
 	enum tracefs_option_id id;
 	unsigned long long set;
 	char file[PATH_MAX];
-	struct stat st;
+	struct dirent *dent;
 	long long val;
 	char *path;
+	DIR *dir;
 	int ret;
 
 	bitmask = enabled ? enabled_opts_mask(instance) :
 			   supported_opts_mask(instance);
 
-	for (id = 1; id < TRACEFS_OPTION_MAX; id++) {
-		snprintf(file, PATH_MAX, "options/%s", options_map[id]);
-		path = tracefs_instance_get_file(instance, file);
-		if (!path)
-			return NULL;
+	read_trace_options(instance, &found, &on);
+	mask = enabled ? on : found;
+
+	/*
+	 * The options of the tracers that are not the current one are not
+	 * in trace_options, but still have their file under options. List
+	 * that directory once, instead of looking up every known option.
+	 */
+	path = tracefs_instance_get_file(instance, "options");
+	if (!path)
+		return NULL;
+	dir = trace_opendir_at(AT_FDCWD, path);
+	tracefs_put_tracing_file(path);
+
+	while (dir && (dent = readdir(dir))) {
+		id = tracefs_option_id(dent->d_name);
+		if (id == TRACEFS_OPTION_INVALID || (found & (1ULL << (id - 1))))
+			continue;
+		if (trace_dirent_is_dir(dir, dent))
+			continue;
 
 		set = 1;
-		ret = stat(path, &st);
-		if (ret < 0 || !S_ISREG(st.st_mode)) {
-			set = 0;
-		} else if (enabled) {
+		if (enabled) {
+			snprintf(file, PATH_MAX, "options/%s", dent->d_name);
 			ret = tracefs_instance_file_read_number(instance, file, &val);
 			if (ret != 0 || val != 1)
 				set = 0;
 		}
-
-		pthread_mutex_lock(lock);
-		bitmask->mask = (bitmask->mask & ~(1ULL << (id - 1))) | (set << (id - 1));
-		pthread_mutex_unlock(lock);
-
-		tracefs_put_tracing_file(path);
+		mask |= set << (id - 1);
 	}
+	if (dir)
+		closedir(dir);
 
+	pthread_mutex_lock(lock);
+	bitmask->mask = mask;
+	pthread_mutex_unlock(lock);
 
 	return bitmask;
 }
@@ -526,6 +583,84 @@ static int write_filter(int fd, const char *filter, const char *module)
 	return 0;
 }
 
+/*
+ * The words written to set_ftrace_filter are collected in a buffer, and
+ * written with as few write() calls as the file takes. The kernel parses
+ * the file one word per write(), and returns how much of the buffer that
+ * word used, so the rest of it is written again until it is all taken.
+ */
+#define FILTER_BUF_SIZE		(64 * 1024)
+
+struct filter_buf {
+	int			fd;
+	char			*buf;
+	size_t			len;
+	/* Set once the file took some of the data */
+	bool			started;
+};
+
+static int filter_buf_init(struct filter_buf *fb, int fd)
+{
+	memset(fb, 0, sizeof(*fb));
+	fb->fd = fd;
+	fb->buf = malloc(FILTER_BUF_SIZE);
+
+	return fb->buf ? 0 : -1;
+}
+
+/*
+ * Returns 0 on success, 1 if the file did not take anything yet, and
+ * -1 on error after some of it was written.
+ */
+static int filter_buf_flush(struct filter_buf *fb)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while (done < fb->len) {
+		r = write(fb->fd, fb->buf + done, fb->len - done);
+		if (r <= 0)
+			return fb->started ? -1 : 1;
+		fb->started = true;
+		done += r;
+	}
+	fb->len = 0;
+
+	return 0;
+}
+
+/* Add @word (for @module if set) followed by a space. Returns as flush */
+static int filter_buf_add(struct filter_buf *fb, const char *word,
+			  const char *module)
+{
+	size_t len;
+	int ret;
+
+	len = strlen(word) + 1;
+	if (module)
+		len += strlen(":mod:") + strlen(module);
+
+	/* The kernel does not take words anywhere near this size anyway */
+	if (len >= FILTER_BUF_SIZE) {
+		errno = EINVAL;
+		return fb->started ? -1 : 1;
+	}
+
+	if (fb->len + len >= FILTER_BUF_SIZE) {
+		ret = filter_buf_flush(fb);
+		if (ret)
+			return ret;
+	}
+
+	if (module)
+		sprintf(fb->buf + fb->len, "%s:mod:%s ", word, module);
+	else
+		sprintf(fb->buf + fb->len, "%s ", word);
+	fb->len += len;
+
+	return 0;
+}
+
 static int add_func(struct func_list ***next_func_ptr, unsigned int index)
 {
 	struct func_list **next_func = *next_func_ptr;
@@ -587,92 +722,385 @@ enum match_type {
 	SAVE_STRING	= (1 << 2),
 };
 
+/* The module offset of the functions of the core kernel */
+#define NO_MODULE		UINT32_MAX
+
+struct filter_func {
+	uint32_t		name;
+	uint32_t		mod;
+};
+
+/*
+ * The content of available_filter_functions, kept by the process so that
+ * it is not read again for every filter. The functions are in the order
+ * of the file, as their position is the index that the kernel takes, with
+ * the offsets of their names and modules in a string pool. @sorted has
+ * their positions, ordered by name (ignoring case, like the filters) to
+ * find the names that start with a given string.
+ *
+ * The functions change when modules are loaded or removed, which is
+ * checked with a hash of the names in /proc/modules.
+ */
+struct filter_funcs {
+	pthread_mutex_t		lock;
+	char			*path;
+	unsigned long long	modules_hash;
+	struct filter_func	*funcs;
+	uint32_t		*sorted;
+	char			*pool;
+	int			nr_funcs;
+};
+
+static struct filter_funcs filter_funcs = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void free_filter_funcs(struct filter_funcs *ff)
+{
+	free(ff->path);
+	free(ff->funcs);
+	free(ff->sorted);
+	free(ff->pool);
+	ff->path = NULL;
+	ff->funcs = NULL;
+	ff->sorted = NULL;
+	ff->pool = NULL;
+	ff->nr_funcs = 0;
+}
+
+/* Only used by qsort() under filter_funcs.lock */
+static const struct filter_funcs *sort_ff;
+
+static int cmp_filter_funcs(const void *a, const void *b)
+{
+	const char *na = sort_ff->pool + sort_ff->funcs[*(const uint32_t *)a].name;
+	const char *nb = sort_ff->pool + sort_ff->funcs[*(const uint32_t *)b].name;
+	int ret;
+
+	ret = strcasecmp(na, nb);
+	if (ret)
+		return ret;
+	/* Keep the functions with the same name in the order of the file */
+	return *(const uint32_t *)a < *(const uint32_t *)b ? -1 : 1;
+}
+
+/* Parse the available_filter_functions file at @path into @ff */
+static int parse_filter_funcs(struct filter_funcs *ff, const char *path)
+{
+	struct filter_func *tmp;
+	char *last_mod = NULL;
+	uint32_t mod_offset = NO_MODULE;
+	size_t pool_size = 0;
+	char *line, *next;
+	char *name, *mod;
+	int alloc = 0;
+	char *buf;
+	int len;
+	int i;
+
+	len = str_read_file(path, &buf, false);
+	if (len <= 0)
+		return -1;
+
+	/*
+	 * Like for kallsyms, the names are moved to the front of the buffer
+	 * that they are read into, which becomes the string pool.
+	 */
+	for (line = buf; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+
+		name = line + strspn(line, " ");
+		if (!*name)
+			continue;
+		mod = name + strcspn(name, " \t");
+		if (*mod) {
+			*mod++ = '\0';
+			mod += strspn(mod, " \t");
+			if (*mod == '[') {
+				mod++;
+				mod[strcspn(mod, "]")] = '\0';
+			} else {
+				mod = NULL;
+			}
+		} else {
+			mod = NULL;
+		}
+
+		if (ff->nr_funcs == alloc) {
+			alloc = alloc ? alloc * 2 : 4096;
+			tmp = realloc(ff->funcs, alloc * sizeof(*tmp));
+			if (!tmp)
+				goto fail;
+			ff->funcs = tmp;
+		}
+
+		ff->funcs[ff->nr_funcs].name = pool_size;
+		len = strlen(name) + 1;
+		memmove(buf + pool_size, name, len);
+		pool_size += len;
+
+		/* The functions of a module are listed together */
+		if (mod && (!last_mod || strcmp(mod, last_mod) != 0)) {
+			mod_offset = pool_size;
+			len = strlen(mod) + 1;
+			memmove(buf + pool_size, mod, len);
+			last_mod = buf + pool_size;
+			pool_size += len;
+		}
+		ff->funcs[ff->nr_funcs].mod = mod ? mod_offset : NO_MODULE;
+		ff->nr_funcs++;
+	}
+
+	if (!ff->nr_funcs)
+		goto fail;
+
+	ff->sorted = malloc(ff->nr_funcs * sizeof(*ff->sorted));
+	if (!ff->sorted)
+		goto fail;
+	for (i = 0; i < ff->nr_funcs; i++)
+		ff->sorted[i] = i;
+
+	ff->pool = realloc(buf, pool_size) ? : buf;
+
+	sort_ff = ff;
+	qsort(ff->sorted, ff->nr_funcs, sizeof(*ff->sorted), cmp_filter_funcs);
+	sort_ff = NULL;
+
+	return 0;
+ fail:
+	free(buf);
+	free_filter_funcs(ff);
+	return -1;
+}
+
+/*
+ * Make sure @ff has the functions of the current tracing directory and
+ * of the loaded modules. Must be called with ff->lock held.
+ */
+static int load_filter_funcs(struct filter_funcs *ff)
+{
+	unsigned long long modules_hash;
+	char *path;
+
+	path = tracefs_get_tracing_file(TRACE_FILTER_LIST);
+	if (!path)
+		return -1;
+
+	modules_hash = trace_hash_file("/proc/modules", true);
+
+	if (ff->path && strcmp(ff->path, path) == 0 &&
+	    ff->modules_hash == modules_hash) {
+		tracefs_put_tracing_file(path);
+		return 0;
+	}
+
+	free_filter_funcs(ff);
+	if (parse_filter_funcs(ff, path) < 0) {
+		tracefs_put_tracing_file(path);
+		return -1;
+	}
+	ff->path = path;
+	ff->modules_hash = modules_hash;
+
+	return 0;
+}
+
+static bool filter_func_in_module(struct filter_funcs *ff, int i,
+				  const char *module)
+{
+	if (!module)
+		return true;
+	return ff->funcs[i].mod != NO_MODULE &&
+		strcmp(ff->pool + ff->funcs[i].mod, module) == 0;
+}
+
+/* Returns the first entry of @ff->sorted whose name compares to @str >= 0 */
+static int find_sorted(struct filter_funcs *ff, const char *str, int len,
+		       bool after)
+{
+	int lo = 0, hi = ff->nr_funcs;
+	int mid;
+	int r;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		r = strncasecmp(ff->pool + ff->funcs[ff->sorted[mid]].name, str, len);
+		if (r < 0 || (after && r == 0))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int cmp_uint32(const void *a, const void *b)
+{
+	uint32_t ua = *(const uint32_t *)a;
+	uint32_t ub = *(const uint32_t *)b;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+/*
+ * Returns the length of the name that @glob starts with, if it can be
+ * looked up by that name, or 0 if it must be matched on every name.
+ *
+ * A "?" in a glob ends up as a regex quantifier (see make_regex()),
+ * so only globs made of a name and "*"s are looked up by the name
+ * they start with.
+ */
+static int glob_prefix(const char *glob, bool regex)
+{
+	int plen;
+
+	if (regex)
+		return 0;
+
+	plen = strcspn(glob, "*?");
+	if (glob[plen] == '?' || strchr(glob + plen, '?'))
+		return 0;
+
+	return plen;
+}
+
+/* Match @name, that starts with the @plen characters of @glob */
+static bool glob_match(const char *name, const char *glob, int plen)
+{
+	/* "name" only matches itself, and "name*" all the names found */
+	if (!glob[plen])
+		return !name[plen];
+	if (glob[plen] == '*' && !glob[plen + 1])
+		return true;
+
+	return fnmatch(glob, name, FNM_CASEFOLD) == 0;
+}
+
+/*
+ * Find the functions in @ff that match @func_filter and @module. Their
+ * positions are returned in @matches, in the order of the file.
+ * Returns the number of matches, or -1 on error.
+ */
+static int find_filter_funcs(struct filter_funcs *ff,
+			     struct func_filter *func_filter,
+			     const char *module, uint32_t **matches)
+{
+	const char *glob = func_filter->filter;
+	uint32_t *m;
+	const char *name;
+	int first, last;
+	int plen;
+	int nr = 0;
+	int i;
+
+	m = malloc(ff->nr_funcs * sizeof(*m));
+	if (!m)
+		return -1;
+
+	plen = glob_prefix(glob, func_filter->is_regex);
+	if (!plen) {
+		for (i = 0; i < ff->nr_funcs; i++) {
+			if (filter_func_in_module(ff, i, module) &&
+			    match(ff->pool + ff->funcs[i].name, func_filter))
+				m[nr++] = i;
+		}
+		goto out;
+	}
+
+	first = find_sorted(ff, glob, plen, false);
+	last = find_sorted(ff, glob, plen, true);
+
+	for (i = first; i < last; i++) {
+		name = ff->pool + ff->funcs[ff->sorted[i]].name;
+		if (glob_match(name, glob, plen) &&
+		    filter_func_in_module(ff, ff->sorted[i], module))
+			m[nr++] = ff->sorted[i];
+	}
+	qsort(m, nr, sizeof(*m), cmp_uint32);
+ out:
+	*matches = m;
+	return nr;
+}
+
+/* Returns true if @module has functions in @ff */
+static bool filter_funcs_module(struct filter_funcs *ff, const char *module)
+{
+	int i;
+
+	for (i = 0; i < ff->nr_funcs; i++) {
+		if (filter_func_in_module(ff, i, module))
+			return true;
+	}
+	return false;
+}
+
 static int match_filters(int fd, struct func_filter *func_filter,
 			 const char *module, struct func_list **func_list,
 			 int flags)
 {
 	enum match_type type = flags & (FILTER_CHECK | FILTER_WRITE);
+	struct filter_funcs *ff = &filter_funcs;
 	bool save_str = flags & SAVE_STRING;
 	bool future = flags & FILTER_FUTURE;
 	bool mod_match = false;
-	char *line = NULL;
-	size_t size = 0;
-	char *path;
-	FILE *fp;
-	int index = 0;
+	uint32_t *matches = NULL;
+	struct filter_buf fb = { };
+	const char *name;
 	int ret = 1;
-	int mlen;
+	int nr;
+	int i;
 
-	path = tracefs_get_tracing_file(TRACE_FILTER_LIST);
-	if (!path)
+	if (type == FILTER_WRITE && filter_buf_init(&fb, fd) < 0)
 		return 1;
 
-	fp = fopen(path, "r");
-	tracefs_put_tracing_file(path);
+	pthread_mutex_lock(&ff->lock);
 
-	if (!fp)
-		return 1;
+	if (load_filter_funcs(ff) < 0)
+		goto out;
+
+	nr = find_filter_funcs(ff, func_filter, module, &matches);
+	if (nr < 0)
+		goto out;
+
+	if (future && module)
+		mod_match = filter_funcs_module(ff, module);
+
+	for (i = 0; i < nr; i++) {
+		name = ff->pool + ff->funcs[matches[i]].name;
 
-	if (module)
-		mlen = strlen(module);
-
-	while (getline(&line, &size, fp) >= 0) {
-		char *saveptr = NULL;
-		char *tok, *mtok;
-		int len = strlen(line);
-
-		if (line[len - 1] == '\n')
-			line[len - 1] = '\0';
-		tok = strtok_r(line, " ", &saveptr);
-		if (!tok)
-			goto next;
-
-		index++;
-
-		if (module) {
-			mtok = strtok_r(NULL, " ", &saveptr);
-			if (!mtok)
-				goto next;
-			if ((strncmp(mtok + 1, module, mlen) != 0) ||
-			    (mtok[mlen + 1] != ']'))
-				goto next;
-			if (future)
-				mod_match = true;
-		}
 		switch (type) {
 		case FILTER_CHECK:
-			if (match(tok, func_filter)) {
-				func_filter->set = true;
-				if (save_str)
-					ret = add_func_str(&func_list, tok);
-				else
-					ret = add_func(&func_list, index);
-				if (ret)
-					goto out;
-			}
+			func_filter->set = true;
+			if (save_str)
+				ret = add_func_str(&func_list, name);
+			else
+				/* The kernel counts the functions from 1 */
+				ret = add_func(&func_list, matches[i] + 1);
+			if (ret)
+				goto out;
 			break;
 		case FILTER_WRITE:
 			/* Writes only have one filter */
-			if (match(tok, func_filter)) {
-				ret = write_filter(fd, tok, module);
-				if (ret)
-					goto out;
+			ret = filter_buf_add(&fb, name, module);
+			if (ret) {
+				ret = -1;
+				goto out;
 			}
 			break;
 		default:
 			/* Should never happen */
 			ret = -1;
 			goto out;
-
 		}
-	next:
-		free(line);
-		line = NULL;
-		len = 0;
 	}
+
+	if (type == FILTER_WRITE && nr && filter_buf_flush(&fb))
+		ret = -1;
  out:
-	free(line);
-	fclose(fp);
+	pthread_mutex_unlock(&ff->lock);
+	free(matches);
+	free(fb.buf);
 
 	/* If there was no matches and future was set, this is a success */
 	if (future && !mod_match)
@@ -721,70 +1149,65 @@ static int controlled_write(int fd, struct func_filter *func_filter,
 	return ret;
 }
 
+/* Returns the regular expression that @filter matches with */
+static char *filter_regex(const char *filter, bool *regex)
+{
+	if (!(*regex = is_regex(filter)))
+		return make_regex(filter);
+	return update_regex(filter);
+}
+
 static int init_func_filter(struct func_filter *func_filter, const char *filter)
 {
 	char *str;
 	int ret;
 
-	if (!(func_filter->is_regex = is_regex(filter)))
-		str = make_regex(filter);
-	else
-		str = update_regex(filter);
-
+	str = filter_regex(filter, &func_filter->is_regex);
 	if (!str)
 		return -1;
 
 	ret = regcomp(&func_filter->re, str, REG_ICASE|REG_NOSUB);
 	free(str);
 
-	if (ret < 0)
+	/* regcomp() returns a positive error code */
+	if (ret)
 		return -1;
 
 	func_filter->filter = filter;
 	return 0;
 }
 
-static int write_number(int fd, unsigned int start, unsigned int end)
-{
-	char buf[64];
-	unsigned int i;
-	int n, ret;
-
-	for (i = start; i <= end; i++) {
-		n = snprintf(buf, 64, "%d ", i);
-		ret = write(fd, buf, n);
-		if (ret < 0)
-			return ret;
-	}
-
-	return 0;
-}
-
 /*
- * This will try to write the first number, if that fails, it
- * will assume that it is not supported and return 1.
- * If the first write succeeds, but a following write fails, then
- * the kernel does support this, but something else went wrong,
- * in this case, return -1.
+ * This will try to write the indexes of the functions. If the file does
+ * not take the first write, it will assume that indexes are not supported
+ * and return 1. If the first write succeeds, but a following write fails,
+ * then the kernel does support this, but something else went wrong, in
+ * this case, return -1.
  */
 static int write_func_list(int fd, struct func_list *list)
 {
-	int ret;
+	struct filter_buf fb;
+	unsigned int i;
+	char num[16];
+	int ret = 0;
 
 	if (!list)
 		return 0;
 
-	ret = write_number(fd, list->start, list->end);
-	if (ret)
+	if (filter_buf_init(&fb, fd) < 0)
 		return 1; // try a different way
-	list = list->next;
-	while (list) {
-		ret = write_number(fd, list->start, list->end);
-		if (ret)
-			return -1;
-		list = list->next;
+
+	for (; list && !ret; list = list->next) {
+		for (i = list->start; i <= list->end && !ret; i++) {
+			snprintf(num, sizeof(num), "%u", i);
+			ret = filter_buf_add(&fb, num, NULL);
+		}
 	}
-	return 0;
+	if (!ret)
+		ret = filter_buf_flush(&fb);
+
+	free(fb.buf);
+	return ret;
 }
 
 static int update_filter(const char *filter_path, int *fd,
@@ -976,6 +1399,420 @@ int tracefs_function_notrace(struct tracefs_instance *instance, const char *filt
 	return ret;
 }
 
+/* The files that tracefs_function_filter_patterns() writes to */
+enum {
+	PATTERN_FILTER,
+	PATTERN_NOTRACE,
+	NR_PATTERN_FILES,
+};
+
+#define pattern_file(p)	((p)->notrace ? PATTERN_NOTRACE : PATTERN_FILTER)
+
+/*
+ * The patterns that can not be looked up by name, for the same module
+ * and file, are joined into one regex: "\(re1\)\|\(re2\)...".
+ */
+struct pattern_group {
+	const char		*module;
+	int			file;
+	char			*str;
+	regex_t			re;
+	bool			compiled;
+};
+
+static bool same_module(const char *a, const char *b)
+{
+	if (!a || !b)
+		return a == b;
+	return strcmp(a, b) == 0;
+}
+
+/* Back references would not count the groups of the other patterns */
+static bool has_backref(const char *regex)
+{
+	for (; *regex; regex++) {
+		if (*regex == '\\' && regex[1]) {
+			regex++;
+			if (*regex >= '1' && *regex <= '9')
+				return true;
+		}
+	}
+	return false;
+}
+
+static int add_pattern_group(struct pattern_group **groups, int *nr_groups,
+			     const char *module, int file, const char *regex)
+{
+	struct pattern_group *group = NULL;
+	bool alone = has_backref(regex);
+	char *str;
+	int i;
+
+	for (i = 0; !alone && i < *nr_groups; i++) {
+		group = &(*groups)[i];
+		if (group->file == file && same_module(group->module, module) &&
+		    !has_backref(group->str))
+			break;
+	}
+
+	if (alone || i == *nr_groups) {
+		group = realloc(*groups, (*nr_groups + 1) * sizeof(*group));
+		if (!group)
+			return -1;
+		*groups = group;
+		group += (*nr_groups)++;
+		memset(group, 0, sizeof(*group));
+		group->module = module;
+		group->file = file;
+	}
+
+	if (asprintf(&str, "%s%s\\(%s\\)", group->str ? : "",
+		     group->str ? "\\|" : "", regex) < 0)
+		return -1;
+	free(group->str);
+	group->str = str;
+
+	return 0;
+}
+
+static void free_pattern_groups(struct pattern_group *groups, int nr_groups)
+{
+	int i;
+
+	for (i = 0; i < nr_groups; i++) {
+		if (groups[i].compiled)
+			regfree(&groups[i].re);
+		free(groups[i].str);
+	}
+	free(groups);
+}
+
+/* Mark the functions that the glob @filter, that starts with a name, matches */
+static void mark_glob_funcs(struct filter_funcs *ff, unsigned char *marks,
+			    int bit, const char *filter, int plen,
+			    const char *module)
+{
+	int first, last;
+	uint32_t f;
+	int i;
+
+	first = find_sorted(ff, filter, plen, false);
+	last = find_sorted(ff, filter, plen, true);
+
+	for (i = first; i < last; i++) {
+		f = ff->sorted[i];
+		if (glob_match(ff->pool + ff->funcs[f].name, filter, plen) &&
+		    filter_func_in_module(ff, f, module))
+			marks[f] |= bit;
+	}
+}
+
+/* Mark the functions that the groups match, in one pass on the functions */
+static void mark_group_funcs(struct filter_funcs *ff, unsigned char *marks,
+			     struct pattern_group *groups, int nr_groups)
+{
+	const char *name;
+	int bit;
+	int i, g;
+
+	for (i = 0; i < ff->nr_funcs; i++) {
+		name = ff->pool + ff->funcs[i].name;
+		for (g = 0; g < nr_groups; g++) {
+			bit = 1 << groups[g].file;
+			if (marks[i] & bit ||
+			    !filter_func_in_module(ff, i, groups[g].module))
+				continue;
+			if (regexec(&groups[g].re, name, 0, NULL, 0) == 0)
+				marks[i] |= bit;
+		}
+	}
+}
+
+/* Write the indexes of the functions marked with @bit. Returns as write_func_list() */
+static int write_marked_funcs(int fd, struct filter_funcs *ff,
+			      unsigned char *marks, int bit)
+{
+	struct filter_buf fb;
+	char num[16];
+	int ret = 0;
+	int i;
+
+	if (filter_buf_init(&fb, fd) < 0)
+		return 1;
+
+	for (i = 0; i < ff->nr_funcs && !ret; i++) {
+		if (!(marks[i] & bit))
+			continue;
+		/* The kernel counts the functions from 1 */
+		snprintf(num, sizeof(num), "%u", i + 1);
+		ret = filter_buf_add(&fb, num, NULL);
+	}
+	if (!ret)
+		ret = filter_buf_flush(&fb);
+
+	free(fb.buf);
+	return ret;
+}
+
+/* Write the patterns of @file that are given to the kernel as they are */
+static int write_direct_patterns(int fd, const struct tracefs_function_pattern *patterns,
+				 int nr_patterns, bool *direct, int file)
+{
+	struct filter_buf fb;
+	int ret = 0;
+	int i;
+
+	if (filter_buf_init(&fb, fd) < 0)
+		return -1;
+
+	for (i = 0; i < nr_patterns && !ret; i++) {
+		if (!direct[i] || pattern_file(&patterns[i]) != file)
+			continue;
+		ret = filter_buf_add(&fb, patterns[i].filter ? : "*",
+				     patterns[i].module);
+	}
+	if (!ret)
+		ret = filter_buf_flush(&fb);
+
+	free(fb.buf);
+	return ret;
+}
+
+/* Write the patterns of @file one by one, for kernels that do not take indexes */
+static int write_patterns(int fd, const struct tracefs_function_pattern *patterns,
+			  int nr_patterns, bool *direct, int file)
+{
+	struct func_filter func_filter;
+	int ret;
+	int i;
+
+	for (i = 0; i < nr_patterns; i++) {
+		if (direct[i] || pattern_file(&patterns[i]) != file)
+			continue;
+		if (init_func_filter(&func_filter, patterns[i].filter ? : "*") < 0)
+			return -1;
+		ret = controlled_write(fd, &func_filter, patterns[i].module);
+		regfree(&func_filter.re);
+		/* Patterns that match nothing are ignored */
+		if (ret < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * tracefs_function_filter_patterns - set many function filters at once
+ * @instance: ftrace instance, can be NULL for top tracing instance.
+ * @patterns: The patterns of the functions to filter
+ * @nr_patterns: The number of @patterns
+ * @flags: flags on modifying the filter files
+ *
+ * Does what calling tracefs_function_filter() (or tracefs_function_notrace()
+ * for the patterns with notrace set) for each of @patterns would do, but
+ * matches all of them in one pass on the available functions, and writes
+ * the functions found to each file in one go.
+ *
+ * Each pattern has a filter, that is a function name, a glob or a regex
+ * like for tracefs_function_filter(), or NULL for all the functions of its
+ * module. If module is set, only the functions of that module are matched.
+ *
+ * The patterns that match no function are ignored. @flags are applied to
+ * both the filter and the notrace files, see tracefs_function_filter().
+ *
+ * Returns 0 on success, 1 if there was an error but the filtering has not
+ *  yet started (or if no pattern matched any function), -1 if there was an
+ *  error but the filtering has started.
+ */
+int tracefs_function_filter_patterns(struct tracefs_instance *instance,
+				     const struct tracefs_function_pattern *patterns,
+				     int nr_patterns, unsigned int flags)
+{
+	static const char * const files[] = { TRACE_FILTER, TRACE_NOTRACE };
+	pthread_mutex_t *lock = trace_get_lock(instance);
+	struct filter_funcs *ff = &filter_funcs;
+	bool reset = flags & TRACEFS_FL_RESET;
+	bool cont = flags & TRACEFS_FL_CONTINUE;
+	bool future = flags & TRACEFS_FL_FUTURE;
+	bool fallback[NR_PATTERN_FILES] = { };
+	bool found[NR_PATTERN_FILES] = { };
+	struct pattern_group *groups = NULL;
+	int *fds[NR_PATTERN_FILES];
+	unsigned char *marks = NULL;
+	bool *direct = NULL;
+	bool started = false;
+	const char *filter;
+	const char *module;
+	int nr_groups = 0;
+	char *path;
+	bool regex;
+	char *str;
+	int ret = 1;
+	int plen;
+	int i, f;
+
+	if (!patterns || nr_patterns <= 0) {
+		errno = EINVAL;
+		return 1;
+	}
+
+	if (instance) {
+		fds[PATTERN_FILTER] = &instance->ftrace_filter_fd;
+		fds[PATTERN_NOTRACE] = &instance->ftrace_notrace_fd;
+	} else {
+		fds[PATTERN_FILTER] = &ftrace_filter_fd;
+		fds[PATTERN_NOTRACE] = &ftrace_notrace_fd;
+	}
+
+	direct = calloc(nr_patterns, sizeof(*direct));
+	if (!direct)
+		return 1;
+
+	pthread_mutex_lock(lock);
+
+	/* RESET is only allowed if the files are not opened yet */
+	for (i = 0; reset && i < nr_patterns; i++) {
+		if (*fds[pattern_file(&patterns[i])] >= 0) {
+			errno = EBUSY;
+			ret = -1;
+			goto out;
+		}
+	}
+
+	pthread_mutex_lock(&ff->lock);
+
+	if (load_filter_funcs(ff) < 0)
+		goto out_unlock;
+
+	marks = calloc(ff->nr_funcs, sizeof(*marks));
+	if (!marks)
+		goto out_unlock;
+
+	errno = EINVAL;
+
+	for (i = 0; i < nr_patterns; i++) {
+		filter = patterns[i].filter;
+		module = patterns[i].module;
+		f = pattern_file(&patterns[i]);
+
+		/* module set with NULL filter means all functions in a module */
+		if (!filter) {
+			if (!module)
+				goto out_unlock;
+			filter = "*";
+		}
+
+		/* A module that is not loaded yet is given to the kernel as is */
+		if (future && module && !filter_funcs_module(ff, module)) {
+			direct[i] = true;
+			found[f] = true;
+			continue;
+		}
+
+		str = filter_regex(filter, &regex);
+		if (!str)
+			goto out_unlock;
+
+		plen = glob_prefix(filter, regex);
+		if (plen) {
+			mark_glob_funcs(ff, marks, 1 << f, filter, plen, module);
+			free(str);
+			continue;
+		}
+
+		/* Do not touch ret, the exits below must still return 1 */
+		if (add_pattern_group(&groups, &nr_groups, module, f, str) < 0) {
+			free(str);
+			goto out_unlock;
+		}
+		free(str);
+	}
+
+	for (i = 0; i < nr_groups; i++) {
+		if (regcomp(&groups[i].re, groups[i].str, REG_ICASE|REG_NOSUB)) {
+			errno = EINVAL;
+			goto out_unlock;
+		}
+		groups[i].compiled = true;
+	}
+	if (nr_groups)
+		mark_group_funcs(ff, marks, groups, nr_groups);
+
+	for (i = 0; i < ff->nr_funcs; i++) {
+		for (f = 0; f < NR_PATTERN_FILES; f++) {
+			if (marks[i] & (1 << f))
+				found[f] = true;
+		}
+	}
+
+	errno = EINVAL;
+	if (!found[PATTERN_FILTER] && !found[PATTERN_NOTRACE])
+		goto out_unlock;
+
+	for (f = 0; f < NR_PATTERN_FILES; f++) {
+		if (!found[f])
+			continue;
+
+		if (*fds[f] < 0) {
+			path = tracefs_instance_get_file(instance, files[f]);
+			if (!path)
+				goto fail_unlock;
+			*fds[f] = open(path, O_WRONLY | O_CLOEXEC |
+				       (reset ? O_TRUNC : O_APPEND));
+			tracefs_put_tracing_file(path);
+			if (*fds[f] < 0)
+				goto fail_unlock;
+		}
+
+		ret = write_marked_funcs(*fds[f], ff, marks, 1 << f);
+		if (ret < 0)
+			goto out_unlock;
+		if (ret > 0)
+			fallback[f] = true;
+		else
+			started = true;
+
+		if (write_direct_patterns(*fds[f], patterns, nr_patterns, direct, f))
+			goto fail_unlock;
+	}
+
+	pthread_mutex_unlock(&ff->lock);
+
+	/* The regex patterns take the lock of the functions again */
+	for (f = 0; f < NR_PATTERN_FILES; f++) {
+		if (!fallback[f])
+			continue;
+		if (write_patterns(*fds[f], patterns, nr_patterns, direct, f) < 0) {
+			ret = -1;
+			goto out;
+		}
+		started = true;
+	}
+
+	errno = 0;
+	ret = 0;
+	goto out;
+
+ fail_unlock:
+	ret = started ? -1 : 1;
+ out_unlock:
+	pthread_mutex_unlock(&ff->lock);
+ out:
+	for (f = 0; !cont && f < NR_PATTERN_FILES; f++) {
+		if (found[f] && *fds[f] >= 0) {
+			close(*fds[f]);
+			*fds[f] = -1;
+		}
+	}
+	pthread_mutex_unlock(lock);
+
+	free_pattern_groups(groups, nr_groups);
+	free(marks);
+	free(direct);
+
+	return ret;
+}
+
 int write_tracer(int fd, const char *tracer)
 {
 	int ret;
@@ -1063,7 +1900,7 @@ int  tracefs_tracer_clear(struct tracefs_instance *instance)
 	return tracefs_tracer_set(instance, TRACEFS_TRACER_NOP);
 }
 
-static bool splice_safe(int fd, int pfd)
+__hidden bool trace_splice_safe(int fd, int pfd)
 {
 	int ret;
 
@@ -1152,7 +1989,7 @@ ssize_t tracefs_trace_pipe_stream(int fd, struct tracefs_instance *instance,
 	}
 
 	/* Test if the output is splice safe */
-	if (!splice_safe(fd, brass[0])) {
+	if (!trace_splice_safe(fd, brass[0])) {
 		bread = read_trace_pipe(keep_going, in_fd, fd);
 		ret = 0; /* Force return of bread */
 		goto close_all;
@@ -1237,7 +2074,7 @@ void tracefs_trace_pipe_stop(struct tracefs_instance *instance)
 int tracefs_filter_functions(const char *filter, const char *module, char ***list)
 {
 	struct func_filter func_filter;
-	struct func_list *func_list, *f;
+	struct func_list *func_list = NULL, *f;
 	char **funcs = NULL;
 	int ret;
 
@@ -0,0 +1,501 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * A minimal io_uring, with the system calls and without liburing.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "tracefs.h"
+#include "tracefs-local.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct trace_uring {
+	struct io_uring_sqe		*sqes;
+	struct io_uring_cqe		*cqes;
+	unsigned int			*sq_head;
+	unsigned int			*sq_tail;
+	unsigned int			*sq_array;
+	unsigned int			*cq_head;
+	unsigned int			*cq_tail;
+	unsigned int			sq_mask;
+	unsigned int			cq_mask;
+	unsigned int			sq_entries;
+	/* The tail of the entries filled in, not given to the kernel yet */
+	unsigned int			sqe_tail;
+	void				*ring_map;
+	size_t				ring_size;
+	size_t				sqes_size;
+	int				fd;
+};
+
+/* The operations that the users of the ring need */
+static const int uring_ops[] = {
+	IORING_OP_SPLICE,
+	IORING_OP_READ,
+	IORING_OP_WRITE,
+	IORING_OP_READ_FIXED,
+	IORING_OP_WRITE_FIXED,
+	IORING_OP_POLL_ADD,
+	IORING_OP_ASYNC_CANCEL,
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+		       unsigned int flags, void *arg, size_t size)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, arg, size);
+}
+
+static int uring_register(int fd, unsigned int opcode, void *arg,
+			  unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static bool uring_has_ops(int fd)
+{
+	struct io_uring_probe *probe;
+	bool ret = false;
+	size_t size;
+	int i;
+
+	size = sizeof(*probe) + IORING_OP_LAST * sizeof(probe->ops[0]);
+	probe = calloc(1, size);
+	if (!probe)
+		return false;
+
+	if (uring_register(fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0)
+		goto out;
+
+	for (i = 0; i < ARRAY_SIZE(uring_ops); i++) {
+		if (uring_ops[i] > probe->last_op ||
+		    !(probe->ops[uring_ops[i]].flags & IO_URING_OP_SUPPORTED))
+			goto out;
+	}
+	ret = true;
+ out:
+	free(probe);
+	return ret;
+}
+
+static int uring_register_sparse(int fd, unsigned int opcode, int nr)
+{
+	struct io_uring_rsrc_register reg = { };
+
+	reg.nr = nr;
+	reg.flags = IORING_RSRC_REGISTER_SPARSE;
+
+	return uring_register(fd, opcode, &reg, sizeof(reg));
+}
+
+/**
+ * trace_uring_alloc - create an io_uring
+ * @entries: The number of entries of the submission queue
+ * @nr_files: The number of slots for registered files
+ * @nr_buffers: The number of slots for registered buffers
+ *
+ * Returns the ring, or NULL with errno set if the kernel does not have
+ * an io_uring with all that its users need.
+ */
+__hidden struct trace_uring *trace_uring_alloc(unsigned int entries, int nr_files,
+					       int nr_buffers)
+{
+	struct io_uring_params p = { };
+	struct trace_uring *ring;
+	size_t cq_size;
+	void *map;
+	int i;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	ring->ring_map = MAP_FAILED;
+	ring->sqes = MAP_FAILED;
+
+	/* Do not stop at the first request that fails to be submitted */
+	p.flags = IORING_SETUP_CLAMP | IORING_SETUP_SUBMIT_ALL;
+	ring->fd = uring_setup(entries, &p);
+	if (ring->fd < 0)
+		goto error;
+
+	/* The waits with a timeout need EXT_ARG, the rest is older */
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_EXT_ARG) ||
+	    !uring_has_ops(ring->fd)) {
+		errno = EOPNOTSUPP;
+		goto error;
+	}
+
+	if (uring_register_sparse(ring->fd, IORING_REGISTER_FILES2, nr_files) < 0 ||
+	    uring_register_sparse(ring->fd, IORING_REGISTER_BUFFERS2, nr_buffers) < 0)
+		goto error;
+
+	ring->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_size > ring->ring_size)
+		ring->ring_size = cq_size;
+
+	map = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (map == MAP_FAILED)
+		goto error;
+	ring->ring_map = map;
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto error;
+
+	ring->sq_head = map + p.sq_off.head;
+	ring->sq_tail = map + p.sq_off.tail;
+	ring->sq_array = map + p.sq_off.array;
+	ring->sq_mask = *(unsigned int *)(map + p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	ring->cq_head = map + p.cq_off.head;
+	ring->cq_tail = map + p.cq_off.tail;
+	ring->cqes = map + p.cq_off.cqes;
+	ring->cq_mask = *(unsigned int *)(map + p.cq_off.ring_mask);
+	ring->sqe_tail = *ring->sq_tail;
+
+	for (i = 0; i < ring->sq_entries; i++)
+		ring->sq_array[i] = i;
+
+	return ring;
+ error:
+	trace_uring_free(ring);
+	return NULL;
+}
+
+/**
+ * trace_uring_free - free an io_uring
+ * @ring: The ring returned by trace_uring_alloc()
+ *
+ * The requests still in flight are cancelled by the kernel, but buffers
+ * they use must not be freed before they complete.
+ */
+__hidden void trace_uring_free(struct trace_uring *ring)
+{
+	int save_errno = errno;
+
+	if (!ring)
+		return;
+
+	if (ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->ring_map != MAP_FAILED)
+		munmap(ring->ring_map, ring->ring_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	free(ring);
+
+	errno = save_errno;
+}
+
+__hidden int trace_uring_fd(struct trace_uring *ring)
+{
+	return ring->fd;
+}
+
+/* Set the registered file at @slot to @fd */
+__hidden int trace_uring_set_file(struct trace_uring *ring, int slot, int fd)
+{
+	struct io_uring_rsrc_update2 up = { };
+
+	up.offset = slot;
+	up.data = (unsigned long)&fd;
+	up.nr = 1;
+
+	return uring_register(ring->fd, IORING_REGISTER_FILES_UPDATE2,
+			      &up, sizeof(up)) == 1 ? 0 : -1;
+}
+
+/* Set the registered buffer at @slot to @size bytes at @buf */
+__hidden int trace_uring_set_buffer(struct trace_uring *ring, int slot,
+				    void *buf, size_t size)
+{
+	struct io_uring_rsrc_update2 up = { };
+	struct iovec iov;
+	__u64 tag = 0;
+
+	iov.iov_base = buf;
+	iov.iov_len = size;
+	up.offset = slot;
+	up.data = (unsigned long)&iov;
+	up.tags = (unsigned long)&tag;
+	up.nr = 1;
+
+	return uring_register(ring->fd, IORING_REGISTER_BUFFERS_UPDATE,
+			      &up, sizeof(up)) == 1 ? 0 : -1;
+}
+
+static struct io_uring_sqe *get_sqe(struct trace_uring *ring, unsigned long long data)
+{
+	struct io_uring_sqe *sqe;
+
+	/* Make room by submitting what is queued */
+	if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) ==
+	    ring->sq_entries) {
+		if (trace_uring_submit(ring, 0) < 0)
+			return NULL;
+		if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) ==
+		    ring->sq_entries) {
+			errno = EBUSY;
+			return NULL;
+		}
+	}
+
+	sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = data;
+	ring->sqe_tail++;
+
+	return sqe;
+}
+
+static void set_file(struct io_uring_sqe *sqe, int fd, bool fixed)
+{
+	sqe->fd = fd;
+	if (fixed)
+		sqe->flags |= IOSQE_FIXED_FILE;
+}
+
+/*
+ * Queue a splice of @len bytes from @in to @out. If @fixed is set, @in
+ * and @out are slots of registered files.
+ */
+__hidden int trace_uring_splice(struct trace_uring *ring, int in, int out,
+				unsigned int len, bool fixed, unsigned long long data)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(ring, data);
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_SPLICE;
+	set_file(sqe, out, fixed);
+	sqe->splice_fd_in = in;
+	sqe->splice_off_in = -1;
+	sqe->off = -1;
+	sqe->len = len;
+	sqe->splice_flags = SPLICE_F_MOVE;
+	if (fixed)
+		sqe->splice_flags |= SPLICE_F_FD_IN_FIXED;
+
+	return 0;
+}
+
+/*
+ * Queue a read or a write of @len bytes of @buf, that is in the registered
+ * buffer at @buf_slot, or not registered if @buf_slot is negative.
+ */
+__hidden int trace_uring_rw(struct trace_uring *ring, bool write, int fd,
+			    bool fixed, void *buf, unsigned int len,
+			    int buf_slot, unsigned long long data)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(ring, data);
+	if (!sqe)
+		return -1;
+
+	if (buf_slot >= 0) {
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->buf_index = buf_slot;
+	} else {
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	}
+	set_file(sqe, fd, fixed);
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = -1;
+
+	return 0;
+}
+
+/* Queue a wait for one of the poll @events on @fd */
+__hidden int trace_uring_poll(struct trace_uring *ring, int fd, bool fixed,
+			      unsigned int events, unsigned long long data)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(ring, data);
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	set_file(sqe, fd, fixed);
+	sqe->poll32_events = events;
+
+	return 0;
+}
+
+/* Queue the cancellation of all the requests in flight */
+__hidden int trace_uring_cancel(struct trace_uring *ring, unsigned long long data)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(ring, data);
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+
+	return 0;
+}
+
+/**
+ * trace_uring_submit - submit the queued requests, and wait for completions
+ * @ring: The ring returned by trace_uring_alloc()
+ * @timeout: Milliseconds to wait for a completion, 0 to not wait,
+ *	     -1 to wait forever
+ *
+ * Submits everything queued, and waits in the same system call.
+ *
+ * Returns 0 on success, including when @timeout expired or a signal
+ * interrupted the wait, or -1 on error.
+ */
+__hidden int trace_uring_submit(struct trace_uring *ring, int timeout)
+{
+	struct io_uring_getevents_arg arg = { };
+	struct __kernel_timespec ts;
+	unsigned int to_submit;
+	unsigned int flags = 0;
+	int ret;
+
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+	to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (!to_submit && !timeout)
+		return 0;
+
+	if (timeout) {
+		flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+		if (timeout > 0) {
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000;
+			arg.ts = (unsigned long)&ts;
+		}
+	}
+
+	ret = uring_enter(ring->fd, to_submit, timeout ? 1 : 0, flags,
+			  flags ? &arg : NULL, flags ? sizeof(arg) : 0);
+	if (ret < 0 && (errno == ETIME || errno == EINTR))
+		ret = 0;
+
+	return ret < 0 ? -1 : 0;
+}
+
+/**
+ * trace_uring_reap - get a completion
+ * @ring: The ring returned by trace_uring_alloc()
+ * @data: Where to store the data the request was queued with
+ * @res: Where to store the result of the request
+ *
+ * Returns 1 if a completion was taken off the ring, or 0 if there is none.
+ */
+__hidden int trace_uring_reap(struct trace_uring *ring, unsigned long long *data, int *res)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+
+	head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	cqe = &ring->cqes[head & ring->cq_mask];
+	*data = cqe->user_data;
+	*res = cqe->res;
+
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+#else /* !HAVE_IO_URING */
+
+__hidden struct trace_uring *trace_uring_alloc(unsigned int entries, int nr_files,
+					       int nr_buffers)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+__hidden void trace_uring_free(struct trace_uring *ring) { }
+
+__hidden int trace_uring_fd(struct trace_uring *ring)
+{
+	return -1;
+}
+
+__hidden int trace_uring_set_file(struct trace_uring *ring, int slot, int fd)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+__hidden int trace_uring_set_buffer(struct trace_uring *ring, int slot,
+				    void *buf, size_t size)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+__hidden int trace_uring_splice(struct trace_uring *ring, int in, int out,
+				unsigned int len, bool fixed, unsigned long long data)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+__hidden int trace_uring_rw(struct trace_uring *ring, bool write, int fd,
+			    bool fixed, void *buf, unsigned int len,
+			    int buf_slot, unsigned long long data)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+__hidden int trace_uring_poll(struct trace_uring *ring, int fd, bool fixed,
+			      unsigned int events, unsigned long long data)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+__hidden int trace_uring_cancel(struct trace_uring *ring, unsigned long long data)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+__hidden int trace_uring_submit(struct trace_uring *ring, int timeout)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+__hidden int trace_uring_reap(struct trace_uring *ring, unsigned long long *data, int *res)
+{
+	return 0;
+}
+
+#endif /* HAVE_IO_URING */
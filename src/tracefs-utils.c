@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/utsname.h>
 #include <linux/limits.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -216,12 +217,12 @@ void tracefs_put_tracing_file(char *name)
 
 __hidden int str_read_file(const char *file, char **buffer, bool warn)
 {
-	char stbuf[BUFSIZ];
 	char *buf = NULL;
+	size_t alloc = 0;
 	int size = 0;
 	char *nbuf;
 	int fd;
-	int r;
+	int r = -1;
 
 	fd = open(file, O_RDONLY);
 	if (fd < 0) {
@@ -231,19 +232,24 @@ __hidden int str_read_file(const char *file, char **buffer, bool warn)
 	}
 
 	do {
-		r = read(fd, stbuf, BUFSIZ);
-		if (r <= 0)
-			continue;
-		nbuf = realloc(buf, size+r+1);
-		if (!nbuf) {
-			if (warn)
-				tracefs_warning("Failed to allocate file buffer");
-			size = -1;
-			break;
+		/*
+		 * Read straight into the buffer, and double it when full, as
+		 * files like /proc/kallsyms are several megabytes.
+		 */
+		if (size + BUFSIZ + 1 > alloc) {
+			alloc = alloc ? alloc * 2 : BUFSIZ * 2;
+			nbuf = realloc(buf, alloc);
+			if (!nbuf) {
+				if (warn)
+					tracefs_warning("Failed to allocate file buffer");
+				size = -1;
+				break;
+			}
+			buf = nbuf;
 		}
-		buf = nbuf;
-		memcpy(buf+size, stbuf, r);
-		size += r;
+		r = read(fd, buf + size, alloc - size - 1);
+		if (r > 0)
+			size += r;
 	} while (r > 0);
 
 	close(fd);
@@ -256,6 +262,122 @@ __hidden int str_read_file(const char *file, char **buffer, bool warn)
 	return size;
 }
 
+/* FNV-1a, only used to notice that a file changed */
+static unsigned long long hash_str(unsigned long long hash, const char *str, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)str[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/*
+ * Returns a hash of the content of @path, or of only the first word of
+ * each of its lines if @names_only is set. Returns 0 if it can't be read.
+ */
+__hidden unsigned long long trace_hash_file(const char *path, bool names_only)
+{
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	char *line, *save;
+	char *buf;
+	int len;
+
+	len = str_read_file(path, &buf, false);
+	if (len <= 0)
+		return 0;
+
+	if (!names_only) {
+		hash = hash_str(hash, buf, len);
+		goto out;
+	}
+
+	for (line = strtok_r(buf, "\n", &save); line;
+	     line = strtok_r(NULL, "\n", &save))
+		hash = hash_str(hash, line, strcspn(line, " ") + 1);
+ out:
+	free(buf);
+	return hash;
+}
+
+/*
+ * Returns an allocated string that identifies the running kernel: its
+ * release and version, the boot it is running, and the modules that are
+ * loaded (only their names, as the rest of /proc/modules changes while
+ * they are used). It is used to validate the files cached by the library.
+ */
+__hidden char *trace_kernel_id(void)
+{
+	unsigned long long modules_hash;
+	struct utsname uts;
+	char *boot_id = NULL;
+	char *id;
+	int ret;
+
+	if (uname(&uts) < 0)
+		return NULL;
+
+	str_read_file("/proc/sys/kernel/random/boot_id", &boot_id, false);
+	modules_hash = trace_hash_file("/proc/modules", true);
+
+	/* The boot_id file ends with a new line */
+	ret = asprintf(&id, "%s\n%s\n%s%llx", uts.release, uts.version,
+		       boot_id ? : "\n", modules_hash);
+	free(boot_id);
+
+	return ret < 0 ? NULL : id;
+}
+
+/*
+ * Open the directory @path, relative to @dfd (or AT_FDCWD). Opening it
+ * with O_DIRECTORY fails if it is not a directory, so there is no need
+ * to stat it first.
+ */
+__hidden DIR *trace_opendir_at(int dfd, const char *path)
+{
+	DIR *dir;
+	int fd;
+
+	fd = openat(dfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	dir = fdopendir(fd);
+	if (!dir)
+		close(fd);
+
+	return dir;
+}
+
+/*
+ * Returns true if @dent, read from @dir, is a directory. The type that
+ * readdir() returns is used when the file system gives it, and symbolic
+ * links are followed.
+ */
+__hidden bool trace_dirent_is_dir(DIR *dir, struct dirent *dent)
+{
+	struct stat st;
+
+	if (dent->d_type != DT_UNKNOWN && dent->d_type != DT_LNK)
+		return dent->d_type == DT_DIR;
+
+	return fstatat(dirfd(dir), dent->d_name, &st, 0) == 0 &&
+		S_ISDIR(st.st_mode);
+}
+
+/* Returns true if the directory @dent, read from @dir, has @file */
+__hidden bool trace_dirent_has_file(DIR *dir, struct dirent *dent, const char *file)
+{
+	char path[NAME_MAX * 2 + 2];
+
+	if (snprintf(path, sizeof(path), "%s/%s", dent->d_name, file) >= sizeof(path))
+		return false;
+
+	return faccessat(dirfd(dir), path, F_OK, 0) == 0;
+}
+
 /**
  * tracefs_error_all - return the content of the error log
  * @instance: The instance to read the error log from (NULL for top level)
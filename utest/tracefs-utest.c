@@ -11,6 +11,7 @@
 #include <time.h>
 #include <dirent.h>
 #include <ftw.h>
+#include <errno.h>
 
 #include <CUnit/CUnit.h>
 #include <CUnit/Basic.h>
@@ -206,6 +207,205 @@ static void test_iter_raw_events(void)
 	test_instance_iter_raw_events(test_instance);
 }
 
+static int test_unordered_callback(struct tep_event *event, struct tep_record *record,
+				   int cpu, void *context)
+{
+	struct tep_format_field *field;
+	struct test_sample *sample;
+	int *found = context;
+
+	CU_TEST(cpu == record->cpu);
+
+	field = tep_find_field(event, "buf");
+	if (field) {
+		sample = ((struct test_sample *)(record->data + field->offset));
+		if (sample->cpu == cpu)
+			__atomic_add_fetch(found, 1, __ATOMIC_RELAXED);
+	}
+
+	return 0;
+}
+
+static void test_instance_iter_raw_events_parallel(struct tracefs_instance *instance)
+{
+	int found = 0;
+	int ret;
+
+	ret = tracefs_iterate_raw_events_parallel(NULL, instance, NULL, 0, 0,
+						  test_callback, NULL);
+	CU_TEST(ret < 0);
+	ret = tracefs_iterate_raw_events_parallel(test_tep, instance, NULL, 0, 0,
+						  NULL, NULL);
+	CU_TEST(ret < 0);
+
+	test_found = 0;
+	last_ts = 0;
+	test_iter_write(instance);
+	ret = tracefs_iterate_raw_events_parallel(test_tep, instance, NULL, 0, 0,
+						  test_callback, NULL);
+	CU_TEST(ret == 0);
+	CU_TEST(test_found == TEST_ARRAY_SIZE);
+
+	test_iter_write(instance);
+	ret = tracefs_iterate_raw_events_parallel(test_tep, instance, NULL, 0,
+						  TRACEFS_ITERATE_UNORDERED,
+						  test_unordered_callback, &found);
+	CU_TEST(ret == 0);
+	CU_TEST(found == TEST_ARRAY_SIZE);
+}
+
+static void test_iter_raw_events_parallel(void)
+{
+	test_instance_iter_raw_events_parallel(test_instance);
+}
+
+static int test_batch_callback(struct tep_event **events, struct tep_record *records,
+			       int nr, void *context)
+{
+	int *max = context;
+	int i;
+
+	CU_TEST(nr > 0 && nr <= *max);
+	for (i = 0; i < nr; i++)
+		test_callback(events[i], &records[i], records[i].cpu, NULL);
+
+	return 0;
+}
+
+static void test_instance_iter_raw_events_batch(struct tracefs_instance *instance)
+{
+	int batch_size = 16;
+	int ret;
+
+	ret = tracefs_iterate_raw_events_batch(NULL, instance, NULL, 0, batch_size,
+					       test_batch_callback, &batch_size);
+	CU_TEST(ret < 0);
+	ret = tracefs_iterate_raw_events_batch(test_tep, instance, NULL, 0, 0,
+					       test_batch_callback, &batch_size);
+	CU_TEST(ret < 0);
+	ret = tracefs_iterate_raw_events_batch(test_tep, instance, NULL, 0, batch_size,
+					       NULL, NULL);
+	CU_TEST(ret < 0);
+
+	test_found = 0;
+	last_ts = 0;
+	test_iter_write(instance);
+	ret = tracefs_iterate_raw_events_batch(test_tep, instance, NULL, 0, batch_size,
+					       test_batch_callback, &batch_size);
+	CU_TEST(ret == 0);
+	CU_TEST(test_found == TEST_ARRAY_SIZE);
+}
+
+static void test_iter_raw_events_batch(void)
+{
+	test_instance_iter_raw_events_batch(test_instance);
+}
+
+static void test_instance_iterator(struct tracefs_instance *instance)
+{
+	struct tracefs_iterator *iter;
+	int ret;
+
+	iter = tracefs_iterator_open(NULL, instance, NULL, 0);
+	CU_TEST(iter == NULL);
+
+	iter = tracefs_iterator_open(test_tep, instance, NULL, 0);
+	CU_TEST(iter != NULL);
+	if (!iter)
+		return;
+	CU_TEST(tracefs_iterator_fd(iter) >= 0);
+	CU_TEST(tracefs_iterator_set_watermark(iter, 101) < 0);
+	CU_TEST(tracefs_iterator_set_watermark(iter, 0) == 0);
+	CU_TEST(tracefs_iterator_read(iter, 0, NULL, NULL) < 0);
+
+	/* Drain anything left over by other tests */
+	while (tracefs_iterator_read(iter, 0, test_callback, NULL) > 0)
+		;
+
+	test_found = 0;
+	last_ts = 0;
+	test_iter_write(instance);
+	do {
+		ret = tracefs_iterator_read(iter, 100, test_callback, NULL);
+		CU_TEST(ret >= 0);
+	} while (ret > 0 && test_found < TEST_ARRAY_SIZE);
+	CU_TEST(test_found == TEST_ARRAY_SIZE);
+
+	tracefs_iterator_close(iter);
+}
+
+static void test_iterator(void)
+{
+	test_instance_iterator(test_instance);
+}
+
+static void test_instance_cpu_reader(struct tracefs_instance *instance)
+{
+	int cpus = sysconf(_SC_NPROCESSORS_CONF);
+	struct tracefs_cpu_reader *reader;
+	int ret;
+	int i;
+
+	reader = tracefs_cpu_reader_open(instance, -1, true);
+	CU_TEST(reader == NULL);
+
+	test_found = 0;
+	test_iter_write(instance);
+	for (i = 0; i < cpus; i++) {
+		reader = tracefs_cpu_reader_open(instance, i, true);
+		if (!reader)
+			continue;
+		CU_TEST(tracefs_cpu_reader_fd(reader) >= 0);
+		CU_TEST(tracefs_cpu_reader_read(reader, NULL, test_callback, &i) < 0);
+		last_ts = 0;
+		ret = tracefs_cpu_reader_read(reader, test_tep, test_callback, &i);
+		CU_TEST(ret >= 0);
+		/* Nothing is left to read */
+		ret = tracefs_cpu_reader_read(reader, test_tep, test_callback, &i);
+		CU_TEST(ret == 0);
+		tracefs_cpu_reader_close(reader);
+	}
+	CU_TEST(test_found == TEST_ARRAY_SIZE);
+}
+
+static void test_cpu_reader(void)
+{
+	test_instance_cpu_reader(test_instance);
+}
+
+static void test_instance_follow_event(struct tracefs_instance *instance)
+{
+	int ret;
+
+	ret = tracefs_follow_event(test_tep, instance, "ftrace", "no_such_event",
+				   test_callback, NULL);
+	CU_TEST(ret < 0);
+	ret = tracefs_follow_event(test_tep, instance, "ftrace", "print",
+				   NULL, NULL);
+	CU_TEST(ret < 0);
+	ret = tracefs_follow_event(test_tep, instance, "ftrace", "print",
+				   test_callback, NULL);
+	CU_TEST(ret == 0);
+
+	test_found = 0;
+	last_ts = 0;
+	test_iter_write(instance);
+	ret = tracefs_iterate_raw_events(test_tep, instance, NULL, 0, NULL, NULL);
+	CU_TEST(ret == 0);
+	CU_TEST(test_found == TEST_ARRAY_SIZE);
+
+	CU_TEST(tracefs_follow_event_clear(instance, "sched", NULL) < 0);
+	CU_TEST(tracefs_follow_event_clear(instance, NULL, "print") == 0);
+	CU_TEST(tracefs_follow_event_clear(instance, NULL, NULL) < 0);
+	ret = tracefs_iterate_raw_events(test_tep, instance, NULL, 0, NULL, NULL);
+	CU_TEST(ret < 0);
+}
+
+static void test_follow_event(void)
+{
+	test_instance_follow_event(test_instance);
+}
+
 #define RAND_STR_SIZE 20
 #define RAND_ASCII "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"
 static const char *get_rand_str(void)
@@ -338,6 +538,82 @@ static void test_ftrace_marker(void)
 	test_instance_ftrace_marker(test_instance);
 }
 
+#define MARKER_SCHEMA_ID	0x7e57
+struct schema_find {
+	struct tracefs_marker_schema	*schema;
+	const char			*path;
+	int				count;
+};
+
+static int test_schema_callback(struct tep_event *event, struct tep_record *record,
+				int cpu, void *context)
+{
+	struct schema_find *walk = context;
+	unsigned long long val;
+	const char *str;
+
+	if (tracefs_marker_schema_find(test_tep, record) != walk->schema)
+		return 0;
+
+	if (tracefs_marker_schema_read(walk->schema, test_tep, record, "seq", &val) ||
+	    val != walk->count)
+		return 0;
+	if (tracefs_marker_schema_read(walk->schema, test_tep, record, "delta", &val) ||
+	    (long long)val != -walk->count)
+		return 0;
+	if (tracefs_marker_schema_read_string(walk->schema, test_tep, record,
+					      "path", &str) != strlen(walk->path) ||
+	    strncmp(str, walk->path, strlen(walk->path)))
+		return 0;
+
+	walk->count++;
+
+	return 0;
+}
+
+static void test_instance_marker_schema(struct tracefs_instance *instance)
+{
+	struct tracefs_marker_schema *schema;
+	struct schema_find walk;
+	long long i;
+	int ret;
+
+	schema = tracefs_marker_schema_alloc(MARKER_SCHEMA_ID, "utest");
+	CU_TEST(schema != NULL);
+	if (!schema)
+		return;
+	CU_TEST(tracefs_marker_schema_alloc(MARKER_SCHEMA_ID, "dup") == NULL);
+	CU_TEST(errno == EEXIST);
+
+	CU_TEST(tracefs_marker_schema_add_field(schema, "seq", TRACEFS_MARKER_U64, 0) == 0);
+	CU_TEST(tracefs_marker_schema_add_field(schema, "delta", TRACEFS_MARKER_S32, 0) == 0);
+	CU_TEST(tracefs_marker_schema_add_field(schema, "path", TRACEFS_MARKER_STRING, 16) == 0);
+	CU_TEST(tracefs_marker_schema_add_field(schema, "seq", TRACEFS_MARKER_U8, 0) == -1);
+	/* The kernel takes at most 3K from a raw marker write */
+	CU_TEST(tracefs_marker_schema_add_field(schema, "big", TRACEFS_MARKER_STRING, 3072) == -1);
+	CU_TEST(errno == EINVAL);
+
+	CU_TEST(tracefs_instance_file_clear(instance, "trace") == 0);
+	for (i = 0; i < MARKERS_WRITE_COUNT; i++)
+		CU_TEST(tracefs_marker_schema_write(instance, schema, i, (int)-i, "/utest") == 0);
+
+	walk.schema = schema;
+	walk.path = "/utest";
+	walk.count = 0;
+	ret = tracefs_iterate_raw_events(test_tep, instance, NULL, 0,
+					 test_schema_callback, &walk);
+	CU_TEST(ret == 0);
+	CU_TEST(walk.count == MARKERS_WRITE_COUNT);
+
+	tracefs_binary_close(instance);
+	tracefs_marker_schema_free(schema);
+}
+
+static void test_marker_schema(void)
+{
+	test_instance_marker_schema(test_instance);
+}
+
 static void test_instance_trace_sql(struct tracefs_instance *instance)
 {
 	struct tracefs_synth *synth;
@@ -706,6 +982,15 @@ static void test_instance_file(void)
 	CU_TEST(tracefs_file_exists(instance, PER_CPU) == false);
 	CU_TEST(tracefs_dir_exists(instance, PER_CPU) == true);
 
+	/* These keep tracing_on open, it must not prevent the destroy */
+	CU_TEST(tracefs_instance_file_cache_init(instance) == 0);
+	for (i = 0; i < 10; i++) {
+		CU_TEST(tracefs_trace_off(instance) == 0);
+		CU_TEST(tracefs_trace_is_on(instance) == 0);
+		CU_TEST(tracefs_trace_on(instance) == 0);
+		CU_TEST(tracefs_trace_is_on(instance) == 1);
+	}
+
 	CU_TEST(tracefs_instance_destroy(NULL) != 0);
 	CU_TEST(tracefs_instance_destroy(instance) == 0);
 	CU_TEST(tracefs_instance_destroy(instance) != 0);
@@ -862,6 +1147,67 @@ static void test_tracing_onoff(void)
 	test_instance_tracing_onoff(test_instance);
 }
 
+static void test_instance_config(struct tracefs_instance *instance)
+{
+	struct tracefs_config *config;
+	long long on;
+	char *clock;
+	char *buf;
+
+	CU_TEST(tracefs_trace_on(instance) == 0);
+	clock = tracefs_get_clock(instance);
+	CU_TEST(clock != NULL);
+	if (!clock)
+		return;
+
+	/* A failed write undoes the ones before it */
+	config = tracefs_config_alloc(instance);
+	CU_TEST(config != NULL);
+	if (!config)
+		goto out;
+	CU_TEST(tracefs_config_write(config, "tracing_on", "0") == 0);
+	CU_TEST(tracefs_config_set_clock(config, "local") == 0);
+	CU_TEST(tracefs_config_event_enable(config, "sched", NULL) == 0);
+	CU_TEST(tracefs_config_write(config, "no_such_file", "1") == 0);
+	CU_TEST(tracefs_config_apply(config) == -1);
+	tracefs_config_free(config);
+
+	CU_TEST(tracefs_trace_is_on(instance) == 1);
+	buf = tracefs_get_clock(instance);
+	CU_TEST(buf && strcmp(buf, clock) == 0);
+	free(buf);
+	buf = tracefs_instance_file_read(instance, "events/sched/enable", NULL);
+	CU_TEST(buf && buf[0] == '0');
+	free(buf);
+
+	config = tracefs_config_alloc(instance);
+	CU_TEST(config != NULL);
+	if (!config)
+		goto out;
+	CU_TEST(tracefs_config_write(config, "tracing_on", "0") == 0);
+	CU_TEST(tracefs_config_set_clock(config, "local") == 0);
+	CU_TEST(tracefs_config_event_enable(config, "sched", NULL) == 0);
+	CU_TEST(tracefs_config_apply(config) == 0);
+	tracefs_config_free(config);
+
+	CU_TEST(tracefs_instance_file_read_number(instance, "tracing_on", &on) == 0);
+	CU_TEST(on == 0);
+	buf = tracefs_get_clock(instance);
+	CU_TEST(buf && strcmp(buf, "local") == 0);
+	free(buf);
+
+	CU_TEST(tracefs_event_disable(instance, "sched", NULL) == 0);
+	CU_TEST(tracefs_instance_file_write(instance, "trace_clock", clock) > 0);
+	CU_TEST(tracefs_trace_on(instance) == 0);
+ out:
+	free(clock);
+}
+
+static void test_config(void)
+{
+	test_instance_config(test_instance);
+}
+
 static bool check_option(struct tracefs_instance *instance,
 			 enum tracefs_option_id id, bool exist, int enabled)
 {
@@ -1183,6 +1529,189 @@ static void test_local_events(void)
 	local_events(tdir);
 }
 
+static void test_local_events_cached(void)
+{
+	char template[] = TEST_TRACE_DIR;
+	char *dname = mkdtemp(template);
+	struct tep_handle *tep;
+	char cache[PATH_MAX];
+	struct stat st;
+	char **systems;
+	int i;
+
+	CU_TEST(dname != NULL);
+	if (!dname)
+		return;
+	snprintf(cache, PATH_MAX, "%s/events.cache", dname);
+
+	systems = tracefs_event_systems(NULL);
+	CU_TEST(systems != NULL);
+
+	/* The first one creates the cache, the second one loads it */
+	tep = tracefs_local_events_cached(NULL, cache);
+	CU_TEST(tep != NULL);
+	tep_free(tep);
+	CU_TEST(stat(cache, &st) == 0 && st.st_size > 0);
+
+	tep = tracefs_local_events_cached(NULL, cache);
+	CU_TEST(tep != NULL);
+	for (i = 0; systems && systems[i]; i++)
+		test_check_events(tep, systems[i], true);
+	tep_free(tep);
+
+	/* A corrupted cache is ignored and rewritten */
+	CU_TEST(truncate(cache, st.st_size / 2) == 0);
+	tep = tracefs_local_events_cached(NULL, cache);
+	CU_TEST(tep != NULL);
+	for (i = 0; systems && systems[i]; i++)
+		test_check_events(tep, systems[i], true);
+	tep_free(tep);
+	CU_TEST(stat(cache, &st) == 0 && st.st_size > 0);
+
+	tracefs_list_free(systems);
+	unlink(cache);
+	rmdir(dname);
+}
+
+static void test_kallsyms(void)
+{
+	unsigned long long addr = 0;
+	unsigned long long start;
+	struct tep_handle *tep;
+	const char *name;
+	char line[BUFSIZ];
+	char sym[BUFSIZ];
+	char type;
+	FILE *fp;
+
+	fp = fopen("/proc/kallsyms", "r");
+	CU_TEST(fp != NULL);
+	if (!fp)
+		return;
+	while (fgets(line, BUFSIZ, fp)) {
+		if (sscanf(line, "%llx %c %s", &start, &type, sym) == 3 &&
+		    strcmp(sym, "schedule") == 0) {
+			addr = start;
+			break;
+		}
+	}
+	fclose(fp);
+
+	/* The addresses are hidden to non root users */
+	if (!addr)
+		return;
+
+	tep = tracefs_local_events(NULL);
+	CU_TEST(tep != NULL);
+	if (!tep)
+		return;
+
+	name = tep_find_function(tep, addr + 1);
+	CU_TEST(name != NULL && strcmp(name, "schedule") == 0);
+	CU_TEST(tep_find_function_address(tep, addr + 1) == addr);
+
+	/* Too late, the symbols are loaded */
+	CU_TEST(tracefs_kallsyms_set_cache("/tmp/kallsyms.cache") < 0);
+
+	tep_free(tep);
+}
+
+struct lazy_marker_find {
+	struct tep_handle	*tep;
+	int			count;
+};
+
+static int lazy_marker_callback(struct tep_event *event, struct tep_record *record,
+				int cpu, void *context)
+{
+	struct lazy_marker_find *find = context;
+
+	/* The event was loaded from its id in the record */
+	if (tep_data_type(find->tep, record) == event->id &&
+	    strcmp(event->system, "ftrace") == 0 &&
+	    strcmp(event->name, "print") == 0)
+		find->count++;
+
+	return 0;
+}
+
+static void test_lazy_events_iterate(void)
+{
+	struct lazy_marker_find find = { .count = 0 };
+	struct tracefs_lazy_events *lazy;
+	struct tep_handle *tep;
+	int ret;
+	int i;
+
+	CU_TEST(tracefs_trace_on(test_instance) == 0);
+	for (i = 0; i < MARKERS_WRITE_COUNT; i++)
+		CU_TEST(tracefs_printf(test_instance, "Lazy marker %d", i) == 0);
+	tracefs_print_close(test_instance);
+
+	/* No event is looked up before the iteration */
+	tep = tep_alloc();
+	CU_TEST(tep != NULL);
+	lazy = tracefs_lazy_events_alloc(NULL, tep);
+	CU_TEST(lazy != NULL);
+	if (!lazy)
+		goto out;
+
+	find.tep = tep;
+	ret = tracefs_iterate_raw_events(tep, test_instance, NULL, 0,
+					 lazy_marker_callback, &find);
+	CU_TEST(ret == 0);
+	CU_TEST(find.count >= MARKERS_WRITE_COUNT);
+
+	tracefs_lazy_events_free(lazy);
+ out:
+	tep_free(tep);
+}
+
+static void test_lazy_events(void)
+{
+	struct tracefs_lazy_events *lazy;
+	struct tep_event *event;
+	struct tep_handle *tep;
+	char *id;
+
+	tep = tep_alloc();
+	CU_TEST(tep != NULL);
+	lazy = tracefs_lazy_events_alloc(NULL, tep);
+	CU_TEST(lazy != NULL);
+	if (!lazy)
+		goto out;
+
+	/* Only one lazy loader per tep */
+	CU_TEST(tracefs_lazy_events_alloc(NULL, tep) == NULL);
+
+	CU_TEST(tep_find_event_by_name(tep, "sched", "sched_switch") == NULL);
+	event = tracefs_lazy_find_event_by_name(lazy, "sched", "sched_switch");
+	CU_TEST(event != NULL);
+	if (event) {
+		CU_TEST(strcmp(event->name, "sched_switch") == 0);
+		CU_TEST(tep_find_event(tep, event->id) == event);
+	}
+
+	/* Loaded by its id only */
+	id = tracefs_event_file_read(NULL, "sched", "sched_wakeup", "id", NULL);
+	CU_TEST(id != NULL);
+	if (id) {
+		CU_TEST(tep_find_event(tep, atoi(id)) == NULL);
+		event = tracefs_lazy_find_event(lazy, atoi(id));
+		CU_TEST(event != NULL);
+		if (event)
+			CU_TEST(strcmp(event->name, "sched_wakeup") == 0);
+		free(id);
+	}
+
+	CU_TEST(tracefs_lazy_find_event(lazy, 1 << 30) == NULL);
+	CU_TEST(tracefs_lazy_find_event_by_name(lazy, "sched", "no_such_event") == NULL);
+
+	tracefs_lazy_events_free(lazy);
+ out:
+	tep_free(tep);
+}
+
 struct test_walk_instance {
 	struct tracefs_instance *instance;
 	bool found;
@@ -1264,6 +1793,99 @@ static void test_get_clock(void)
 	test_instance_get_clock(test_instance);
 }
 
+static void clear_function_filters(struct tracefs_instance *instance)
+{
+	CU_TEST(tracefs_function_filter(instance, NULL, NULL, TRACEFS_FL_RESET) == 0);
+	CU_TEST(tracefs_function_notrace(instance, NULL, NULL, TRACEFS_FL_RESET) == 0);
+}
+
+/* An empty file is read as NULL */
+static void read_function_filters(struct tracefs_instance *instance,
+				  char **filter, char **notrace)
+{
+	*filter = tracefs_instance_file_read(instance, "set_ftrace_filter", NULL);
+	*notrace = tracefs_instance_file_read(instance, "set_ftrace_notrace", NULL);
+}
+
+static bool same_content(const char *a, const char *b)
+{
+	if (!a || !b)
+		return a == b;
+	return strcmp(a, b) == 0;
+}
+
+static void test_instance_function_filter_patterns(struct tracefs_instance *instance)
+{
+	const struct tracefs_function_pattern patterns[] = {
+		{ .filter = "schedule" },
+		{ .filter = "vfs_*" },
+		{ .filter = "^kfree.*$" },
+		{ .filter = "^do_sys_open.*", .notrace = true },
+	};
+	/* The regex is grouped before the invalid one is compiled */
+	const struct tracefs_function_pattern invalid[] = {
+		{ .filter = "^kfree.*$" },
+		{ .filter = "sched_[a-" },
+	};
+	const struct tracefs_function_pattern nomatch[] = {
+		{ .filter = "^no_such_function_[0-9]$" },
+		{ .filter = "no_such_function_*", .notrace = true },
+	};
+	char *filter, *notrace;
+	char *exp_filter, *exp_notrace;
+
+	if (!tracefs_file_exists(instance, "set_ftrace_filter"))
+		return;
+
+	/* What setting the patterns one by one does */
+	clear_function_filters(instance);
+	CU_TEST(tracefs_function_filter(instance, patterns[0].filter, NULL,
+					TRACEFS_FL_CONTINUE) == 0);
+	CU_TEST(tracefs_function_filter(instance, patterns[1].filter, NULL,
+					TRACEFS_FL_CONTINUE) == 0);
+	CU_TEST(tracefs_function_filter(instance, patterns[2].filter, NULL, 0) == 0);
+	CU_TEST(tracefs_function_notrace(instance, patterns[3].filter, NULL, 0) == 0);
+	read_function_filters(instance, &exp_filter, &exp_notrace);
+
+	clear_function_filters(instance);
+	CU_TEST(tracefs_function_filter_patterns(instance, patterns, 4, 0) == 0);
+	read_function_filters(instance, &filter, &notrace);
+	CU_TEST(exp_filter != NULL);
+	CU_TEST(same_content(filter, exp_filter));
+	CU_TEST(same_content(notrace, exp_notrace));
+	free(filter);
+	free(notrace);
+	free(exp_filter);
+	free(exp_notrace);
+
+	/* Errors that happen before writing anything return 1 */
+	clear_function_filters(instance);
+	CU_TEST(tracefs_function_filter(instance, invalid[1].filter, NULL, 0) == 1);
+	CU_TEST(tracefs_function_filter(instance, nomatch[0].filter, NULL, 0) == 1);
+	CU_TEST(tracefs_function_notrace(instance, nomatch[1].filter, NULL, 0) == 1);
+
+	errno = 0;
+	CU_TEST(tracefs_function_filter_patterns(instance, invalid, 2, 0) == 1);
+	CU_TEST(errno == EINVAL);
+	errno = 0;
+	CU_TEST(tracefs_function_filter_patterns(instance, nomatch, 2, 0) == 1);
+	CU_TEST(errno == EINVAL);
+
+	/* And nothing was written */
+	read_function_filters(instance, &filter, &notrace);
+	CU_TEST(!filter || strstr(filter, "all functions enabled") != NULL);
+	CU_TEST(notrace == NULL);
+	free(filter);
+	free(notrace);
+
+	clear_function_filters(instance);
+}
+
+static void test_function_filter_patterns(void)
+{
+	test_instance_function_filter_patterns(test_instance);
+}
+
 static void copy_trace_file(const char *from, char *to)
 {
 	int fd_from = -1;
@@ -1383,6 +2005,156 @@ static void test_custom_trace_dir(void)
 	free(dname);
 }
 
+static void test_instance_recorder(struct tracefs_instance *instance)
+{
+	char template[] = TEST_TRACE_DIR;
+	struct tracefs_instance *offline;
+	struct tracefs_recorder *rec;
+	char *dname = mkdtemp(template);
+	char file[PATH_MAX];
+	ssize_t size = 0;
+	ssize_t ret;
+
+	CU_TEST(dname != NULL);
+	if (!dname)
+		return;
+
+	rec = tracefs_recorder_open(instance, NULL, 0, NULL, 0);
+	CU_TEST(rec == NULL);
+
+	/* Drop anything left over by other tests */
+	tracefs_iterate_raw_events(test_tep, instance, NULL, 0, test_callback, NULL);
+
+	rec = tracefs_recorder_open(instance, NULL, 0, dname, 0);
+	CU_TEST(rec != NULL);
+	if (!rec)
+		goto out;
+	CU_TEST(tracefs_recorder_fd(rec) >= 0);
+
+	test_iter_write(instance);
+	do {
+		ret = tracefs_recorder_read(rec, 0);
+		CU_TEST(ret >= 0);
+		size += ret;
+	} while (ret > 0);
+	ret = tracefs_recorder_flush(rec);
+	CU_TEST(ret >= 0);
+	size += ret;
+	CU_TEST(size > 0);
+	tracefs_recorder_close(rec);
+
+	/* The recording is read like the buffers it was recorded from */
+	offline = tracefs_instance_alloc(dname, NULL);
+	CU_TEST(offline != NULL);
+	test_found = 0;
+	last_ts = 0;
+	ret = tracefs_iterate_raw_events(test_tep, offline, NULL, 0, test_callback, NULL);
+	CU_TEST(ret == 0);
+	CU_TEST(test_found == TEST_ARRAY_SIZE);
+	tracefs_instance_free(offline);
+	del_trace_dir(dname);
+
+	/* Record all the CPUs into a single file */
+	strcpy(template, TEST_TRACE_DIR);
+	dname = mkdtemp(template);
+	CU_TEST(dname != NULL);
+	if (!dname)
+		return;
+	snprintf(file, PATH_MAX, "%s/trace.dat", dname);
+	rec = tracefs_recorder_open(instance, NULL, 0, file, TRACEFS_RECORD_MULTIPLEX);
+	CU_TEST(rec != NULL);
+	if (!rec)
+		goto out;
+	test_iter_write(instance);
+	CU_TEST(tracefs_recorder_flush(rec) > 0);
+	tracefs_recorder_close(rec);
+
+	test_found = 0;
+	last_ts = 0;
+	ret = tracefs_iterate_raw_file(test_tep, file, NULL, 0, test_callback, NULL);
+	CU_TEST(ret == 0);
+	CU_TEST(test_found == TEST_ARRAY_SIZE);
+	ret = tracefs_iterate_raw_file(test_tep, file, NULL, 0, NULL, NULL);
+	CU_TEST(ret < 0);
+ out:
+	del_trace_dir(dname);
+}
+
+static void test_recorder(void)
+{
+	test_instance_recorder(test_instance);
+}
+
+static void test_instance_streamer(struct tracefs_instance *instance, bool uring)
+{
+	struct tracefs_streamer_stat stat;
+	struct tracefs_streamer *streamer;
+	const char *string = get_rand_str();
+	char buf[BUFSIZ];
+	ssize_t size = 0;
+	ssize_t ret;
+	int fds[2];
+	int tries;
+	int i;
+
+	CU_TEST(pipe(fds) == 0);
+	CU_TEST(fcntl(fds[1], F_SETFL, O_NONBLOCK) == 0);
+
+	streamer = tracefs_streamer_alloc();
+	CU_TEST(streamer != NULL);
+	if (!streamer)
+		goto out;
+	CU_TEST(tracefs_streamer_fd(streamer) >= 0);
+	CU_TEST(tracefs_streamer_set_sizes(streamer, -1, 0, 0) < 0);
+	CU_TEST(tracefs_streamer_set_sizes(streamer, 0, 0, TRACEFS_STREAM_ADAPTIVE) == 0);
+	/* Without io_uring, the streamer keeps using epoll */
+	if (uring && tracefs_streamer_use_uring(streamer) < 0)
+		CU_TEST(errno != EBUSY && errno != EINVAL);
+	CU_TEST(tracefs_streamer_add(streamer, instance, -1) < 0);
+	i = tracefs_streamer_add(streamer, instance, fds[1]);
+	CU_TEST(i == 0);
+	if (uring)
+		CU_TEST(tracefs_streamer_use_uring(streamer) == 0 || errno == EBUSY);
+	CU_TEST(tracefs_streamer_stat(streamer, i + 1, &stat) < 0);
+
+	/* Drop anything left over by other tests */
+	CU_TEST(tracefs_instance_file_clear(instance, "trace") == 0);
+	CU_TEST(tracefs_printf(instance, "Streamer test: %s", string) == 0);
+
+	for (tries = 0; tries < 10 && !size; tries++) {
+		ret = tracefs_streamer_read(streamer, 100);
+		CU_TEST(ret >= 0);
+		size += ret;
+	}
+	CU_TEST(size > 0);
+
+	CU_TEST(tracefs_streamer_stat(streamer, i, &stat) == 0);
+	CU_TEST(stat.bytes == size);
+	CU_TEST(!stat.stopped);
+	CU_TEST(stat.pipe_size > 0);
+
+	ret = read(fds[0], buf, sizeof(buf) - 1);
+	CU_TEST(ret == size);
+	if (ret > 0) {
+		buf[ret] = '\0';
+		CU_TEST(strstr(buf, string) != NULL);
+	}
+
+	/* A stop before the run makes it return right away */
+	tracefs_streamer_stop(streamer);
+	CU_TEST(tracefs_streamer_run(streamer) >= 0);
+	tracefs_streamer_free(streamer);
+ out:
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void test_streamer(void)
+{
+	test_instance_streamer(test_instance, false);
+	test_instance_streamer(test_instance, true);
+}
+
 static int test_suite_destroy(void)
 {
 	tracefs_instance_destroy(test_instance);
@@ -1426,20 +2198,48 @@ void test_tracefs_lib(void)
 		    test_system_event);
 	CU_add_test(suite, "tracefs_iterate_raw_events API",
 		    test_iter_raw_events);
+	CU_add_test(suite, "tracefs_iterate_raw_events_parallel API",
+		    test_iter_raw_events_parallel);
+	CU_add_test(suite, "tracefs_iterate_raw_events_batch API",
+		    test_iter_raw_events_batch);
+	CU_add_test(suite, "tracefs_iterator API",
+		    test_iterator);
+	CU_add_test(suite, "tracefs_cpu_reader API",
+		    test_cpu_reader);
+	CU_add_test(suite, "tracefs_follow_event API",
+		    test_follow_event);
+	CU_add_test(suite, "tracefs_recorder API",
+		    test_recorder);
+	CU_add_test(suite, "tracefs_streamer API",
+		    test_streamer);
 	CU_add_test(suite, "tracefs_tracers API",
 		    test_tracers);
 	CU_add_test(suite, "tracefs_local events API",
 		    test_local_events);
+	CU_add_test(suite, "tracefs_local_events_cached API",
+		    test_local_events_cached);
+	CU_add_test(suite, "tracefs_lazy_events API",
+		    test_lazy_events);
+	CU_add_test(suite, "tracefs_lazy_events iterate",
+		    test_lazy_events_iterate);
+	CU_add_test(suite, "kallsyms",
+		    test_kallsyms);
 	CU_add_test(suite, "tracefs_instances_walk API",
 		    test_instances_walk);
 	CU_add_test(suite, "tracefs_get_clock API",
 		    test_get_clock);
+	CU_add_test(suite, "tracefs_function_filter_patterns API",
+		    test_function_filter_patterns);
 	CU_add_test(suite, "tracing on / off",
 		    test_tracing_onoff);
+	CU_add_test(suite, "tracefs_config API",
+		    test_config);
 	CU_add_test(suite, "tracing options",
 		    test_tracing_options);
 	CU_add_test(suite, "custom system directory",
 		    test_custom_trace_dir);
 	CU_add_test(suite, "ftrace marker",
 		    test_ftrace_marker);
+	CU_add_test(suite, "marker schema",
+		    test_marker_schema);
 }